@@ -13,12 +13,90 @@
 #define SHM_MIN_MEM_MB 256
 #define SHM_MAX_KEY_NUM 10000
 #define SHM_MAX_KEY_SIZE 128
+#define SHM_KEY_PREFIX_SIZE 8u
+// key + value bytes a hash entry holds itself, 80 makes the entry three cache lines
+#define SHM_INLINE_SIZE 80u
 #define SHM_MAX_VAL_SIZE 32 * 1024 * 1024
 #define SHM_HT_SEGMENT_ID 1
+#define SHM_MAX_SHARDS 64
+#define SHM_MAX_PROCESSES 256
 
 #define SHM_TRYLOCK_INTERVAL 100
 #define SHM_TRYLOCK_TICKS 1000
 
+#define SHM_LOCK_TYPE_MUTEX 0
+#define SHM_LOCK_TYPE_RWLOCK 1
+#define SHM_LOCK_TYPE_FUTEX 2
+#define SHM_LOCK_TYPE_MCS 3
+#define SHM_LOCK_READER_SLOTS 64
+#define SHM_LOCK_READER_BATCH 32
+#define SHM_LOCK_DRAIN_YIELDS 16
+#define SHM_LOCK_MAX_SPIN 100
+#define SHM_LOCK_FUTEX_WAITERS 0x80000000u
+
+#define SHM_CACHE_LINE_SIZE 64
+
+#define SHM_HASH_TYPE_SIMPLE 0
+#define SHM_HASH_TYPE_WYHASH 1
+#define SHM_HASH_TYPE_CRC32C 2
+
+#define SHM_BUCKET_TYPE_PRIME 0
+#define SHM_BUCKET_TYPE_POW2 1
+#define SHM_BUCKET_TYPE_FASTRANGE 2
+
+#define SHM_GROW_MIN_CAPACITY 64
+#define SHM_REHASH_STEP 16
+
+#define SHM_INDEX_TYPE_CHAIN 0
+#define SHM_INDEX_TYPE_SWISS 1
+// lanes of a swiss group, its control bytes are compared SHM_GROUP_CTRL at a time and the rest masked off
+#define SHM_GROUP_WIDTH 12
+#define SHM_GROUP_CTRL 16
+#define SHM_GROUP_LANES ((1u << SHM_GROUP_WIDTH) - 1u)
+#define SHM_CTRL_EMPTY 0x80u
+#define SHM_CTRL_DELETED 0xfeu
+
+#define SHM_OPTIMISTIC_RETRY 4
+#define SHM_ACCESS_RING_SIZE 1024
+#define SHM_BATCH_WINDOW 16
+#define SHM_BATCH_SIZE 64
+#define SHM_BATCH_START 0
+#define SHM_BATCH_BUCKET 1
+#define SHM_BATCH_ENTRY 2
+#define SHM_BATCH_KEY 3
+#define SHM_MAX_COMBINE_SIZE (1024 * 1024)
+#define SHM_COMBINE_PASSES 4
+#define SHM_COMBINE_IDLE 0
+#define SHM_COMBINE_PENDING 1
+#define SHM_COMBINE_DONE 2
+#define SHM_COMBINE_TAKEN 3
+#define SHM_MAGAZINE_BATCH 16
+#define SHM_MAGAZINE_SIZE 64
+#define SHM_PIN_SLOTS 64
+#define SHM_PIN_FREE 0
+#define SHM_PIN_LIVE 1
+#define SHM_PIN_RETIRED 2
+#define SHM_SLAB_CLASSES 16
+#define SHM_SLAB_MIN_SIZE 64u
+#define SHM_SLAB_HEADER 64u
+#define SHM_SLAB_NONE 0xffffffffu
+#define SHM_SLAB_SLOT_SIZE(size_class) (SHM_SLAB_MIN_SIZE << ((size_class)-1u))
+#define SHM_EXTENT_RUNS 64
+// walk every chain on its way back to the idle blocks and check it against 'block_used' and 'last_addr'
+// #define SHM_CHECK_CHAIN
+// defined by the crash_repair test only: a process whose SHM_CRASH_AT names the point dies right there, locks held
+#ifdef SHM_CRASH_TEST
+#define SHM_CRASH_POINT(point)                                                                                        \
+    do {                                                                                                               \
+        const char *crash_at = getenv("SHM_CRASH_AT");                                                                 \
+        if (crash_at != nullptr && strcmp(crash_at, point) == 0) {                                                     \
+            _exit(0);                                                                                                  \
+        }                                                                                                              \
+    } while (0)
+#else
+#define SHM_CRASH_POINT(point)
+#endif
+
 #define SHM_SEGMENT_SIZE 128 * 1024 * 1024
 #define SHM_BLOCK_SIZE 256 * 1024
 
@@ -26,6 +104,7 @@
 #define SHM_MEM_ALIGN(x, align) (((x) + ((align)-1u)) & (~((align)-1u)))
 
 #define SHM_RDTSC(low, high) __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high))
+#define SHM_CPU_PAUSE() __asm__ __volatile__("pause" ::: "memory")
 
 #define SHM_ORIGIN_MEMCPY
 #if defined(__x86_64__) && defined(__linux__) && !defined(__CYGWIN__) && !defined(SHM_ORIGIN_MEMCPY)
@@ -184,12 +184,19 @@ void local_stats::init_cpu_info() {
         return;
     }
     fp = popen("cat /proc/cpuinfo | grep -m 1 \"model name\"", "r");
+    if (fp == nullptr) {
+        printf("get cpu info failed\n");
+        free(str);
+        return;
+    }
     char *fget;
     fget = fgets(str, 1024, fp);
     if (fget == nullptr) {
         printf("%s %s: pid: %d fgets() failed.\n", __FILE__, __func__, getpid());
+        str[0] = '\0';
     }
-    fclose(fp);
+    // a stream of popen() has to be closed by pclose(), which also waits for the command
+    pclose(fp);
     if (strstr(str, "AMD")) {
         cmd = R"(cat /proc/cpuinfo | grep -m 1 "cpu MHz" | sed -e 's/.*:[^0-9]//')";
     } else {
@@ -205,9 +212,10 @@ void local_stats::init_cpu_info() {
         fget = fgets(str, 1024, fp);
         if (fget == nullptr) {
             printf("%s %s: pid: %d fgets() failed.\n", __FILE__, __func__, getpid());
+            str[0] = '\0';
         }
         cpu_freq = strtof(str, nullptr) * ratio;
-        fclose(fp);
+        pclose(fp);
     }
     free(str);
 }
@@ -230,12 +238,20 @@ void stats_output::show() {
            (int32_t)(performance.save_bytes / 1024 / 1024), performance.lru_times);
     printf("key op: get = %u/%u set = %u/%u del = %u/%u\n"
            "r_lock_total = %u r_lock_retry = %u average = %f\n"
-           "w_lock_total = %u w_lock_retry = %u average = %f\n",
+           "w_lock_total = %u w_lock_retry = %u average = %f\n"
+           "optimistic_retry = %u optimistic_fallback = %u access_dropped = %u\n"
+           "futex_spin = %u futex_park = %u futex_wake = %u\n"
+           "mcs_spin = %u mcs_park = %u mcs_wake = %u\n"
+           "combine_batch = %u combine_op = %u set_in_place = %u\n",
            global_stats.get.success, global_stats.get.total, global_stats.set.success, global_stats.set.total,
            global_stats.del.success, global_stats.del.total, global_stats.r_lock_total, global_stats.r_lock_retry,
            global_stats.r_lock_retry + global_stats.r_lock_total / (double)global_stats.r_lock_total,
            global_stats.w_lock_total, global_stats.w_lock_retry,
-           global_stats.w_lock_retry + global_stats.w_lock_total / (double)global_stats.w_lock_total);
+           global_stats.w_lock_retry + global_stats.w_lock_total / (double)global_stats.w_lock_total,
+           global_stats.optimistic_retry, global_stats.optimistic_fallback, global_stats.access_dropped,
+           global_stats.futex_spin, global_stats.futex_park, global_stats.futex_wake, global_stats.mcs_spin,
+           global_stats.mcs_park, global_stats.mcs_wake, global_stats.combine_batch, global_stats.combine_op,
+           global_stats.set_in_place);
 }
 
 string stats_output::serialize() {
@@ -295,16 +311,73 @@ string stats_output::serialize() {
     lval = "w_lock_avg";
     rval = to_string((global_stats.w_lock_retry + global_stats.w_lock_total) / (double)(global_stats.w_lock_total));
     helper.put_data(lval, rval);
+    lval = "optimistic_retry";
+    rval = to_string(global_stats.optimistic_retry);
+    helper.put_data(lval, rval);
+    lval = "optimistic_fallback";
+    rval = to_string(global_stats.optimistic_fallback);
+    helper.put_data(lval, rval);
+    lval = "access_dropped";
+    rval = to_string(global_stats.access_dropped);
+    helper.put_data(lval, rval);
+    lval = "futex_spin";
+    rval = to_string(global_stats.futex_spin);
+    helper.put_data(lval, rval);
+    lval = "futex_park";
+    rval = to_string(global_stats.futex_park);
+    helper.put_data(lval, rval);
+    lval = "futex_wake";
+    rval = to_string(global_stats.futex_wake);
+    helper.put_data(lval, rval);
+    lval = "mcs_spin";
+    rval = to_string(global_stats.mcs_spin);
+    helper.put_data(lval, rval);
+    lval = "mcs_park";
+    rval = to_string(global_stats.mcs_park);
+    helper.put_data(lval, rval);
+    lval = "mcs_wake";
+    rval = to_string(global_stats.mcs_wake);
+    helper.put_data(lval, rval);
+    lval = "combine_batch";
+    rval = to_string(global_stats.combine_batch);
+    helper.put_data(lval, rval);
+    lval = "combine_op";
+    rval = to_string(global_stats.combine_op);
+    helper.put_data(lval, rval);
+    lval = "set_in_place";
+    rval = to_string(global_stats.set_in_place);
+    helper.put_data(lval, rval);
     return helper.simple_serialize();
 }
 
 int hash_entry::check_entry(const val_segments &val_segments, const uint32_t block_size) {
     printf("check entry begin\n");
     if (key_len <= 0 || value_len <= 0 || hash_next <= 0 || lru_prev <= 0 || lru_next <= 0 ||
-        !first_addr.valid_addr()) {
+        (!first_addr.valid_addr() && inlined == 0)) {
         printf("invalid entry!\n");
         return -1;
     }
+    if (inlined != 0) {
+        printf("inline, %u of %u bytes\n", SHM_MEM_ALIGN_BYTE(key_len) + SHM_MEM_ALIGN_BYTE(value_len),
+               SHM_INLINE_SIZE);
+        printf("check entry passed\n");
+        return 0;
+    }
+    if (size_class != 0) {
+        printf("slot #%u of class %u on page <%d, %d>\n", slab_slot, size_class, first_addr.index, first_addr.number);
+        printf("check entry passed\n");
+        return 0;
+    }
+    if (extent != 0) {
+        printf("extent of %u blocks <%d, %d> .. <%d, %d>\n", block_used, first_addr.index, first_addr.number,
+               first_addr.index, first_addr.number + (int32_t)block_used - 1);
+        printf("check entry passed\n");
+        return 0;
+    }
+    if (!chain_matches(val_segments, block_size)) {
+        printf("invalid entry! the chain does not end at <%d, %d>\n", last_addr.index, last_addr.number);
+        return -1;
+    }
     block_addr what = first_addr;
     for (unsigned i = 0; i < block_used; ++i) {
         if (i == 0) {
@@ -324,6 +397,23 @@ int hash_entry::check_entry(const val_segments &val_segments, const uint32_t blo
     return 0;
 }
 
+bool hash_entry::chain_matches(const val_segments &val_segments, const uint32_t block_size) const {
+    block_addr what = first_addr;
+    block_addr last;
+    uint32_t count = 0;
+    while (what.valid_addr() && count < block_used) {
+        auto *how = (block_entry *)val_segments.block(what, block_size);
+        if (how == nullptr) {
+            return false;
+        }
+        last = what;
+        what = how->next;
+        ++count;
+    }
+    return count == block_used && !what.valid_addr() && last.index == last_addr.index &&
+           last.number == last_addr.number;
+}
+
 int idle_list::check_list(const val_segments &val_segments) {
     printf("check idle begin.\n");
     if (block_size <= 0) {
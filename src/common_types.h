@@ -2,11 +2,17 @@
 #define SHMCACHE_COMMON_TYPES_H
 
 #include "common_define.h"
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <pthread.h>
 #include <string>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
 
 #ifdef SHM_AVX_MEMCPY
 #include "mem/memcpy_avx.h"
@@ -62,6 +68,50 @@ struct value_info {
         , data(val) {}
 };
 
+// a value read in place by shm_cache::get_view(), 'iov' points into the val segments until release_view()
+struct value_view {
+    uint32_t length;
+    uint32_t options;
+    time_t expires;
+    std::vector<iovec> iov;
+    // the pin that keeps the blocks from being reused
+    int32_t shard_id;
+    uint32_t pin;
+    uint64_t tag;
+    // a value kept inside its hash entry is copied here instead of pinned (pin is SHM_PIN_SLOTS), 'iov' points into it
+    std::vector<char> inline_copy;
+
+    value_view()
+        : length(0)
+        , options(0)
+        , expires(0)
+        , shard_id(-1)
+        , pin(0)
+        , tag(0) {}
+};
+
+// what a get copies: 'length' bytes from 'offset' on, cut at the end of the value; ENOBUFS if that is more than
+// 'capacity'
+struct value_range {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t capacity;
+
+    explicit value_range(uint32_t off, uint32_t len, uint32_t cap)
+        : offset(off)
+        , length(len)
+        , capacity(cap) {}
+
+    uint32_t size_of(uint32_t value_len) const { return std::min(length, value_len - std::min(offset, value_len)); }
+};
+
+// where shm_cache::get_alloc() takes the buffer of a value from, 'release' gives back one that turned out too small
+struct value_allocator {
+    char *(*alloc)(uint32_t size, void *arg);
+    void (*release)(char *data, void *arg);
+    void *arg;
+};
+
 struct mem_segment {
     uint32_t id;
     uint32_t size;
@@ -80,9 +130,14 @@ struct ht_segment {
     mem_segment item;
 };
 
+struct block_addr;
+
 struct val_segments {
     uint32_t current;
     mem_segment *items;
+
+    // nullptr if 'addr' is not a block of a segment mapped by this process (e.g. read without lock)
+    inline char *block(const block_addr &addr, uint32_t block_size) const;
 };
 
 struct block_addr {
@@ -98,9 +153,17 @@ struct block_addr {
         number = -1;
     }
 
-    bool valid_addr() { return index != -1 || number != -1; }
+    bool valid_addr() const { return index != -1 || number != -1; }
 };
 
+char *val_segments::block(const block_addr &addr, uint32_t block_size) const {
+    if (addr.index < 0 || (uint32_t)addr.index >= current || addr.number < 0 ||
+        (uint64_t)((uint32_t)addr.number + 1u) * block_size > items[addr.index].size) {
+        return nullptr;
+    }
+    return items[addr.index].base + (uint32_t)addr.number * block_size;
+}
+
 struct block_entry {
     block_addr next;
     char data[0];
@@ -115,7 +178,40 @@ struct block_entry {
     }
 };
 
+// a block cut into equal slots for small entries, the header takes the first SHM_SLAB_HEADER bytes and 'next'
+// overlays block_entry::next. Pages of a size class with free slots are linked both ways, see slab_list.
+struct slab_page {
+    block_addr next;
+    block_addr prev;
+    uint32_t size_class;
+    uint32_t used;
+    // each free slot keeps the number of the next one in its first bytes
+    uint32_t free_slot;
+    // slots from here on were never handed out
+    uint32_t fresh;
+
+    static uint32_t capacity(uint32_t block_size, uint32_t size_class) {
+        return (block_size - SHM_SLAB_HEADER) / SHM_SLAB_SLOT_SIZE(size_class);
+    }
+
+    char *slot(uint32_t number) {
+        return (char *)this + SHM_SLAB_HEADER + (uint64_t)number * SHM_SLAB_SLOT_SIZE(size_class);
+    }
+
+    void reset(uint32_t page_class) {
+        next.reset();
+        prev.reset();
+        size_class = page_class;
+        used = 0;
+        free_slot = SHM_SLAB_NONE;
+        fresh = 0;
+    }
+};
+
 struct hash_entry {
+    // the full hash and the leading key bytes, so lookups and unlinks rarely have to touch the value segments
+    uint32_t hash_code;
+    char key_prefix[SHM_KEY_PREFIX_SIZE];
     uint32_t key_len;
     uint32_t value_len;
     uint32_t options;
@@ -127,9 +223,25 @@ struct hash_entry {
     time_t born;
     uint32_t block_used;
     block_addr first_addr;
+    // 0 for a chain of 'block_used' whole blocks, else the entry is slot 'slab_slot' of the slab page 'first_addr'
+    uint32_t size_class;
+    uint32_t slab_slot;
+    // 1 if the 'block_used' blocks from 'first_addr' on are adjacent in one segment, the value then runs over the
+    // headers of all but the first one
+    uint32_t extent;
+    // seqlock: odd while the entry or its blocks are being changed, see shm_hashtable::ht_get_optimistic()
+    volatile uint32_t version;
+    // 1 if the key and the value are kept in 'inline_area' and no block is used
+    uint32_t inlined;
+    // the last block of a chain, so it is freed without walking it. Reset for an inline entry, where it is the block
+    // header in front of 'inline_area' that links nowhere.
+    block_addr last_addr;
+    char inline_area[SHM_INLINE_SIZE];
 
     explicit hash_entry(int64_t offset_f2base)
-        : key_len(0)
+        : hash_code(0)
+        , key_prefix{}
+        , key_len(0)
         , value_len(0)
         , options(0)
         , expires(0)
@@ -138,9 +250,18 @@ struct hash_entry {
         , lru_next(offset_f2base)
         , popular(0)
         , born(0)
-        , block_used(0) {}
+        , block_used(0)
+        , size_class(0)
+        , slab_slot(0)
+        , extent(0)
+        , version(0)
+        , inlined(0)
+        , last_addr()
+        , inline_area{} {}
 
     void reset(int64_t offset_f2base) {
+        hash_code = 0;
+        memset(key_prefix, 0, SHM_KEY_PREFIX_SIZE);
         key_len = 0;
         value_len = 0;
         options = 0;
@@ -152,9 +273,16 @@ struct hash_entry {
         born = 0;
         block_used = 0;
         first_addr.reset();
+        size_class = 0;
+        slab_slot = 0;
+        extent = 0;
+        inlined = 0;
+        last_addr.reset();
     }
 
     void update(const hash_entry &entry) {
+        hash_code = entry.hash_code;
+        memcpy(key_prefix, entry.key_prefix, SHM_KEY_PREFIX_SIZE);
         key_len = entry.key_len;
         value_len = entry.value_len;
         options = entry.options;
@@ -166,26 +294,75 @@ struct hash_entry {
         born = entry.born;
         block_used = entry.block_used;
         first_addr = entry.first_addr;
+        size_class = entry.size_class;
+        slab_slot = entry.slab_slot;
+        extent = entry.extent;
+        inlined = entry.inlined;
+        last_addr = entry.last_addr;
+        if (inlined != 0) {
+            memcpy(inline_area, entry.inline_area, sizeof(inline_area));
+        }
     }
 
-    void write_data(const val_segments &val_segments, const key_info &key_info, const value_info &value_info,
-                    uint32_t block_size) {
+    // the block holding the key and the head of the value, a slot of a slab page for a small entry, the whole run of
+    // an extent or the entry's own inline area; 'payload' is the room behind its header. nullptr if the fields read
+    // are torn or not mapped here.
+    block_entry *first_block(const val_segments &val_segments, uint32_t block_size, uint32_t &payload) const {
+        if (inlined != 0) {
+            payload = SHM_INLINE_SIZE;
+            return (block_entry *)&last_addr;
+        }
+        block_addr addr = first_addr;
+        uint32_t entry_class = size_class;
+        uint32_t slot = slab_slot;
+        uint32_t run = extent != 0 ? block_used : 0;
+        char *block = val_segments.block(addr, block_size);
+        payload = block_size - (uint32_t)sizeof(block_entry);
+        if (block == nullptr || (entry_class == 0 && run == 0)) {
+            return (block_entry *)block;
+        }
+        if (run != 0) {
+            if (entry_class != 0 ||
+                ((uint64_t)(uint32_t)addr.number + run) * block_size > val_segments.items[addr.index].size) {
+                return nullptr;
+            }
+            payload = run * block_size - (uint32_t)sizeof(block_entry);
+            return (block_entry *)block;
+        }
+        if (entry_class > SHM_SLAB_CLASSES || slot >= block_size ||
+            SHM_SLAB_HEADER + (uint64_t)(slot + 1) * SHM_SLAB_SLOT_SIZE(entry_class) > block_size) {
+            return nullptr;
+        }
+        payload = SHM_SLAB_SLOT_SIZE(entry_class) - (uint32_t)sizeof(block_entry);
+        return (block_entry *)(block + SHM_SLAB_HEADER + slot * SHM_SLAB_SLOT_SIZE(entry_class));
+    }
+
+    void write_data(const val_segments &val_segments, const key_info &key_info, uint32_t hash,
+                    const value_info &value_info, uint32_t block_size) {
+        hash_code = hash;
+        memset(key_prefix, 0, SHM_KEY_PREFIX_SIZE);
+        memcpy(key_prefix, key_info.data, std::min(key_info.length, SHM_KEY_PREFIX_SIZE));
         key_len = key_info.length;
+        uint32_t payload;
+        block_entry *first_entry = first_block(val_segments, block_size, payload);
+        memset(first_entry->data, 0, SHM_MEM_ALIGN_BYTE(key_info.length));
+        memcpy_var(first_entry->data, key_info.data, key_info.length);
+        write_value(val_segments, value_info, block_size);
+    }
+
+    // the value goes behind the key in the first block, the key and its header are left as they are
+    void write_value(const val_segments &val_segments, const value_info &value_info, uint32_t block_size) {
         value_len = value_info.length;
         options = value_info.options;
         expires = value_info.expires;
         popular = 0;
         born = time(nullptr);
 
-        char *dst;
-        block_addr cursor_addr = first_addr;
-        auto *cursor_entry =
-            (block_entry *)(val_segments.items[cursor_addr.index].base + (uint32_t)cursor_addr.number * block_size);
-        dst = cursor_entry->data;
-        memset(dst, 0, SHM_MEM_ALIGN_BYTE(key_info.length));
-        memcpy_var(dst, key_info.data, key_info.length);
-        dst += SHM_MEM_ALIGN_BYTE(key_info.length);
-        uint32_t rest_of_block = block_size - (uint32_t)sizeof(block_entry) - SHM_MEM_ALIGN_BYTE(key_info.length);
+        uint32_t payload;
+        block_entry *cursor_entry = first_block(val_segments, block_size, payload);
+        char *dst = cursor_entry->data + SHM_MEM_ALIGN_BYTE(key_len);
+        uint32_t rest_of_block = payload - SHM_MEM_ALIGN_BYTE(key_len);
+        block_addr cursor_addr;
         uint32_t offset = 0;
 
         while (value_info.length - offset > rest_of_block) {
@@ -200,58 +377,140 @@ struct hash_entry {
         memcpy_var(dst, value_info.data + offset, value_info.length - offset);
     }
 
-    void read_data(const val_segments &val_segments, value_info &value_info, uint32_t block_size) {
-        value_info.length = value_len;
-        value_info.options = options;
-        value_info.expires = expires;
+    void begin_update() { __sync_fetch_and_or(&version, 1u); }
 
-        char *src;
-        block_addr cursor_addr = first_addr;
-        auto *cursor_entry =
-            (block_entry *)(val_segments.items[cursor_addr.index].base + (uint32_t)cursor_addr.number * block_size);
-        src = cursor_entry->data + SHM_MEM_ALIGN_BYTE(key_len);
+    void end_update() { __sync_add_and_fetch(&version, 1u); }
 
-        uint32_t rest_of_block = block_size - (uint32_t)sizeof(block_entry) - SHM_MEM_ALIGN_BYTE(key_len);
+    // fields are read once and every block is checked, so a racing writer may corrupt the copy but never the reader.
+    // Only the blocks up to the range are walked, and only the range is copied.
+    bool read_data(const val_segments &val_segments, value_info &value_info, uint32_t block_size, uint32_t max_len,
+                   const value_range &range) {
+        uint32_t key_length = key_len;
+        uint32_t value_length = value_len;
+        if (value_length > max_len) {
+            return false;
+        }
+        read_header(value_info);
+        uint32_t begin = std::min(range.offset, value_length);
+        uint32_t size = range.size_of(value_length);
+        value_info.length = size;
+        if (size == 0) {
+            return true;
+        }
+
+        uint32_t payload = 0;
+        block_entry *cursor_entry = first_block(val_segments, block_size, payload);
+        if (cursor_entry == nullptr || SHM_MEM_ALIGN_BYTE(key_length) > payload) {
+            return false;
+        }
+        // where the first byte sits in the chain, the key comes first. A slot holds the whole entry, a longer value
+        // is torn and runs into the end of the chain.
+        uint64_t position = (uint64_t)SHM_MEM_ALIGN_BYTE(key_length) + begin;
+        for (uint64_t skip = position / payload; cursor_entry != nullptr && skip > 0; --skip) {
+            cursor_entry = (block_entry *)val_segments.block(cursor_entry->next, block_size);
+        }
+        if (cursor_entry == nullptr) {
+            return false;
+        }
+        char *src = cursor_entry->data + position % payload;
+        auto rest_of_block = (uint32_t)(payload - position % payload);
         uint32_t offset = 0;
 
-        while (value_len - offset > rest_of_block) {
+        while (size - offset > rest_of_block) {
             memcpy_var(value_info.data + offset, src, rest_of_block);
             offset += rest_of_block;
-            rest_of_block = block_size - (uint32_t)sizeof(block_entry);
-            cursor_addr = cursor_entry->next;
-            cursor_entry =
-                (block_entry *)(val_segments.items[cursor_addr.index].base + (uint32_t)cursor_addr.number * block_size);
+            rest_of_block = payload;
+            cursor_entry = (block_entry *)val_segments.block(cursor_entry->next, block_size);
+            if (cursor_entry == nullptr) {
+                return false;
+            }
             src = cursor_entry->data;
         }
-        memcpy_var(value_info.data + offset, src, value_len - offset);
+        memcpy_var(value_info.data + offset, src, size - offset);
+        return true;
+    }
+
+    void read_header(value_info &value_info) const {
+        value_info.length = value_len;
+        value_info.options = options;
+        value_info.expires = expires;
+    }
+
+    // one iovec per block the value spans, the first one starts behind the key
+    bool read_view(const val_segments &val_segments, value_view &view, uint32_t block_size) const {
+        view.length = value_len;
+        view.options = options;
+        view.expires = expires;
+        view.iov.clear();
+        uint32_t offset = SHM_MEM_ALIGN_BYTE(key_len);
+        uint32_t rest = value_len;
+        uint32_t payload = 0;
+        block_entry *cursor_entry = first_block(val_segments, block_size, payload);
+        if (cursor_entry == nullptr || offset > payload) {
+            return false;
+        }
+        while (true) {
+            uint32_t size = std::min(rest, payload - offset);
+            if (size > 0) {
+                view.iov.push_back(iovec{cursor_entry->data + offset, size});
+            }
+            rest -= size;
+            if (rest == 0) {
+                return true;
+            }
+            offset = 0;
+            payload = block_size - (uint32_t)sizeof(block_entry);
+            cursor_entry = (block_entry *)val_segments.block(cursor_entry->next, block_size);
+            if (cursor_entry == nullptr) {
+                return false;
+            }
+        }
     }
 
     int check_entry(const val_segments &val_segments, uint32_t block_size);
+    // walks the chain: 'block_used' blocks ending at 'last_addr'
+    bool chain_matches(const val_segments &val_segments, uint32_t block_size) const;
 };
 
+static_assert(offsetof(hash_entry, inline_area) == offsetof(hash_entry, last_addr) + sizeof(block_addr),
+              "the inline area has to follow its block header");
+
 struct idle_list {
     uint32_t block_size;
     uint32_t block_current;
+    uint32_t segment_count;
     int64_t offset_f2base;
     block_entry fake_block;
 
     explicit idle_list(int64_t offset)
         : block_size(0)
         , block_current(0)
+        , segment_count(0)
         , offset_f2base(offset) {}
 
-    void reset(const val_segments &val_segments, uint32_t count_of_each) {
+    // rebuild the list from the segments owned by 'shard_id'
+    void reset(const val_segments &val_segments, uint32_t count_of_each, const int32_t *segment_owner,
+               int32_t shard_id) {
         block_current = 0;
+        segment_count = 0;
         fake_block.reset();
         for (uint32_t index = 0; index < val_segments.current; ++index) {
-            add_val_segment(val_segments, index, count_of_each);
+            if (segment_owner[index] == shard_id) {
+                add_val_segment(val_segments, index, count_of_each);
+            }
         }
     }
 
     void add_val_segment(const val_segments &val_segments, uint32_t index, uint32_t count) {
+        add_blocks(val_segments, index, 0, count);
+        ++segment_count;
+    }
+
+    // put the 'count' adjacent blocks from 'first' on at the head, in order
+    void add_blocks(const val_segments &val_segments, uint32_t index, uint32_t first, uint32_t count) {
         block_addr first_addr = fake_block.next;
         block_entry *prev_entry = &fake_block;
-        for (uint32_t number = 0; number < count; ++number) {
+        for (uint32_t number = first; number < first + count; ++number) {
             prev_entry->next.index = (int32_t)index;
             prev_entry->next.number = (int32_t)number;
             prev_entry = (block_entry *)(val_segments.items[index].base + number * block_size);
@@ -261,16 +520,16 @@ struct idle_list {
     }
 
     bool alloc_hash_entry_block(const val_segments &val_segments, hash_entry &new_entry, uint32_t block_used) {
-        new_entry.block_used = block_used;
-
         block_addr cursor_addr = fake_block.next;
-        if (!cursor_addr.valid_addr()) {
+        if (block_used > block_current || !cursor_addr.valid_addr()) {
             return false;
         }
+        new_entry.block_used = block_used;
         block_entry *cursor_entry = nullptr;
 
         uint32_t alloc_num = 0;
         do {
+            new_entry.last_addr = cursor_addr;
             cursor_entry =
                 (block_entry *)(val_segments.items[cursor_addr.index].base + (uint32_t)cursor_addr.number * block_size);
 
@@ -288,27 +547,25 @@ struct idle_list {
         return alloc_num == block_used;
     }
 
+    // splices the chain in front of the list through its last block, the chain itself is not walked
     bool free_hash_entry_block(const val_segments &val_segments, hash_entry &old_entry) {
-        block_addr cursor_addr = old_entry.first_addr;
-        if (!cursor_addr.valid_addr()) {
+        if (!old_entry.first_addr.valid_addr() || !old_entry.last_addr.valid_addr()) {
             return false;
         }
-        block_entry *cursor_entry = nullptr;
-
-        uint32_t free_num = 0;
-        do {
-            cursor_entry =
-                (block_entry *)(val_segments.items[cursor_addr.index].base + (uint32_t)cursor_addr.number * block_size);
-            cursor_addr = cursor_entry->next;
-            ++free_num;
-        } while (cursor_addr.valid_addr());
-
-        cursor_entry->next = fake_block.next;
+#ifdef SHM_CHECK_CHAIN
+        if (!old_entry.chain_matches(val_segments, block_size)) {
+            printf("invalid chain! block_used = %u.\n", old_entry.block_used);
+            return false;
+        }
+#endif
+        auto *last_entry = (block_entry *)(val_segments.items[old_entry.last_addr.index].base +
+                                           (uint32_t)old_entry.last_addr.number * block_size);
+        last_entry->next = fake_block.next;
         fake_block.next = old_entry.first_addr;
 
         block_current += old_entry.block_used;
 
-        return old_entry.block_used == free_num;
+        return true;
     }
 
     int check_list(const val_segments &val_segments);
@@ -334,38 +591,122 @@ struct busy_list {
     int check_list(const ht_segment &ht_segment);
 };
 
+// the hash entries of a shard, an entry keeps its slot from alloc to free
 struct entry_queue {
-    uint32_t head;
-    uint32_t tail;
+    // each free entry keeps the offset of the next one in 'hash_next', 0 ends the stack
+    int64_t free_entry;
+    // slots from here on were never handed out
+    uint32_t fresh;
     uint32_t capacity;
     int64_t offset_2base;
 
     explicit entry_queue(int64_t offset)
-        : head(0)
-        , tail(0)
+        : free_entry(0)
+        , fresh(0)
         , capacity(0)
         , offset_2base(offset) {}
 
-    void reset() { head = tail = 0; }
+    void reset() {
+        free_entry = 0;
+        fresh = 0;
+    }
 
-    void tail_forward() { tail = (tail + 1u + capacity) % capacity; }
+    // the entry take() hands out next, 0 if every slot is in use
+    int64_t peek() const {
+        if (free_entry != 0) {
+            return free_entry;
+        }
+        return fresh < capacity ? offset_2base + (int64_t)sizeof(hash_entry) * fresh : 0;
+    }
 
-    void head_forward() { head = (head + 1u + capacity) % capacity; }
+    void take(const char *base) {
+        if (free_entry != 0) {
+            free_entry = ((const hash_entry *)(base + free_entry))->hash_next;
+        } else {
+            ++fresh;
+        }
+    }
+
+    void put(char *base, int64_t entry_offset) {
+        ((hash_entry *)(base + entry_offset))->hash_next = free_entry;
+        free_entry = entry_offset;
+    }
 };
 
+// one probe step of the swiss index, a cache line of its own: the control bytes compared at once, then the entry
+// slots they stand for
+struct index_group {
+    // SHM_CTRL_EMPTY, SHM_CTRL_DELETED or the low 7 bits of the mixed hash of the entry in that lane, the bytes past
+    // SHM_GROUP_WIDTH only fill up the compare
+    uint8_t ctrl[SHM_GROUP_CTRL];
+    // slot of the entry in the entry queue of the shard
+    uint32_t slot[SHM_GROUP_WIDTH];
+} __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
+
+static_assert(sizeof(index_group) == SHM_CACHE_LINE_SIZE, "a probe of the swiss index loads one cache line");
+
 struct hashtable {
+    uint32_t index_type;
+    // how a chained index maps a hash to a bucket, see shm_hashtable::bucket_index()
+    uint32_t bucket_type;
+    uint32_t bucket_shift;
+    // buckets of a chained index, lanes (SHM_GROUP_WIDTH per group) of a swiss index
     uint32_t capacity;
     uint32_t inserted;
-    int64_t bucket[0];
+    // tombstones of a swiss index, they are dropped by shm_swiss_index::rebuild()
+    uint32_t deleted;
+    // seqlock over the buckets and every 'hash_next', odd while a writer relinks chains
+    volatile uint32_t version;
+    int64_t offset_2base;
+    // a growing chained index (grow_index = true) lives in one of two regions sized for 'max_capacity' buckets,
+    // buckets [rehash_index, old_capacity) of the table in the other region still wait to be moved over
+    uint32_t max_capacity;
+    uint32_t old_capacity;
+    uint32_t old_shift;
+    uint32_t rehash_index;
+    int64_t offset_2old;
 
     hashtable()
-        : capacity(0)
+        : index_type(SHM_INDEX_TYPE_CHAIN)
+        , bucket_type(SHM_BUCKET_TYPE_PRIME)
+        , bucket_shift(0)
+        , capacity(0)
         , inserted(0)
-        , bucket() {}
+        , deleted(0)
+        , version(0)
+        , offset_2base(0)
+        , max_capacity(0)
+        , old_capacity(0)
+        , old_shift(0)
+        , rehash_index(0)
+        , offset_2old(0) {}
 
-    void reset() {
+    int64_t *bucket(char *base) const { return (int64_t *)(base + offset_2base); }
+
+    int64_t *old_bucket(char *base) const { return (int64_t *)(base + offset_2old); }
+
+    index_group *groups(char *base) const { return (index_group *)(base + offset_2base); }
+
+    static uint32_t index_size(uint32_t type, uint32_t capacity) {
+        return type == SHM_INDEX_TYPE_SWISS ? (uint32_t)sizeof(index_group) * (capacity / SHM_GROUP_WIDTH)
+                                            : (uint32_t)sizeof(int64_t) * capacity;
+    }
+
+    void reset(char *base) {
         inserted = 0;
-        memset(&bucket, 0, sizeof(int64_t) * capacity);
+        deleted = 0;
+        if (index_type == SHM_INDEX_TYPE_SWISS) {
+            // only the control bytes matter, an empty lane never looks at its slot
+            memset(groups(base), SHM_CTRL_EMPTY, index_size(index_type, capacity));
+        } else if (offset_2old != 0) {
+            // a rehash may have been cut short anywhere, keep the size but start over from two clean regions
+            memset(bucket(base), 0, index_size(index_type, max_capacity));
+            memset(old_bucket(base), 0, index_size(index_type, max_capacity));
+            old_capacity = 0;
+            rehash_index = 0;
+        } else {
+            memset(bucket(base), 0, index_size(index_type, capacity));
+        }
     }
 };
 
@@ -378,6 +719,10 @@ struct basic_unit {
     struct {
         uint32_t size;
         uint32_t max_of_each;
+        // size classes of the slab pages, 0 if every entry takes whole blocks
+        uint32_t slab_classes;
+        // 1 if values of several blocks take a run of adjacent blocks when there is one
+        uint32_t extents;
     } block;
 };
 
@@ -402,6 +747,18 @@ struct global_stats {
     volatile uint32_t eliminate_count;
     volatile uint32_t get_bytes;
     volatile uint32_t lru_count;
+    volatile uint32_t optimistic_retry;
+    volatile uint32_t optimistic_fallback;
+    volatile uint32_t access_dropped;
+    volatile uint32_t futex_spin;
+    volatile uint32_t futex_park;
+    volatile uint32_t futex_wake;
+    volatile uint32_t mcs_spin;
+    volatile uint32_t mcs_park;
+    volatile uint32_t mcs_wake;
+    volatile uint32_t combine_batch;
+    volatile uint32_t combine_op;
+    volatile uint32_t set_in_place;
     struct {
         ratio_counter get;
         uint32_t survive_duration;
@@ -426,6 +783,18 @@ struct global_stats {
         eliminate_count = 0;
         get_bytes = 0;
         lru_count = 0;
+        optimistic_retry = 0;
+        optimistic_fallback = 0;
+        access_dropped = 0;
+        futex_spin = 0;
+        futex_park = 0;
+        futex_wake = 0;
+        mcs_spin = 0;
+        mcs_park = 0;
+        mcs_wake = 0;
+        combine_batch = 0;
+        combine_op = 0;
+        set_in_place = 0;
         last.get.reset();
         last.survive_duration = 0;
         last.eliminate_count = 0;
@@ -496,13 +865,444 @@ struct local_stats {
     static uint32_t get_cpu_cycle();
 };
 
+struct reader_slot {
+    volatile pid_t pid;
+    char padding[SHM_CACHE_LINE_SIZE - sizeof(pid_t)];
+};
+
 struct memory_lock {
     pid_t owner;
+    uint32_t type;
+    // index of the shard guarded by this lock, -1 for memory_info::global_lock
+    int32_t shard_id;
     pthread_mutex_t mutex;
+    // SHM_LOCK_TYPE_RWLOCK: the mutex serializes writers, 'writer' turns away new readers (writer preference)
+    // and 'reader_grant' lets at most SHM_LOCK_READER_BATCH waiting readers pass before the next writer
+    volatile uint32_t writer;
+    volatile int32_t readers_waiting;
+    volatile uint32_t reader_grant;
+    // set when the mutex was taken over from a dead owner, the shard has to be repaired before it is used
+    volatile uint32_t dirty;
+    // SHM_LOCK_TYPE_FUTEX: pid of the owner (0 if free) | SHM_LOCK_FUTEX_WAITERS when somebody is parked
+    volatile uint32_t futex;
+    // average spins before the futex was free, bounds the next spin phase
+    volatile uint32_t spins;
+    // SHM_LOCK_TYPE_MCS: id of the last queued mcs_node, 0 if the lock is free
+    volatile uint32_t tail;
+    reader_slot readers[SHM_LOCK_READER_SLOTS] __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
 
     memory_lock()
         : owner(-1)
-        , mutex() {}
+        , type(SHM_LOCK_TYPE_MUTEX)
+        , shard_id(-1)
+        , mutex()
+        , writer(0)
+        , readers_waiting(0)
+        , reader_grant(0)
+        , dirty(0)
+        , futex(0)
+        , spins(0)
+        , tail(0)
+        , readers() {}
+
+    void reset() {
+        owner = -1;
+        writer = 0;
+        readers_waiting = 0;
+        reader_grant = 0;
+        dirty = 0;
+        futex = 0;
+        spins = 0;
+        tail = 0;
+        for (auto &slot : readers) {
+            slot.pid = 0;
+        }
+    }
+};
+
+// queue node of SHM_LOCK_TYPE_MCS, waiters spin (then sleep) on their own 'locked' only
+struct mcs_node {
+    // process index + 1 of the node queued behind us and of the node we queued behind, 0 if none
+    volatile uint32_t next;
+    volatile uint32_t prev;
+    volatile pid_t prev_pid;
+    // futex word, 1 while waiting and 0 once the lock was handed to us
+    volatile uint32_t locked;
+    volatile uint32_t parked;
+    // queued or holding the lock, the process slot can not be reused before it is cleared
+    volatile uint32_t busy;
+} __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
+
+// a set handed to the combiner of its shard, key and value are staged in the scratch area of the process
+struct combine_request {
+    // SHM_COMBINE_*: a pending request is taken by a combiner or withdrawn by its owner, never both
+    volatile uint32_t state;
+    int32_t shard_id;
+    uint32_t hash_code;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t options;
+    time_t expires;
+    volatile int32_t result;
+} __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
+
+// free blocks of one shard set aside by a process, only touched under the lock of that shard (or while empty,
+// to bind it to another shard); blocks left behind by a dead process are drained by the next shortage
+struct block_magazine {
+    volatile int32_t shard_id;
+    volatile uint32_t count;
+    block_addr head;
+    block_addr tail;
+
+    block_entry *block(const val_segments &val_segments, uint32_t block_size, const block_addr &addr) const {
+        return (block_entry *)(val_segments.items[addr.index].base + (uint32_t)addr.number * block_size);
+    }
+
+    // move 'wanted' blocks from the head of the idle list to our tail
+    void refill(const val_segments &val_segments, uint32_t block_size, idle_list &idle_list, uint32_t wanted) {
+        block_addr first = idle_list.fake_block.next;
+        block_addr last = first;
+        for (uint32_t number = 1; number < wanted; ++number) {
+            last = block(val_segments, block_size, last)->next;
+        }
+        block_entry *last_entry = block(val_segments, block_size, last);
+        idle_list.fake_block.next = last_entry->next;
+        idle_list.block_current -= wanted;
+        last_entry->next.reset();
+        if (count == 0) {
+            head = first;
+        } else {
+            block(val_segments, block_size, tail)->next = first;
+        }
+        tail = last;
+        count += wanted;
+    }
+
+    void take(const val_segments &val_segments, uint32_t block_size, hash_entry &new_entry, uint32_t block_used) {
+        new_entry.block_used = block_used;
+        new_entry.first_addr = head;
+        block_addr last = head;
+        for (uint32_t number = 1; number < block_used; ++number) {
+            last = block(val_segments, block_size, last)->next;
+        }
+        block_entry *last_entry = block(val_segments, block_size, last);
+        new_entry.last_addr = last;
+        head = last_entry->next;
+        last_entry->next.reset();
+        count -= block_used;
+        if (count == 0) {
+            tail.reset();
+        }
+    }
+
+    bool put(const val_segments &val_segments, uint32_t block_size, hash_entry &old_entry) {
+        if (!old_entry.first_addr.valid_addr() || !old_entry.last_addr.valid_addr()) {
+            return false;
+        }
+#ifdef SHM_CHECK_CHAIN
+        if (!old_entry.chain_matches(val_segments, block_size)) {
+            printf("invalid chain! block_used = %u.\n", old_entry.block_used);
+            return false;
+        }
+#endif
+        block(val_segments, block_size, old_entry.last_addr)->next = head;
+        head = old_entry.first_addr;
+        if (count == 0) {
+            tail = old_entry.last_addr;
+        }
+        count += old_entry.block_used;
+        return true;
+    }
+
+    // hand every block back to the idle list in one splice
+    void drain(const val_segments &val_segments, uint32_t block_size, idle_list &idle_list) {
+        if (count != 0) {
+            block(val_segments, block_size, tail)->next = idle_list.fake_block.next;
+            idle_list.fake_block.next = head;
+            idle_list.block_current += count;
+        }
+        forget();
+    }
+
+    // 'count' goes last, a process binding the empty magazine to another shard must not race our stores
+    void forget() {
+        head.reset();
+        tail.reset();
+        __sync_synchronize();
+        count = 0;
+    }
+};
+
+// one per attached process, claimed in shm_lock::attach_process()
+struct process_slot {
+    volatile pid_t pid;
+    // a process holds at most one shard lock, the global lock is always a mutex
+    struct mcs_node node;
+    struct combine_request request;
+    struct block_magazine magazine;
+} __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
+
+// what the owner of a shard lock is half way through, read by shm_hashtable::ht_repair() after EOWNERDEAD
+struct op_journal {
+    // entry taken from the entry queue (or rewritten in place) whose data is not completely written yet
+    volatile int64_t fresh;
+    // entry being freed, it may already be back on the free stack
+    volatile int64_t victim;
+    volatile uint32_t clearing;
+
+    void reset() {
+        fresh = 0;
+        victim = 0;
+        clearing = 0;
+    }
+};
+
+// a hit recorded by a reader, it is complete once 'sequence' is its ticket + 1
+struct access_record {
+    volatile uint32_t sequence;
+    uint32_t version;
+    uint32_t lru;
+    int64_t offset;
+};
+
+// hits are appended without any lock and applied to the lru list by the next writer of the shard
+struct access_ring {
+    // next ticket handed to a reader
+    volatile uint32_t head;
+    // first ticket not applied yet, only moved under the shard lock
+    volatile uint32_t tail;
+    struct access_record records[SHM_ACCESS_RING_SIZE] __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
+
+    void reset() {
+        head = tail = 0;
+        memset(records, 0, sizeof(records));
+    }
+
+    // readers may be appending, pending hits are dropped by moving the tail only
+    void discard() { tail = head; }
+};
+
+// blocks of values handed out by shm_cache::get_view(): an entry freed while pinned leaves its blocks to the pin,
+// the release of the last pin on them puts them back on the idle list
+struct pin_slot {
+    // (ticket << 32) | state, a view only ever releases the pin it took
+    volatile uint64_t tag;
+    volatile pid_t owner;
+    block_addr first_addr;
+    uint32_t block_used;
+    block_addr last_addr;
+    uint32_t size_class;
+    uint32_t slab_slot;
+    uint32_t extent;
+
+    bool holds(const block_addr &addr, uint32_t entry_class, uint32_t slot) const {
+        return first_addr.index == addr.index && first_addr.number == addr.number && size_class == entry_class &&
+               (entry_class == 0 || slab_slot == slot);
+    }
+};
+
+struct pin_table {
+    // slots that are not free, writers only look at the table while there are any
+    volatile uint32_t used;
+    // a reader found every slot taken, the next writer frees the ones of dead processes
+    volatile uint32_t starved;
+    volatile uint32_t ticket;
+    struct pin_slot slots[SHM_PIN_SLOTS];
+
+    // the ticket goes on, tags handed out before a reset never match again
+    void reset() {
+        for (auto &slot : slots) {
+            slot.tag = (slot.tag & ~0xffffffffull) | SHM_PIN_FREE;
+            slot.owner = 0;
+        }
+        used = 0;
+        starved = 0;
+    }
+};
+
+// slab pages of a shard, 'partial' heads the list of pages with a free slot of every size class; a page goes back
+// to the idle list when its last slot is freed
+struct slab_list {
+    block_addr partial[SHM_SLAB_CLASSES];
+    uint32_t pages;
+
+    void reset() {
+        for (auto &addr : partial) {
+            addr.reset();
+        }
+        pages = 0;
+    }
+
+    slab_page *page(const val_segments &val_segments, uint32_t block_size, const block_addr &addr) const {
+        return (slab_page *)(val_segments.items[addr.index].base + (uint32_t)addr.number * block_size);
+    }
+
+    void link(const val_segments &val_segments, uint32_t block_size, const block_addr &addr) {
+        slab_page *current = page(val_segments, block_size, addr);
+        block_addr &head = partial[current->size_class - 1];
+        current->prev.reset();
+        current->next = head;
+        if (head.valid_addr()) {
+            page(val_segments, block_size, head)->prev = addr;
+        }
+        head = addr;
+    }
+
+    void unlink(const val_segments &val_segments, uint32_t block_size, const block_addr &addr) {
+        slab_page *current = page(val_segments, block_size, addr);
+        if (current->prev.valid_addr()) {
+            page(val_segments, block_size, current->prev)->next = current->next;
+        } else {
+            partial[current->size_class - 1] = current->next;
+        }
+        if (current->next.valid_addr()) {
+            page(val_segments, block_size, current->next)->prev = current->prev;
+        }
+        current->next.reset();
+        current->prev.reset();
+    }
+};
+
+// free runs of adjacent blocks of a shard, none crosses a segment and their blocks are not on the idle list. A value of
+// several blocks takes the shortest run long enough, the idle list takes blocks off the end of the shortest run only
+// when it runs dry, and a freed run is merged with the runs right before and behind it.
+struct extent_run {
+    block_addr first;
+    uint32_t count;
+};
+
+struct extent_list {
+    uint32_t count;
+    // blocks in all runs
+    uint32_t blocks;
+    struct extent_run runs[SHM_EXTENT_RUNS];
+
+    void reset() {
+        count = 0;
+        blocks = 0;
+    }
+
+    bool take(uint32_t wanted, block_addr &first) {
+        uint32_t best = count;
+        for (uint32_t index = 0; index < count; ++index) {
+            if (runs[index].count >= wanted && (best == count || runs[index].count < runs[best].count)) {
+                best = index;
+            }
+        }
+        if (best == count) {
+            return false;
+        }
+        first = runs[best].first;
+        runs[best].first.number += (int32_t)wanted;
+        shrink(best, wanted);
+        return true;
+    }
+
+    // up to 'wanted' blocks off the end of the shortest run
+    bool carve(uint32_t wanted, block_addr &first, uint32_t &carved) {
+        if (count == 0) {
+            return false;
+        }
+        uint32_t shortest = 0;
+        for (uint32_t index = 1; index < count; ++index) {
+            if (runs[index].count < runs[shortest].count) {
+                shortest = index;
+            }
+        }
+        carved = std::min(wanted, runs[shortest].count);
+        first = runs[shortest].first;
+        first.number += (int32_t)(runs[shortest].count - carved);
+        shrink(shortest, carved);
+        return true;
+    }
+
+    // false, with nothing changed, if the run touches no other run and every slot is taken
+    bool put(const block_addr &first, uint32_t run_count) {
+        uint32_t before = count, behind = count;
+        for (uint32_t index = 0; index < count; ++index) {
+            if (runs[index].first.index != first.index) {
+                continue;
+            }
+            if (runs[index].first.number + (int32_t)runs[index].count == first.number) {
+                before = index;
+            } else if (first.number + (int32_t)run_count == runs[index].first.number) {
+                behind = index;
+            }
+        }
+        if (before == count && behind == count) {
+            if (count == SHM_EXTENT_RUNS) {
+                return false;
+            }
+            runs[count].first = first;
+            runs[count].count = run_count;
+            ++count;
+        } else if (before == count) {
+            runs[behind].first = first;
+            runs[behind].count += run_count;
+        } else {
+            runs[before].count += run_count;
+            if (behind != count) {
+                runs[before].count += runs[behind].count;
+                runs[behind] = runs[--count];
+            }
+        }
+        blocks += run_count;
+        return true;
+    }
+
+    void shrink(uint32_t index, uint32_t taken) {
+        runs[index].count -= taken;
+        blocks -= taken;
+        if (runs[index].count == 0) {
+            runs[index] = runs[--count];
+        }
+    }
+};
+
+struct shard {
+    struct memory_lock lock;
+    struct hashtable hashtable;
+    struct idle_list idle_list;
+    struct busy_list busy_list;
+    struct entry_queue entry_queue;
+    struct op_journal journal;
+    struct access_ring access_ring;
+    struct pin_table pins;
+    struct slab_list slabs;
+    struct extent_list extents;
+    // process applying the pending combine requests of this shard, 0 if none
+    volatile pid_t combiner;
+    // futex word bumped after every batch, waiting requesters sleep on it
+    volatile uint32_t combine_epoch;
+    volatile uint32_t combine_waiters;
+    // requests published and not served yet, a combiner stops scanning when it drops to 0
+    volatile int32_t combine_pending;
+} __attribute__((aligned(SHM_CACHE_LINE_SIZE)));
+
+// where everything lives in the ht segment, all offsets are relative to its base
+struct ht_layout {
+    uint32_t shard_count;
+    uint32_t capacity_of_each;
+    uint32_t entry_of_each;
+    uint32_t segment_max;
+    uint32_t offset_2shard;
+    uint32_t offset_2process;
+    uint32_t offset_2bucket;
+    // every process has to hash keys the same way, so the hash function is part of the layout
+    uint32_t hash_type;
+    uint32_t bucket_type;
+    uint32_t index_type;
+    // the chained index of a shard starts small and doubles online, see shm_hashtable::grow_index()
+    uint32_t grow_index;
+    // bytes of the index of one shard, both regions of a growing one
+    uint32_t index_size;
+    uint32_t offset_2entry;
+    uint32_t offset_2owner;
+    uint32_t offset_2scratch;
+    uint32_t scratch_size;
+    uint32_t total_size;
+
+    bool operator==(const ht_layout &other) const { return memcmp(this, &other, sizeof(ht_layout)) == 0; }
 };
 
 struct memory_info {
@@ -512,12 +1312,12 @@ struct memory_info {
     uint32_t status;
 
     struct global_stats global_stats;
+    // guards segment creation and the global stats, every shard has its own lock for the data
     struct memory_lock global_lock;
     struct basic_unit basic_unit;
-    struct idle_list idle_list;
-    struct busy_list busy_list;
-    struct entry_queue entry_queue;
-    struct hashtable hashtable;
+    struct ht_layout layout;
+    // one past the highest process slot ever claimed, scans of the process slots stop there
+    volatile uint32_t process_limit;
 };
 
 struct config {
@@ -536,6 +1336,16 @@ struct config {
     uint32_t try_w_lk_interval;
     uint32_t detect_r_dl_ticks;
     uint32_t detect_w_dl_ticks;
+    uint32_t lock_type;
+    uint32_t shard_count;
+    bool optimistic_get;
+    uint32_t combine_size;
+    uint32_t hash_type;
+    uint32_t bucket_type;
+    uint32_t index_type;
+    bool grow_index;
+    bool slab;
+    bool extent;
 
     void reset() {
         max_mem_mb = SHM_MAX_MEM_MB;
@@ -553,23 +1363,47 @@ struct config {
         try_w_lk_interval = SHM_TRYLOCK_INTERVAL;
         detect_r_dl_ticks = SHM_TRYLOCK_TICKS;
         detect_w_dl_ticks = SHM_TRYLOCK_TICKS;
+        lock_type = SHM_LOCK_TYPE_MUTEX;
+        shard_count = 1;
+        optimistic_get = false;
+        combine_size = 0;
+        hash_type = SHM_HASH_TYPE_SIMPLE;
+        bucket_type = SHM_BUCKET_TYPE_PRIME;
+        index_type = SHM_INDEX_TYPE_CHAIN;
+        grow_index = false;
+        slab = false;
+        extent = false;
     }
 };
 
 struct context {
     int lock_fd;
+    int32_t reader_slot;
+    int32_t process_index;
+    pid_t process_pid;
+    uint32_t update_depth;
     bool enable_create;
     bool enable_stats;
     struct memory_info *memory;
+    struct shard *shards;
+    struct process_slot *processes;
+    int32_t *segment_owner;
     struct local_stats local_stats;
     struct ht_segment ht_segment;
     struct val_segments val_segments;
 
     void reset() {
         lock_fd = -1;
+        reader_slot = -1;
+        process_index = -1;
+        process_pid = 0;
+        update_depth = 0;
         enable_create = true;
         enable_stats = true;
         memory = nullptr;
+        shards = nullptr;
+        processes = nullptr;
+        segment_owner = nullptr;
         local_stats.reset();
         ht_segment.item.reset();
         val_segments.current = 0;
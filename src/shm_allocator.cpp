@@ -1,5 +1,6 @@
 #include "shm_allocator.h"
 #include "shm_hashtable.h"
+#include "shm_lock.h"
 #include "shm_memory.h"
 #include <cerrno>
 #include <unistd.h>
@@ -30,29 +31,40 @@ int shm_allocator::init_val_segment(uint32_t type, const char *file, mem_segment
     return res;
 }
 
-int shm_allocator::create_val_segment(context &context, const config &config) {
+int shm_allocator::create_val_segment(context &context, const config &config, shard &shard) {
     int res;
+    // the caller holds the shard lock, segments are numbered under the global lock
+    if ((res = shm_lock::write_lock(context, config, context.memory->global_lock, context.memory->global_stats)) != 0) {
+        return res;
+    }
+    if ((res = open_val_segment(context, config)) != 0) {
+        printf("%s %s: pid: %d open_val_segment() failed.\n", __FILE__, __func__, getpid());
+        shm_lock::write_unlock(context, context.memory->global_lock);
+        return res;
+    }
     uint32_t index = context.val_segments.current;
-    if (index >= context.memory->basic_unit.segment.max) {
-        printf("%s %s: pid: %d map() failed.\n", __FILE__, __func__, getpid());
+    if (!can_grow(context, shard)) {
+        shm_lock::write_unlock(context, context.memory->global_lock);
         return ENOSPC;
     }
-    if (index != context.memory->basic_unit.segment.current) {
-        printf("%s %s: pid: %d map() failed.\n", __FILE__, __func__, getpid());
-        return EINVAL;
-    }
     res = shm_allocator::init_val_segment(config.memory_type, config.file, context.val_segments.items[index], index,
                                           context.memory->basic_unit.segment.size, context.enable_create);
     if (res != 0) {
         printf("%s %s: pid: %d init_val_segment() failed.\n", __FILE__, __func__, getpid());
+        shm_lock::write_unlock(context, context.memory->global_lock);
         return res;
     }
-    context.memory->idle_list.add_val_segment(context.val_segments, index,
-                                              context.memory->basic_unit.block.max_of_each);
+    context.segment_owner[index] = shard.lock.shard_id;
+    // processes attach every segment below 'current' without the global lock, ht_repair() rebuilds the idle list
+    // from the segments below 'current' if we die before the blocks are added
+    __sync_synchronize();
     ++context.memory->basic_unit.segment.current;
     ++context.val_segments.current;
-    printf("%s %s: pid: %d create new segment #%u idle = %u.\n", __FILE__, __func__, getpid(),
-           context.val_segments.current, context.memory->idle_list.block_current);
+    add_idle_run(context, shard, index, 0, context.memory->basic_unit.block.max_of_each);
+    ++shard.idle_list.segment_count;
+    shm_lock::write_unlock(context, context.memory->global_lock);
+    printf("%s %s: pid: %d create new segment #%u for shard %d idle = %u.\n", __FILE__, __func__, getpid(),
+           context.val_segments.current, shard.lock.shard_id, shard.idle_list.block_current);
     return res;
 }
 
@@ -89,35 +101,41 @@ int shm_allocator::remove_all(uint32_t type, const char *file, ht_segment &ht_se
     return res;
 }
 
-hash_entry *shm_allocator::alloc_hash_entry(context &context, const config &config, const key_info &key_info,
+hash_entry *shm_allocator::alloc_hash_entry(context &context, const config &config, shard &shard,
+                                            const key_info &key_info, uint32_t hash_code,
                                             const value_info &value_info) {
     hash_entry *new_entry;
-    uint32_t total = SHM_MEM_ALIGN_BYTE(key_info.length) + SHM_MEM_ALIGN_BYTE(value_info.length);
-    uint32_t rest_of_each_block = context.memory->basic_unit.block.size - (int32_t)sizeof(block_entry);
-    uint32_t block_used = (total + rest_of_each_block - 1) / rest_of_each_block;
-    new_entry = do_alloc_hash_entry(context, block_used, key_info, value_info);
+    uint32_t size_class = class_of(context, key_info.length, value_info.length);
+    uint32_t block_used = size_class != 0 ? 0 : blocks_of(context, key_info.length, value_info.length);
+    new_entry = do_alloc_hash_entry(context, shard, size_class, block_used, key_info, hash_code, value_info);
     if (new_entry != nullptr) {
         return new_entry;
     }
+    int res = ENOSPC;
     if (context.memory->basic_unit.segment.current < context.memory->basic_unit.segment.max) {
-        if (create_val_segment(context, config) == 0) {
-            new_entry = do_alloc_hash_entry(context, block_used, key_info, value_info);
-        } else {
+        res = create_val_segment(context, config, shard);
+        if (res == 0) {
+            new_entry = do_alloc_hash_entry(context, shard, size_class, block_used, key_info, hash_code, value_info);
+        } else if (res != ENOSPC) {
             printf("%s %s: pid: %d create_val_segment() failed.\n", __FILE__, __func__, getpid());
             return nullptr;
         }
-    } else {
-        if (context.memory->busy_list.entry_current > 0) {
-            if (shm_hashtable::ht_recycle(context, config, block_used, false) == 0) {
-                new_entry = do_alloc_hash_entry(context, block_used, key_info, value_info);
+    }
+    if (res == ENOSPC) {
+        if (shard.busy_list.entry_current > 0) {
+            if (shm_hashtable::ht_recycle(context, config, shard, size_class, block_used, false) == 0) {
+                new_entry =
+                    do_alloc_hash_entry(context, shard, size_class, block_used, key_info, hash_code, value_info);
             } else {
                 printf("%s %s: pid: %d ht_recycle() failed.\n", __FILE__, __func__, getpid());
-                if (shm_hashtable::ht_recycle(context, config, block_used, true) == 0) {
-                    new_entry = do_alloc_hash_entry(context, block_used, key_info, value_info);
+                if (shm_hashtable::ht_recycle(context, config, shard, size_class, block_used, true) == 0) {
+                    new_entry =
+                        do_alloc_hash_entry(context, shard, size_class, block_used, key_info, hash_code, value_info);
                 } else {
                     printf("%s %s: pid: %d ht_recycle(force) failed -> ht_clear()!\n", __FILE__, __func__, getpid());
-                    shm_hashtable::ht_clear(context, context.memory->global_stats);
-                    new_entry = do_alloc_hash_entry(context, block_used, key_info, value_info);
+                    shm_hashtable::ht_clear(context, shard, context.memory->global_stats);
+                    new_entry =
+                        do_alloc_hash_entry(context, shard, size_class, block_used, key_info, hash_code, value_info);
                 }
             }
         } else {
@@ -131,18 +149,47 @@ hash_entry *shm_allocator::alloc_hash_entry(context &context, const config &conf
     return new_entry;
 }
 
-hash_entry *shm_allocator::do_alloc_hash_entry(context &context, uint32_t required_block, const key_info &key_info,
+hash_entry *shm_allocator::do_alloc_hash_entry(context &context, shard &shard, uint32_t size_class,
+                                               uint32_t required_block, const key_info &key_info, uint32_t hash_code,
                                                const value_info &value_info) {
-    if (required_block > context.memory->idle_list.block_current) {
+    if (!has_room(context, shard, size_class, required_block)) {
+        // blocks parked in the magazines of other (maybe dead) processes are ours again
+        drain_magazines(context, shard, false);
+        if (!has_room(context, shard, size_class, required_block)) {
+            return nullptr;
+        }
+    }
+    int64_t new_offset = shard.entry_queue.peek();
+    if (new_offset == 0) {
+        printf("%s %s: pid: %d no free hash entry.\n", __FILE__, __func__, getpid());
         return nullptr;
     }
-    hash_entry *new_entry = (hash_entry *)(context.ht_segment.item.base + context.memory->entry_queue.offset_2base) +
-                            context.memory->entry_queue.tail;
-    context.memory->entry_queue.tail_forward();
-    // set new hash entry's attributes: 'block_used' and 'first_addr' during allocating
-    if (!context.memory->idle_list.alloc_hash_entry_block(context.val_segments, *new_entry, required_block)) {
+    auto *new_entry = (hash_entry *)(context.ht_segment.item.base + new_offset);
+    shard.journal.fresh = new_offset;
+    __sync_synchronize();
+    shard.entry_queue.take(context.ht_segment.item.base);
+    new_entry->begin_update();
+    // set new hash entry's attributes: 'block_used', 'first_addr', the slot or the extent during allocating, no
+    // class and no block at all means inline
+    new_entry->size_class = 0;
+    new_entry->slab_slot = 0;
+    new_entry->extent = 0;
+    new_entry->inlined = 0;
+    bool allocated = true;
+    if (size_class != 0) {
+        allocated = alloc_slot(context, shard, *new_entry, size_class);
+    } else if (required_block != 0) {
+        allocated = alloc_extent(context, shard, *new_entry, required_block) ||
+                    alloc_blocks(context, shard, *new_entry, required_block);
+    } else {
+        new_entry->block_used = 0;
+        new_entry->first_addr.reset();
+        new_entry->last_addr.reset();
+        new_entry->inlined = 1;
+    }
+    if (!allocated) {
         printf("%s %s: pid: %d alloc_hash_entry_block() failed.\n", __FILE__, __func__, getpid());
-        shm_hashtable::ht_clear(context, context.memory->global_stats);
+        shm_hashtable::ht_clear(context, shard, context.memory->global_stats);
         return nullptr;
     }
     uint32_t write_start{}, write_end{};
@@ -150,62 +197,482 @@ hash_entry *shm_allocator::do_alloc_hash_entry(context &context, uint32_t requir
         write_start = local_stats::get_cpu_cycle();
     }
     // set new hash entry's other attributes and key/value data
-    new_entry->write_data(context.val_segments, key_info, value_info, context.memory->basic_unit.block.size);
+    new_entry->write_data(context.val_segments, key_info, hash_code, value_info,
+                          context.memory->basic_unit.block.size);
     if (context.enable_stats) {
         write_end = local_stats::get_cpu_cycle();
         context.local_stats.w_data.all_cost += write_end - write_start;
         ++context.local_stats.w_data.call_count;
         context.local_stats.w_data.max_cost = std::max(write_end - write_start, context.local_stats.w_data.max_cost);
     }
+    new_entry->end_update();
+    __sync_synchronize();
+    shard.journal.fresh = 0;
     return new_entry;
 }
 
-int shm_allocator::free_hash_entry(context &context, int64_t removed_offset) {
+int shm_allocator::free_hash_entry(context &context, shard &shard, int64_t removed_offset) {
     auto removed_entry = (hash_entry *)(context.ht_segment.item.base + removed_offset);
-    if (!context.memory->idle_list.free_hash_entry_block(context.val_segments, *removed_entry)) {
+    shard.journal.victim = removed_offset;
+    __sync_synchronize();
+    // the blocks may be reused as soon as they are back on the idle list
+    removed_entry->begin_update();
+    // pinned blocks are freed by the release of the last view on them
+    if (!retire_pins(shard, *removed_entry) && !free_blocks(context, shard, *removed_entry)) {
         printf("%s %s: pid: %d free_hash_entry() failed.\n", __FILE__, __func__, getpid());
         return -1;
     }
-    hash_entry *first_entry = (hash_entry *)(context.ht_segment.item.base + context.memory->entry_queue.offset_2base) +
-                              context.memory->entry_queue.head;
-    if (first_entry != removed_entry) {
-        int64_t prev_lru_offset = first_entry->lru_prev;
-        auto *prev_lru_entry = (hash_entry *)(context.ht_segment.item.base + prev_lru_offset);
-        int64_t next_lru_offset = first_entry->lru_next;
-        auto *next_lru_entry = (hash_entry *)(context.ht_segment.item.base + next_lru_offset);
-        prev_lru_entry->lru_next = removed_offset;
-        next_lru_entry->lru_prev = removed_offset;
-        char *key_data = context.val_segments.items[first_entry->first_addr.index].base +
-                         (uint32_t)first_entry->first_addr.number * context.memory->basic_unit.block.size +
-                         sizeof(block_entry);
-        key_info temp_key_info(first_entry->key_len, key_data);
-        uint32_t ht_index = shm_hashtable::bucket_index(context, temp_key_info);
-        int64_t old_offset = context.memory->hashtable.bucket[ht_index];
-        bool found = false;
-        hash_entry *prev_entry = nullptr;
-        hash_entry *old_entry = nullptr;
-        while (old_offset > 0) {
-            old_entry = (hash_entry *)(context.ht_segment.item.base + old_offset);
-            if (shm_hashtable::same_key(context, old_entry, temp_key_info)) {
-                found = true;
-                break;
-            }
-            old_offset = old_entry->hash_next;
-            prev_entry = old_entry;
+    // no other entry moves, the slot goes on the free stack with a header that holds no blocks for ht_repair()
+    removed_entry->reset(0);
+    shard.entry_queue.put(context.ht_segment.item.base, removed_offset);
+    removed_entry->end_update();
+    __sync_synchronize();
+    shard.journal.victim = 0;
+    --shard.hashtable.inserted;
+    --shard.busy_list.entry_current;
+    return 0;
+}
+
+bool shm_allocator::rewrite_hash_entry(context &context, shard &shard, int64_t entry_offset,
+                                       const value_info &value_info) {
+    auto *entry = (hash_entry *)(context.ht_segment.item.base + entry_offset);
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    uint32_t size_class = class_of(context, entry->key_len, value_info.length);
+    uint32_t block_used = size_class != 0 ? 0 : blocks_of(context, entry->key_len, value_info.length);
+    // a slot is only reused by a value of its own size class, moving to another class or in or out of the entry
+    // takes a new entry. An extent is cut but never grown in place, the longer value looks for a longer run.
+    if (size_class != entry->size_class || (size_class == 0 && (block_used == 0) != (entry->inlined != 0)) ||
+        pinned(shard, *entry) || (entry->extent != 0 && block_used > entry->block_used)) {
+        return false;
+    }
+    uint32_t extra = block_used > entry->block_used ? block_used - entry->block_used : 0;
+    if (extra > idle_blocks(context, shard)) {
+        drain_magazines(context, shard, false);
+        if (extra > shard.idle_list.block_current + shard.extents.blocks) {
+            return false;
+        }
+    }
+    // the last block both the old and the new value use, the blocks of an extent have no links to follow
+    block_entry *last_block = nullptr;
+    block_addr last_addr = entry->first_addr;
+    if (entry->extent == 0 && entry->inlined == 0) {
+        last_block = (block_entry *)context.val_segments.block(entry->first_addr, block_size);
+        for (uint32_t number = 1; last_block != nullptr && number < std::min(block_used, entry->block_used);
+             ++number) {
+            last_addr = last_block->next;
+            last_block = (block_entry *)context.val_segments.block(last_addr, block_size);
         }
-        if (!found) {
-            printf("%s %s: pid: %d free_hash_entry() failed, clear hashtable...\n", __FILE__, __func__, getpid());
-            shm_hashtable::ht_clear(context, context.memory->global_stats);
+        if (last_block == nullptr) {
+            return false;
         }
-        if (prev_entry != nullptr) {
-            prev_entry->hash_next = removed_offset;
+    }
+    // a writer dying half way leaves a torn value, ht_repair() drops the entry like a fresh one
+    shard.journal.fresh = entry_offset;
+    __sync_synchronize();
+    entry->begin_update();
+    hash_entry rest(0);
+    if (entry->block_used > block_used) {
+        rest.block_used = entry->block_used - block_used;
+        rest.last_addr = entry->last_addr;
+        if (entry->extent != 0) {
+            rest.first_addr = entry->first_addr;
+            rest.first_addr.number += (int32_t)block_used;
+            rest.extent = 1;
+            last_addr.number += (int32_t)block_used - 1;
         } else {
-            context.memory->hashtable.bucket[ht_index] = removed_offset;
+            rest.first_addr = last_block->next;
+            last_block->next.reset();
+        }
+        entry->last_addr = last_addr;
+        if (!free_blocks(context, shard, rest)) {
+            printf("%s %s: pid: %d free_blocks() failed, clear hashtable...\n", __FILE__, __func__, getpid());
+            shm_hashtable::ht_clear(context, shard, context.memory->global_stats);
+            return false;
+        }
+    } else if (extra > 0) {
+        if (!alloc_blocks(context, shard, rest, extra)) {
+            printf("%s %s: pid: %d alloc_blocks() failed, clear hashtable...\n", __FILE__, __func__, getpid());
+            shm_hashtable::ht_clear(context, shard, context.memory->global_stats);
+            return false;
+        }
+        last_block->next = rest.first_addr;
+        entry->last_addr = rest.last_addr;
+    }
+    entry->block_used = block_used;
+    uint32_t write_start{}, write_end{};
+    if (context.enable_stats) {
+        write_start = local_stats::get_cpu_cycle();
+    }
+    entry->write_value(context.val_segments, value_info, block_size);
+    if (context.enable_stats) {
+        write_end = local_stats::get_cpu_cycle();
+        context.local_stats.w_data.all_cost += write_end - write_start;
+        ++context.local_stats.w_data.call_count;
+        context.local_stats.w_data.max_cost = std::max(write_end - write_start, context.local_stats.w_data.max_cost);
+    }
+    entry->end_update();
+    __sync_synchronize();
+    shard.journal.fresh = 0;
+    return true;
+}
+
+uint32_t shm_allocator::blocks_of(const context &context, uint32_t key_len, uint32_t value_len) {
+    if (fits_inline(key_len, value_len)) {
+        return 0;
+    }
+    uint32_t total = SHM_MEM_ALIGN_BYTE(key_len) + SHM_MEM_ALIGN_BYTE(value_len);
+    uint32_t rest_of_each_block = context.memory->basic_unit.block.size - (uint32_t)sizeof(block_entry);
+    return (total + rest_of_each_block - 1) / rest_of_each_block;
+}
+
+uint32_t shm_allocator::class_of(const context &context, uint32_t key_len, uint32_t value_len) {
+    if (fits_inline(key_len, value_len)) {
+        return 0;
+    }
+    uint32_t total = (uint32_t)sizeof(block_entry) + SHM_MEM_ALIGN_BYTE(key_len) + SHM_MEM_ALIGN_BYTE(value_len);
+    for (uint32_t size_class = 1; size_class <= context.memory->basic_unit.block.slab_classes; ++size_class) {
+        if (total <= SHM_SLAB_SLOT_SIZE(size_class)) {
+            return size_class;
         }
-        removed_entry->update(*first_entry);
     }
-    context.memory->entry_queue.head_forward();
-    --context.memory->hashtable.inserted;
-    --context.memory->busy_list.entry_current;
     return 0;
 }
+
+bool shm_allocator::fits_inline(uint32_t key_len, uint32_t value_len) {
+    return (uint64_t)SHM_MEM_ALIGN_BYTE(key_len) + SHM_MEM_ALIGN_BYTE(value_len) <= SHM_INLINE_SIZE;
+}
+
+uint32_t shm_allocator::slab_classes(uint32_t block_size) {
+    // a page of the largest class still holds two slots, anything bigger is better off with whole blocks
+    uint32_t count = 0;
+    while (count < SHM_SLAB_CLASSES && slab_page::capacity(block_size, count + 1) >= 2) {
+        ++count;
+    }
+    return count;
+}
+
+bool shm_allocator::has_room(context &context, const shard &shard, uint32_t size_class, uint32_t block_used) {
+    if (size_class == 0) {
+        return idle_blocks(context, shard) >= block_used;
+    }
+    return shard.slabs.partial[size_class - 1].valid_addr() || idle_blocks(context, shard) >= 1;
+}
+
+bool shm_allocator::can_grow(context &context, const shard &shard) {
+    uint32_t current = context.memory->basic_unit.segment.current;
+    if (current >= context.memory->basic_unit.segment.max) {
+        return false;
+    }
+    // keep one segment in reserve for every other shard that does not own any yet
+    bool owned[SHM_MAX_SHARDS] = {false};
+    for (uint32_t index = 0; index < current; ++index) {
+        owned[context.segment_owner[index]] = true;
+    }
+    uint32_t reserved = 0;
+    for (uint32_t index = 0; index < context.memory->layout.shard_count; ++index) {
+        if (!owned[index] && (int32_t)index != shard.lock.shard_id) {
+            ++reserved;
+        }
+    }
+    return owned[shard.lock.shard_id] ? context.memory->basic_unit.segment.max - current > reserved : true;
+}
+
+uint32_t shm_allocator::idle_blocks(context &context, const shard &shard) {
+    block_magazine *magazine = magazine_of(context, shard);
+    return shard.idle_list.block_current + (magazine != nullptr ? magazine->count : 0) + shard.extents.blocks;
+}
+
+void shm_allocator::add_idle_run(context &context, shard &shard, uint32_t index, uint32_t first, uint32_t count) {
+    block_addr addr;
+    addr.index = (int32_t)index;
+    addr.number = (int32_t)first;
+    if (context.memory->basic_unit.block.extents == 0 || count < 2 || !shard.extents.put(addr, count)) {
+        shard.idle_list.add_blocks(context.val_segments, index, first, count);
+    }
+}
+
+void shm_allocator::reset_idle(context &context, shard &shard) {
+    shard.idle_list.block_current = 0;
+    shard.idle_list.segment_count = 0;
+    shard.idle_list.fake_block.reset();
+    shard.extents.reset();
+    for (uint32_t index = 0; index < context.val_segments.current; ++index) {
+        if (context.segment_owner[index] == shard.lock.shard_id) {
+            add_idle_run(context, shard, index, 0, context.memory->basic_unit.block.max_of_each);
+            ++shard.idle_list.segment_count;
+        }
+    }
+}
+
+void shm_allocator::drain_magazines(context &context, shard &shard, bool forget) {
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    for (uint32_t index = 0; index < context.memory->process_limit; ++index) {
+        block_magazine &magazine = context.processes[index].magazine;
+        // 'count' before 'shard_id': a magazine rebound to another shard is filled only after its id changed
+        uint32_t count = magazine.count;
+        __sync_synchronize();
+        if (count == 0 || magazine.shard_id != shard.lock.shard_id) {
+            continue;
+        }
+        if (forget) {
+            magazine.forget();
+        } else {
+            magazine.drain(context.val_segments, block_size, shard.idle_list);
+        }
+    }
+}
+
+block_magazine *shm_allocator::magazine_of(context &context, const shard &shard) {
+    if (shm_lock::attach_process(context) != 0) {
+        return nullptr;
+    }
+    block_magazine &magazine = context.processes[context.process_index].magazine;
+    if (magazine.shard_id != shard.lock.shard_id) {
+        // the blocks belong to a shard whose lock we do not hold, they wait there for its next shortage
+        if (magazine.count != 0) {
+            return nullptr;
+        }
+        magazine.shard_id = shard.lock.shard_id;
+        __sync_synchronize();
+    }
+    return &magazine;
+}
+
+bool shm_allocator::alloc_extent(context &context, shard &shard, hash_entry &new_entry, uint32_t block_used) {
+    block_addr first;
+    if (context.memory->basic_unit.block.extents == 0 || block_used < 2 || !shard.extents.take(block_used, first)) {
+        return false;
+    }
+    ((block_entry *)context.val_segments.block(first, context.memory->basic_unit.block.size))->reset();
+    new_entry.first_addr = first;
+    new_entry.last_addr = first;
+    new_entry.last_addr.number += (int32_t)block_used - 1;
+    new_entry.block_used = block_used;
+    new_entry.extent = 1;
+    return true;
+}
+
+bool shm_allocator::alloc_blocks(context &context, shard &shard, hash_entry &new_entry, uint32_t block_used) {
+    block_magazine *magazine = magazine_of(context, shard);
+    bool direct = magazine == nullptr || block_used > SHM_MAGAZINE_SIZE;
+    // runs are cut up only once the loose blocks are gone
+    uint32_t loose = shard.idle_list.block_current + (direct ? 0 : magazine->count);
+    block_addr first;
+    uint32_t carved = 0;
+    while (loose < block_used && shard.extents.carve(block_used - loose, first, carved)) {
+        shard.idle_list.add_blocks(context.val_segments, (uint32_t)first.index, (uint32_t)first.number, carved);
+        loose += carved;
+    }
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    if (direct) {
+        // has_room() counted our magazine, a chain longer than it takes those blocks through the idle list
+        if (magazine != nullptr && shard.idle_list.block_current < block_used) {
+            magazine->drain(context.val_segments, block_size, shard.idle_list);
+        }
+        return shard.idle_list.alloc_hash_entry_block(context.val_segments, new_entry, block_used);
+    }
+    if (magazine->count < block_used) {
+        uint32_t wanted = std::min(std::max(block_used - magazine->count, (uint32_t)SHM_MAGAZINE_BATCH),
+                                   shard.idle_list.block_current);
+        if (magazine->count + wanted < block_used) {
+            magazine->drain(context.val_segments, block_size, shard.idle_list);
+            return shard.idle_list.alloc_hash_entry_block(context.val_segments, new_entry, block_used);
+        }
+        magazine->refill(context.val_segments, block_size, shard.idle_list, wanted);
+    }
+    magazine->take(context.val_segments, block_size, new_entry, block_used);
+    return true;
+}
+
+bool shm_allocator::free_blocks(context &context, shard &shard, hash_entry &old_entry) {
+    if (old_entry.inlined != 0) {
+        return true;
+    }
+    if (old_entry.size_class != 0) {
+        return free_slot(context, shard, old_entry);
+    }
+    if (old_entry.extent != 0) {
+        if (context.val_segments.block(old_entry.first_addr, context.memory->basic_unit.block.size) == nullptr ||
+            (uint32_t)old_entry.first_addr.number + old_entry.block_used >
+                context.memory->basic_unit.block.max_of_each) {
+            return false;
+        }
+        add_idle_run(context, shard, (uint32_t)old_entry.first_addr.index, (uint32_t)old_entry.first_addr.number,
+                     old_entry.block_used);
+        return true;
+    }
+    block_magazine *magazine = magazine_of(context, shard);
+    if (magazine == nullptr || old_entry.block_used > SHM_MAGAZINE_SIZE) {
+        return shard.idle_list.free_hash_entry_block(context.val_segments, old_entry);
+    }
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    bool res = magazine->put(context.val_segments, block_size, old_entry);
+    if (magazine->count > SHM_MAGAZINE_SIZE) {
+        magazine->drain(context.val_segments, block_size, shard.idle_list);
+    }
+    return res;
+}
+
+bool shm_allocator::alloc_slot(context &context, shard &shard, hash_entry &new_entry, uint32_t size_class) {
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    slab_list &slabs = shard.slabs;
+    if (!slabs.partial[size_class - 1].valid_addr()) {
+        hash_entry page_entry(0);
+        if (!alloc_blocks(context, shard, page_entry, 1)) {
+            return false;
+        }
+        slabs.page(context.val_segments, block_size, page_entry.first_addr)->reset(size_class);
+        slabs.link(context.val_segments, block_size, page_entry.first_addr);
+        ++slabs.pages;
+    }
+    block_addr page_addr = slabs.partial[size_class - 1];
+    slab_page *page = slabs.page(context.val_segments, block_size, page_addr);
+    uint32_t slot = page->free_slot;
+    if (slot != SHM_SLAB_NONE) {
+        page->free_slot = *(uint32_t *)((block_entry *)page->slot(slot))->data;
+    } else {
+        slot = page->fresh++;
+    }
+    if (++page->used == slab_page::capacity(block_size, size_class)) {
+        slabs.unlink(context.val_segments, block_size, page_addr);
+    }
+    // the slot is a chain of one block as far as the readers are concerned
+    ((block_entry *)page->slot(slot))->reset();
+    new_entry.block_used = 0;
+    new_entry.first_addr = page_addr;
+    new_entry.size_class = size_class;
+    new_entry.slab_slot = slot;
+    return true;
+}
+
+bool shm_allocator::free_slot(context &context, shard &shard, const hash_entry &old_entry) {
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    slab_list &slabs = shard.slabs;
+    auto *page = (slab_page *)context.val_segments.block(old_entry.first_addr, block_size);
+    if (page == nullptr || page->size_class != old_entry.size_class || old_entry.slab_slot >= page->fresh ||
+        page->used == 0) {
+        return false;
+    }
+    bool full = page->used == slab_page::capacity(block_size, page->size_class);
+    *(uint32_t *)((block_entry *)page->slot(old_entry.slab_slot))->data = page->free_slot;
+    page->free_slot = old_entry.slab_slot;
+    if (--page->used == 0) {
+        if (!full) {
+            slabs.unlink(context.val_segments, block_size, old_entry.first_addr);
+        }
+        --slabs.pages;
+        hash_entry page_entry(0);
+        page_entry.first_addr = old_entry.first_addr;
+        page_entry.last_addr = old_entry.first_addr;
+        page_entry.block_used = 1;
+        return free_blocks(context, shard, page_entry);
+    }
+    if (full) {
+        slabs.link(context.val_segments, block_size, old_entry.first_addr);
+    }
+    return true;
+}
+
+bool shm_allocator::pin_blocks(context &context, shard &shard, const hash_entry &entry, uint32_t &pin, uint64_t &tag) {
+    pin_table &pins = shard.pins;
+    uint32_t ticket = __sync_add_and_fetch(&pins.ticket, 1);
+    // readers holding the read lock race each other for a slot, writers are shut out until they are done
+    for (uint32_t index = 0; index < SHM_PIN_SLOTS; ++index) {
+        pin_slot &slot = pins.slots[index];
+        uint64_t current = slot.tag;
+        if ((uint32_t)current != SHM_PIN_FREE ||
+            !__sync_bool_compare_and_swap(&slot.tag, current, (uint64_t)ticket << 32 | SHM_PIN_LIVE)) {
+            continue;
+        }
+        slot.owner = context.process_pid;
+        slot.first_addr = entry.first_addr;
+        slot.block_used = entry.block_used;
+        slot.last_addr = entry.last_addr;
+        slot.size_class = entry.size_class;
+        slot.slab_slot = entry.slab_slot;
+        slot.extent = entry.extent;
+        __sync_add_and_fetch(&pins.used, 1);
+        pin = index;
+        tag = (uint64_t)ticket << 32 | SHM_PIN_LIVE;
+        return true;
+    }
+    pins.starved = 1;
+    return false;
+}
+
+int shm_allocator::unpin_blocks(context &context, shard &shard, uint32_t pin, uint64_t tag, bool locked) {
+    if (pin >= SHM_PIN_SLOTS) {
+        return EINVAL;
+    }
+    pin_table &pins = shard.pins;
+    pin_slot &slot = pins.slots[pin];
+    uint64_t free_tag = (tag & ~0xffffffffull) | SHM_PIN_FREE;
+    if (__sync_bool_compare_and_swap(&slot.tag, (tag & ~0xffffffffull) | SHM_PIN_LIVE, free_tag)) {
+        __sync_sub_and_fetch(&pins.used, 1);
+        return 0;
+    }
+    uint64_t retired_tag = (tag & ~0xffffffffull) | SHM_PIN_RETIRED;
+    if (slot.tag != retired_tag) {
+        // cleared (or reaped) meanwhile, ht_clear() took the blocks back along with every other one
+        return 0;
+    }
+    if (!locked) {
+        return EAGAIN;
+    }
+    slot.tag = free_tag;
+    __sync_sub_and_fetch(&pins.used, 1);
+    for (auto &other : pins.slots) {
+        if ((uint32_t)other.tag != SHM_PIN_FREE && other.holds(slot.first_addr, slot.size_class, slot.slab_slot)) {
+            return 0;
+        }
+    }
+    hash_entry retired(0);
+    retired.first_addr = slot.first_addr;
+    retired.block_used = slot.block_used;
+    retired.last_addr = slot.last_addr;
+    retired.size_class = slot.size_class;
+    retired.slab_slot = slot.slab_slot;
+    retired.extent = slot.extent;
+    return free_blocks(context, shard, retired) ? 0 : EFAULT;
+}
+
+void shm_allocator::reap_pins(context &context, shard &shard) {
+    shard.pins.starved = 0;
+    for (uint32_t index = 0; index < SHM_PIN_SLOTS; ++index) {
+        pin_slot &slot = shard.pins.slots[index];
+        uint64_t current = slot.tag;
+        if ((uint32_t)current != SHM_PIN_FREE && slot.owner != 0 && shm_lock::owner_dead(slot.owner)) {
+            unpin_blocks(context, shard, index, current, true);
+        }
+    }
+}
+
+bool shm_allocator::retire_pins(shard &shard, const hash_entry &old_entry) {
+    if (shard.pins.used == 0) {
+        return false;
+    }
+    bool pinned = false;
+    for (auto &slot : shard.pins.slots) {
+        uint64_t current = slot.tag;
+        // a view released meanwhile no longer needs the blocks
+        if ((uint32_t)current == SHM_PIN_LIVE &&
+            slot.holds(old_entry.first_addr, old_entry.size_class, old_entry.slab_slot) &&
+            __sync_bool_compare_and_swap(&slot.tag, current, (current & ~0xffffffffull) | SHM_PIN_RETIRED)) {
+            pinned = true;
+        }
+    }
+    return pinned;
+}
+
+bool shm_allocator::pinned(const shard &shard, const hash_entry &entry) {
+    if (shard.pins.used == 0) {
+        return false;
+    }
+    // pins are taken under the read lock, with the write lock held none can show up meanwhile
+    for (auto &slot : shard.pins.slots) {
+        if ((uint32_t)slot.tag == SHM_PIN_LIVE && slot.holds(entry.first_addr, entry.size_class, entry.slab_slot)) {
+            return true;
+        }
+    }
+    return false;
+}
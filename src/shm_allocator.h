@@ -9,17 +9,50 @@ public:
                                bool create);
     static int init_val_segment(uint32_t type, const char *file, mem_segment &segment, uint32_t index, uint32_t size,
                                 bool create);
-    static int create_val_segment(context &context, const config &config);
+    static int create_val_segment(context &context, const config &config, shard &shard);
     static int open_val_segment(context &context, const config &config);
     static int remove_all(uint32_t type, const char *file, ht_segment &ht_segment, val_segments &val_segments,
                           bool create);
-    static hash_entry *alloc_hash_entry(context &context, const config &config, const key_info &key_info,
-                                        const value_info &value_info);
-    static int free_hash_entry(context &context, int64_t removed_offset);
+    static hash_entry *alloc_hash_entry(context &context, const config &config, shard &shard,
+                                        const key_info &key_info, uint32_t hash_code, const value_info &value_info);
+    static int free_hash_entry(context &context, shard &shard, int64_t removed_offset);
+    // writes the new value into the blocks of the entry, trimming or extending its chain: false, with nothing
+    // changed, if a view pins the blocks or the extra blocks are not idle right away
+    static bool rewrite_hash_entry(context &context, shard &shard, int64_t entry_offset, const value_info &value_info);
+    // 0 if the key and the value are kept inline
+    static uint32_t blocks_of(const context &context, uint32_t key_len, uint32_t value_len);
+    // smallest size class whose slot holds the key and the value, 0 if they take a chain of whole blocks or are kept
+    // inline
+    static uint32_t class_of(const context &context, uint32_t key_len, uint32_t value_len);
+    static bool fits_inline(uint32_t key_len, uint32_t value_len);
+    static uint32_t slab_classes(uint32_t block_size);
+    // a slot of 'size_class' or 'block_used' blocks can be handed out without recycling
+    static bool has_room(context &context, const shard &shard, uint32_t size_class, uint32_t block_used);
+    static uint32_t idle_blocks(context &context, const shard &shard);
+    // a run of idle blocks from 'first' on in segment 'index', kept whole if runs are on
+    static void add_idle_run(context &context, shard &shard, uint32_t index, uint32_t first, uint32_t count);
+    // every block of the shard's segments is idle again
+    static void reset_idle(context &context, shard &shard);
+    static void drain_magazines(context &context, shard &shard, bool forget);
+    // under the shard lock, read or write
+    static bool pin_blocks(context &context, shard &shard, const hash_entry &entry, uint32_t &pin, uint64_t &tag);
+    // EAGAIN if the entry is gone and the caller has to call again holding the write lock to free the blocks
+    static int unpin_blocks(context &context, shard &shard, uint32_t pin, uint64_t tag, bool locked);
+    static void reap_pins(context &context, shard &shard);
 
 private:
-    static hash_entry *do_alloc_hash_entry(context &context, uint32_t block_used, const key_info &key_info,
+    static hash_entry *do_alloc_hash_entry(context &context, shard &shard, uint32_t size_class, uint32_t block_used,
+                                           const key_info &key_info, uint32_t hash_code,
                                            const value_info &value_info);
+    static bool can_grow(context &context, const shard &shard);
+    static block_magazine *magazine_of(context &context, const shard &shard);
+    static bool alloc_extent(context &context, shard &shard, hash_entry &new_entry, uint32_t block_used);
+    static bool alloc_blocks(context &context, shard &shard, hash_entry &new_entry, uint32_t block_used);
+    static bool free_blocks(context &context, shard &shard, hash_entry &old_entry);
+    static bool alloc_slot(context &context, shard &shard, hash_entry &new_entry, uint32_t size_class);
+    static bool free_slot(context &context, shard &shard, const hash_entry &old_entry);
+    static bool retire_pins(shard &shard, const hash_entry &old_entry);
+    static bool pinned(const shard &shard, const hash_entry &entry);
 };
 
 #endif // SHMCACHE_SHM_ALLOCATOR_H
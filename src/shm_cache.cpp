@@ -4,12 +4,18 @@
 #include "shm_hashtable.h"
 #include "shm_lock.h"
 #include "shm_memory.h"
+#include "shm_swiss_index.h"
 #include <cerrno>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 shm_cache::shm_cache() { reset(); }
 
 shm_cache::~shm_cache() {
+    if (m_context.processes != nullptr && m_context.ht_segment.item.base != nullptr) {
+        shm_lock::detach_process(m_context);
+    }
     if (m_context.val_segments.items != nullptr) {
         free(m_context.val_segments.items);
         m_context.val_segments.items = nullptr;
@@ -95,10 +101,22 @@ int shm_cache::set(const key_info &key_info, const value_info &value_info) {
         printf("%s %s: pid: %d invalid value size.\n", __FILE__, __func__, getpid());
         return EINVAL;
     }
+    uint32_t hash_code = shm_hashtable::hash_key(m_context, key_info.data, key_info.length);
+    shard &shard = select_shard(hash_code);
+    if (m_context.memory->layout.scratch_size != 0 &&
+        key_info.length + value_info.length <= m_context.memory->layout.scratch_size) {
+        res = combine_set(shard, key_info, value_info, hash_code);
+        if (m_context.enable_stats) {
+            end = local_stats::get_cpu_cycle();
+            m_context.local_stats.set.all_cost += end - start;
+            ++m_context.local_stats.set.call_count;
+        }
+        return res;
+    }
     if (m_context.enable_stats) {
         lock_start = local_stats::get_cpu_cycle();
     }
-    if ((res = shm_lock::write_lock(m_context, m_config, m_context.memory->global_stats)) != 0) {
+    if ((res = shm_lock::write_lock(m_context, m_config, shard.lock, m_context.memory->global_stats)) != 0) {
         return res;
     }
     if (m_context.enable_stats) {
@@ -108,12 +126,12 @@ int shm_cache::set(const key_info &key_info, const value_info &value_info) {
         m_context.local_stats.w_lock.max_cost = std::max(lock_end - lock_start, m_context.local_stats.w_lock.max_cost);
     }
     check_consistence();
-    ++m_context.memory->global_stats.set.total;
-    res = shm_hashtable::ht_set(m_context, m_config, key_info, value_info);
+    __sync_add_and_fetch(&m_context.memory->global_stats.set.total, 1);
+    res = shm_hashtable::ht_set(m_context, m_config, shard, key_info, hash_code, value_info);
     if (res == 0) {
-        ++m_context.memory->global_stats.set.success;
+        __sync_add_and_fetch(&m_context.memory->global_stats.set.success, 1);
     }
-    shm_lock::write_unlock(m_context);
+    shm_lock::write_unlock(m_context, shard.lock);
     if (m_context.enable_stats) {
         end = local_stats::get_cpu_cycle();
         m_context.local_stats.set.all_cost += end - start;
@@ -137,12 +155,15 @@ int shm_cache::set_ttl(const key_info &key_info, uint32_t ttl) {
         printf("%s %s: pid: %d invalid ttl.\n", __FILE__, __func__, getpid());
         return EINVAL;
     }
-    if ((res = shm_lock::write_lock(m_context, m_config, m_context.memory->global_stats)) != 0) {
+    uint32_t hash_code = shm_hashtable::hash_key(m_context, key_info.data, key_info.length);
+    shard &shard = select_shard(hash_code);
+    if ((res = shm_lock::write_lock(m_context, m_config, shard.lock, m_context.memory->global_stats)) != 0) {
         return res;
     }
     check_consistence();
-    res = shm_hashtable::ht_set_expires(m_context, key_info, ttl == 0 ? 0 : ttl + (uint32_t)time(nullptr));
-    shm_lock::write_unlock(m_context);
+    res = shm_hashtable::ht_set_expires(m_context, shard, key_info, hash_code,
+                                        ttl == 0 ? 0 : ttl + (uint32_t)time(nullptr));
+    shm_lock::write_unlock(m_context, shard.lock);
     return res;
 }
 
@@ -156,18 +177,72 @@ int shm_cache::set_expires(const key_info &key_info, uint32_t expires) {
         printf("%s %s: pid: %d invalid expires.\n", __FILE__, __func__, getpid());
         return EINVAL;
     }
-    if ((res = shm_lock::write_lock(m_context, m_config, m_context.memory->global_stats)) != 0) {
+    uint32_t hash_code = shm_hashtable::hash_key(m_context, key_info.data, key_info.length);
+    shard &shard = select_shard(hash_code);
+    if ((res = shm_lock::write_lock(m_context, m_config, shard.lock, m_context.memory->global_stats)) != 0) {
         return res;
     }
     check_consistence();
-    res = shm_hashtable::ht_set_expires(m_context, key_info, expires);
-    shm_lock::write_unlock(m_context);
+    res = shm_hashtable::ht_set_expires(m_context, shard, key_info, hash_code, expires);
+    shm_lock::write_unlock(m_context, shard.lock);
     return res;
 }
 
 int shm_cache::get(const key_info &key_info, value_info &value_info, uint32_t lru) {
+    return do_get(key_info, value_info, value_range(0, UINT32_MAX, UINT32_MAX), lru, true);
+}
+
+int shm_cache::stat(const key_info &key_info, value_info &value_info) {
+    // a bounded get without any room stops right after the lookup, it is no get for the stats
+    int res = do_get(key_info, value_info, value_range(0, UINT32_MAX, 0), 0, false);
+    return res == ENOBUFS ? 0 : res;
+}
+
+int shm_cache::get_bounded(const key_info &key_info, value_info &value_info, uint32_t capacity, uint32_t lru) {
+    return do_get(key_info, value_info, value_range(0, UINT32_MAX, capacity), lru, true);
+}
+
+int shm_cache::get_range(const key_info &key_info, value_info &value_info, uint32_t offset, uint32_t length,
+                         uint32_t lru) {
+    return do_get(key_info, value_info, value_range(offset, length, UINT32_MAX), lru, true);
+}
+
+int shm_cache::get_alloc(const key_info &key_info, value_info &value_info, const value_allocator &allocator,
+                         uint32_t lru) {
+    if (key_info.length > m_config.max_key_size) {
+        printf("%s %s: pid: %d invalid key size.\n", __FILE__, __func__, getpid());
+        return ENAMETOOLONG;
+    }
+    // the first round only learns the length, a set in between that makes the value longer costs another round;
+    // the call counts as one get in the stats, whatever the number of rounds
+    uint32_t start{};
+    if (m_context.enable_stats) {
+        start = local_stats::get_cpu_cycle();
+    }
+    uint32_t capacity = 0;
+    value_info.data = nullptr;
     int res;
-    uint32_t start{}, end{}, lock_start{}, lock_end{};
+    while ((res = do_get(key_info, value_info, value_range(0, UINT32_MAX, capacity), lru, false)) == ENOBUFS) {
+        if (value_info.data != nullptr) {
+            allocator.release(value_info.data, allocator.arg);
+        }
+        capacity = value_info.length;
+        if ((value_info.data = allocator.alloc(capacity, allocator.arg)) == nullptr) {
+            return ENOMEM;
+        }
+    }
+    if (res != 0 && value_info.data != nullptr) {
+        allocator.release(value_info.data, allocator.arg);
+        value_info.data = nullptr;
+    }
+    count_get(res, value_info.length, start);
+    return res;
+}
+
+int shm_cache::do_get(const key_info &key_info, value_info &value_info, const value_range &range, uint32_t lru,
+                      bool counted) {
+    int res = EAGAIN;
+    uint32_t start{}, lock_start{}, lock_end{};
     if (m_context.enable_stats) {
         start = local_stats::get_cpu_cycle();
     }
@@ -175,28 +250,46 @@ int shm_cache::get(const key_info &key_info, value_info &value_info, uint32_t lr
         printf("%s %s: pid: %d invalid key size.\n", __FILE__, __func__, getpid());
         return ENAMETOOLONG;
     }
-    if (m_context.enable_stats) {
-        lock_start = local_stats::get_cpu_cycle();
-    }
-    if ((res = shm_lock::read_lock(m_context, m_config, m_context.memory->global_stats)) != 0) {
-        return res;
+    uint32_t hash_code = shm_hashtable::hash_key(m_context, key_info.data, key_info.length);
+    shard &shard = select_shard(hash_code);
+    if (m_config.optimistic_get) {
+        // copy without any lock, the lock is only taken when writers keep racing us
+        check_consistence();
+        res = shm_hashtable::ht_get_optimistic(m_context, m_config, shard, key_info, hash_code, value_info, range,
+                                               lru);
+    }
+    if (res == EAGAIN) {
+        if (m_context.enable_stats) {
+            lock_start = local_stats::get_cpu_cycle();
+        }
+        if ((res = shm_lock::read_lock(m_context, m_config, shard.lock, m_context.memory->global_stats)) != 0) {
+            return res;
+        }
+        if (m_context.enable_stats) {
+            lock_end = local_stats::get_cpu_cycle();
+            m_context.local_stats.r_lock.all_cost += lock_end - lock_start;
+            ++m_context.local_stats.r_lock.call_count;
+            m_context.local_stats.r_lock.max_cost =
+                std::max(lock_end - lock_start, m_context.local_stats.r_lock.max_cost);
+        }
+        check_consistence();
+        res = shm_hashtable::ht_get(m_context, shard, key_info, hash_code, value_info, range, lru);
+        shm_lock::read_unlock(m_context, shard.lock);
     }
-    if (m_context.enable_stats) {
-        lock_end = local_stats::get_cpu_cycle();
-        m_context.local_stats.r_lock.all_cost += lock_end - lock_start;
-        ++m_context.local_stats.r_lock.call_count;
-        m_context.local_stats.r_lock.max_cost = std::max(lock_end - lock_start, m_context.local_stats.r_lock.max_cost);
+    if (counted) {
+        count_get(res, value_info.length, start);
     }
-    check_consistence();
-    ++m_context.memory->global_stats.get.total;
-    res = shm_hashtable::ht_get(m_context, key_info, value_info, lru);
+    return res;
+}
+
+void shm_cache::count_get(int res, uint32_t length, uint32_t start) {
+    __sync_add_and_fetch(&m_context.memory->global_stats.get.total, 1);
     if (res == 0) {
-        ++m_context.memory->global_stats.get.success;
-        m_context.memory->global_stats.get_bytes += value_info.length;
+        __sync_add_and_fetch(&m_context.memory->global_stats.get.success, 1);
+        __sync_add_and_fetch(&m_context.memory->global_stats.get_bytes, length);
     }
-    shm_lock::read_unlock(m_context);
     if (m_context.enable_stats) {
-        end = local_stats::get_cpu_cycle();
+        uint32_t end = local_stats::get_cpu_cycle();
         m_context.local_stats.get.all_cost += end - start;
         ++m_context.local_stats.get.call_count;
         m_context.local_stats.get.max_ok_cost = std::max(end - start, m_context.local_stats.get.max_ok_cost);
@@ -206,6 +299,51 @@ int shm_cache::get(const key_info &key_info, value_info &value_info, uint32_t lr
             m_context.local_stats.get.max_ok_cost = std::max(end - start, m_context.local_stats.get.max_ok_cost);
         }
     }
+}
+
+int shm_cache::get_view(const key_info &key_info, value_view &view, uint32_t lru) {
+    int res;
+    uint32_t start{};
+    if (m_context.enable_stats) {
+        start = local_stats::get_cpu_cycle();
+    }
+    if (key_info.length > m_config.max_key_size) {
+        printf("%s %s: pid: %d invalid key size.\n", __FILE__, __func__, getpid());
+        return ENAMETOOLONG;
+    }
+    // the pin remembers its owner, a view of a process that died is reaped by the writers
+    if ((res = shm_lock::attach_process(m_context)) != 0) {
+        return res;
+    }
+    uint32_t hash_code = shm_hashtable::hash_key(m_context, key_info.data, key_info.length);
+    shard &shard = select_shard(hash_code);
+    if ((res = lock_shard(shard, false)) != 0) {
+        return res;
+    }
+    res = shm_hashtable::ht_get_view(m_context, shard, key_info, hash_code, view, lru);
+    shm_lock::read_unlock(m_context, shard.lock);
+    count_get(res, view.length, start);
+    return res;
+}
+
+int shm_cache::release_view(value_view &view) {
+    if (view.shard_id < 0 || (uint32_t)view.shard_id >= m_context.memory->layout.shard_count) {
+        return EINVAL;
+    }
+    shard &shard = m_context.shards[view.shard_id];
+    // an inline value was copied, there is no pin to release
+    int res = view.pin == SHM_PIN_SLOTS ? 0 : shm_allocator::unpin_blocks(m_context, shard, view.pin, view.tag, false);
+    if (res == EAGAIN) {
+        // the entry was freed while we read it, its blocks go back with the last view
+        if ((res = lock_shard(shard, true)) != 0) {
+            return res;
+        }
+        res = shm_allocator::unpin_blocks(m_context, shard, view.pin, view.tag, true);
+        shm_lock::write_unlock(m_context, shard.lock);
+    }
+    view.iov.clear();
+    view.inline_copy.clear();
+    view.shard_id = -1;
     return res;
 }
 
@@ -219,16 +357,18 @@ int shm_cache::del(const key_info &key_info) {
         printf("%s %s: pid: %d invalid key size.\n", __FILE__, __func__, getpid());
         return ENAMETOOLONG;
     }
-    if ((res = shm_lock::write_lock(m_context, m_config, m_context.memory->global_stats)) != 0) {
+    uint32_t hash_code = shm_hashtable::hash_key(m_context, key_info.data, key_info.length);
+    shard &shard = select_shard(hash_code);
+    if ((res = shm_lock::write_lock(m_context, m_config, shard.lock, m_context.memory->global_stats)) != 0) {
         return res;
     }
     check_consistence();
-    ++m_context.memory->global_stats.del.total;
-    res = shm_hashtable::ht_del(m_context, key_info, false);
+    __sync_add_and_fetch(&m_context.memory->global_stats.del.total, 1);
+    res = shm_hashtable::ht_del(m_context, shard, key_info, hash_code);
     if (res == 0) {
-        ++m_context.memory->global_stats.del.success;
+        __sync_add_and_fetch(&m_context.memory->global_stats.del.success, 1);
     }
-    shm_lock::write_unlock(m_context);
+    shm_lock::write_unlock(m_context, shard.lock);
     if (m_context.enable_stats) {
         end = local_stats::get_cpu_cycle();
         m_context.local_stats.del.all_cost += end - start;
@@ -243,6 +383,128 @@ int shm_cache::del(const key_info &key_info) {
     return res;
 }
 
+int shm_cache::multi_set(const key_info *keys, const value_info *values, int *results, uint32_t count) {
+    uint32_t start{};
+    if (m_context.enable_stats) {
+        start = local_stats::get_cpu_cycle();
+    }
+    std::vector<uint32_t> hashes, order, bounds;
+    group_by_shard(keys, values, results, count, hashes, order, bounds);
+    uint32_t success = 0;
+    int failed = 0;
+    for (uint32_t index = 0; index + 1 < bounds.size(); ++index) {
+        if (bounds[index] == bounds[index + 1]) {
+            continue;
+        }
+        // no combining here, the batch already pays one lock for all its keys
+        shard &shard = m_context.shards[index];
+        int res = lock_shard(shard, true);
+        failed = failed != 0 ? failed : res;
+        for (uint32_t j = bounds[index]; j < bounds[index + 1]; ++j) {
+            uint32_t i = order[j];
+            results[i] =
+                res != 0 ? res : shm_hashtable::ht_set(m_context, m_config, shard, keys[i], hashes[i], values[i]);
+            success += results[i] == 0 ? 1 : 0;
+        }
+        if (res == 0) {
+            shm_lock::write_unlock(m_context, shard.lock);
+        }
+    }
+    __sync_add_and_fetch(&m_context.memory->global_stats.set.total, order.size());
+    __sync_add_and_fetch(&m_context.memory->global_stats.set.success, success);
+    count_batch(m_context.local_stats.set, (uint32_t)order.size(), success, start);
+    return failed;
+}
+
+int shm_cache::multi_get(const key_info *keys, value_info *values, int *results, uint32_t count, uint32_t lru) {
+    uint32_t start{};
+    if (m_context.enable_stats) {
+        start = local_stats::get_cpu_cycle();
+    }
+    std::vector<uint32_t> hashes, order, bounds;
+    group_by_shard(keys, nullptr, results, count, hashes, order, bounds);
+    if (m_config.optimistic_get && !order.empty()) {
+        // everything the lock free walk settles needs no lock at all
+        std::vector<batch_lookup> lookups(order.size());
+        for (uint32_t j = 0; j < order.size(); ++j) {
+            uint32_t i = order[j];
+            lookups[j] = batch_lookup{&keys[i], &values[i], &select_shard(hashes[i]), hashes[i], EAGAIN};
+        }
+        check_consistence();
+        shm_hashtable::ht_get_batch(m_context, m_config, lookups.data(), (uint32_t)lookups.size(), lru);
+        for (uint32_t j = 0; j < order.size(); ++j) {
+            results[order[j]] = lookups[j].result;
+        }
+    }
+    uint64_t success = 0, bytes = 0;
+    int failed = 0;
+    for (uint32_t index = 0; index + 1 < bounds.size(); ++index) {
+        uint32_t j = bounds[index];
+        while (j < bounds[index + 1] && results[order[j]] != EAGAIN) {
+            ++j;
+        }
+        if (j == bounds[index + 1]) {
+            continue;
+        }
+        shard &shard = m_context.shards[index];
+        int res = lock_shard(shard, false);
+        failed = failed != 0 ? failed : res;
+        for (; j < bounds[index + 1]; ++j) {
+            uint32_t i = order[j];
+            if (results[i] == EAGAIN) {
+                results[i] = res != 0 ? res
+                                      : shm_hashtable::ht_get(m_context, shard, keys[i], hashes[i], values[i],
+                                                              value_range(0, UINT32_MAX, UINT32_MAX), lru);
+            }
+        }
+        if (res == 0) {
+            shm_lock::read_unlock(m_context, shard.lock);
+        }
+    }
+    for (uint32_t i : order) {
+        if (results[i] == 0) {
+            ++success;
+            bytes += values[i].length;
+        }
+    }
+    __sync_add_and_fetch(&m_context.memory->global_stats.get.total, order.size());
+    __sync_add_and_fetch(&m_context.memory->global_stats.get.success, success);
+    __sync_add_and_fetch(&m_context.memory->global_stats.get_bytes, bytes);
+    count_batch(m_context.local_stats.get, (uint32_t)order.size(), (uint32_t)success, start);
+    return failed;
+}
+
+int shm_cache::multi_del(const key_info *keys, int *results, uint32_t count) {
+    uint32_t start{};
+    if (m_context.enable_stats) {
+        start = local_stats::get_cpu_cycle();
+    }
+    std::vector<uint32_t> hashes, order, bounds;
+    group_by_shard(keys, nullptr, results, count, hashes, order, bounds);
+    uint32_t success = 0;
+    int failed = 0;
+    for (uint32_t index = 0; index + 1 < bounds.size(); ++index) {
+        if (bounds[index] == bounds[index + 1]) {
+            continue;
+        }
+        shard &shard = m_context.shards[index];
+        int res = lock_shard(shard, true);
+        failed = failed != 0 ? failed : res;
+        for (uint32_t j = bounds[index]; j < bounds[index + 1]; ++j) {
+            uint32_t i = order[j];
+            results[i] = res != 0 ? res : shm_hashtable::ht_del(m_context, shard, keys[i], hashes[i]);
+            success += results[i] == 0 ? 1 : 0;
+        }
+        if (res == 0) {
+            shm_lock::write_unlock(m_context, shard.lock);
+        }
+    }
+    __sync_add_and_fetch(&m_context.memory->global_stats.del.total, order.size());
+    __sync_add_and_fetch(&m_context.memory->global_stats.del.success, success);
+    count_batch(m_context.local_stats.del, (uint32_t)order.size(), success, start);
+    return failed;
+}
+
 int shm_cache::destroy() {
     int res = 0;
     for (uint32_t index = 0; index < m_context.val_segments.current; ++index) {
@@ -274,21 +536,28 @@ int shm_cache::remove() {
 }
 
 int shm_cache::clear_hashtable() {
-    int res;
-    if ((res = shm_lock::write_lock(m_context, m_config, m_context.memory->global_stats)) != 0) {
-        return res;
+    int res = 0;
+    int failed = 0;
+    for (uint32_t index = 0; index < m_context.memory->layout.shard_count; ++index) {
+        shard &shard = m_context.shards[index];
+        // the other shards are still cleared, the caller learns that this one was not
+        int lock_res = lock_shard(shard, true);
+        if (lock_res != 0) {
+            failed = failed != 0 ? failed : lock_res;
+            continue;
+        }
+        res += shm_hashtable::ht_clear(m_context, shard, m_context.memory->global_stats);
+        shm_lock::write_unlock(m_context, shard.lock);
     }
-    check_consistence();
-    res = shm_hashtable::ht_clear(m_context, m_context.memory->global_stats);
-    shm_lock::write_unlock(m_context);
-    return res;
+    return failed != 0 ? failed : res;
 }
 
 time_t shm_cache::get_last_ht_clear_time() const { return m_context.memory->global_stats.last_clear_time; }
 
 stats_output shm_cache::get_global_stats() {
     stats_output res;
-    if (shm_lock::write_lock(m_context, m_config, m_context.memory->global_stats) != 0) {
+    if (shm_lock::write_lock(m_context, m_config, m_context.memory->global_lock, m_context.memory->global_stats) !=
+        0) {
         return res;
     }
     time_t current_time = time(nullptr);
@@ -324,17 +593,18 @@ stats_output shm_cache::get_global_stats() {
     m_context.memory->global_stats.last.get_bytes = res.global_stats.get_bytes;
     m_context.memory->global_stats.last.lru_times = res.global_stats.lru_count;
 
-    shm_lock::write_unlock(m_context);
+    shm_lock::write_unlock(m_context, m_context.memory->global_lock);
     return res;
 }
 
 int shm_cache::clear_global_stats() {
     int res;
-    if ((res = shm_lock::write_lock(m_context, m_config, m_context.memory->global_stats)) != 0) {
+    if ((res = shm_lock::write_lock(m_context, m_config, m_context.memory->global_lock,
+                                    m_context.memory->global_stats)) != 0) {
         return res;
     }
     m_context.memory->global_stats.reset();
-    shm_lock::write_unlock(m_context);
+    shm_lock::write_unlock(m_context, m_context.memory->global_lock);
     return 0;
 }
 
@@ -443,6 +713,60 @@ int shm_cache::load_config(const char *file) {
     } else {
         m_config.detect_w_dl_ticks = (uint32_t)integer;
     }
+    str = conf.get_string_value("lock_type");
+    if (str == "rwlock") {
+        m_config.lock_type = SHM_LOCK_TYPE_RWLOCK;
+    } else if (str == "futex") {
+        m_config.lock_type = SHM_LOCK_TYPE_FUTEX;
+    } else if (str == "mcs") {
+        m_config.lock_type = SHM_LOCK_TYPE_MCS;
+    } else {
+        m_config.lock_type = SHM_LOCK_TYPE_MUTEX;
+    }
+    str = conf.get_string_value("optimistic_get");
+    m_config.optimistic_get = str == "true";
+    integer = conf.get_integer_value("combine_size");
+    // every process slot gets a scratch area of this size, all of them together may take at most one segment
+    int64_t combine_max = std::min((int64_t)SHM_MAX_COMBINE_SIZE, (int64_t)m_config.segment_size / SHM_MAX_PROCESSES);
+    if (integer > combine_max) {
+        printf("%s %s: pid: %d combine_size %ld too large, use %ld.\n", __FILE__, __func__, getpid(), (long)integer,
+               (long)combine_max);
+    }
+    m_config.combine_size = (uint32_t)std::max(std::min(integer, combine_max), (int64_t)0);
+    str = conf.get_string_value("hash_type");
+    if (str == "wyhash") {
+        m_config.hash_type = SHM_HASH_TYPE_WYHASH;
+    } else if (str == "crc32c") {
+#ifdef __SSE4_2__
+        m_config.hash_type = SHM_HASH_TYPE_CRC32C;
+#else
+        printf("%s %s: pid: %d crc32c needs sse4.2, use wyhash.\n", __FILE__, __func__, getpid());
+        m_config.hash_type = SHM_HASH_TYPE_WYHASH;
+#endif
+    } else {
+        m_config.hash_type = SHM_HASH_TYPE_SIMPLE;
+    }
+    str = conf.get_string_value("bucket_type");
+    if (str == "pow2") {
+        m_config.bucket_type = SHM_BUCKET_TYPE_POW2;
+    } else if (str == "fastrange") {
+        m_config.bucket_type = SHM_BUCKET_TYPE_FASTRANGE;
+    } else {
+        m_config.bucket_type = SHM_BUCKET_TYPE_PRIME;
+    }
+    str = conf.get_string_value("index_type");
+    m_config.index_type = str == "swiss" ? SHM_INDEX_TYPE_SWISS : SHM_INDEX_TYPE_CHAIN;
+    str = conf.get_string_value("grow_index");
+    m_config.grow_index = str == "true";
+    str = conf.get_string_value("slab");
+    m_config.slab = str == "true";
+    str = conf.get_string_value("extent");
+    m_config.extent = str == "true";
+    integer = conf.get_integer_value("shard_count");
+    m_config.shard_count = (uint32_t)std::max(std::min(integer, (int64_t)SHM_MAX_SHARDS), (int64_t)1);
+    if (m_config.shard_count > std::max(m_config.max_key_count, 1u)) {
+        m_config.shard_count = std::max(m_config.max_key_count, 1u);
+    }
     return 0;
 }
 
@@ -453,13 +777,14 @@ int shm_cache::do_init(const bool create, const bool check) {
     m_context.enable_stats = false;
 
     basic_unit basic_unit;
-    hashtable hashtable;
-    uint32_t total;
-    uint32_t offset_2base;
-    get_unit_and_ht(basic_unit, hashtable, total, offset_2base);
+    ht_layout layout;
+    if (!get_unit_and_layout(basic_unit, layout)) {
+        printf("%s %s: pid: %d ht_segment would exceed 4GB.\n", __FILE__, __func__, getpid());
+        return EINVAL;
+    }
     bool exists = shm_memory::exists(m_config.memory_type, m_config.file, SHM_HT_SEGMENT_ID);
     if ((res = shm_allocator::init_ht_segment(m_config.memory_type, m_config.file, m_context.ht_segment.item,
-                                              SHM_HT_SEGMENT_ID, total, m_context.enable_create)) != 0) {
+                                              SHM_HT_SEGMENT_ID, layout.total_size, m_context.enable_create)) != 0) {
         printf("%s %s: pid: %d init_ht_segment() failed.\n", __FILE__, __func__, getpid());
         return res;
     }
@@ -471,9 +796,12 @@ int shm_cache::do_init(const bool create, const bool check) {
     }
     memset(m_context.val_segments.items, 0, bytes);
     m_context.memory = (memory_info *)m_context.ht_segment.item.base;
+    m_context.shards = (shard *)(m_context.ht_segment.item.base + layout.offset_2shard);
+    m_context.processes = (process_slot *)(m_context.ht_segment.item.base + layout.offset_2process);
+    m_context.segment_owner = (int32_t *)(m_context.ht_segment.item.base + layout.offset_2owner);
     if (exists && check) {
         printf("%s %s: pid: %d ht_segment exists.\n", __FILE__, __func__, getpid());
-        res = check_ht_segment(basic_unit, offset_2base);
+        res = check_ht_segment(basic_unit, layout);
         if (res != 0) {
             printf("%s %s: pid: %d check_ht_segment() failed.\n", __FILE__, __func__, getpid());
             return res;
@@ -481,7 +809,7 @@ int shm_cache::do_init(const bool create, const bool check) {
     }
     if (create) {
         if (m_context.memory->status == SHM_STATUS_INIT) {
-            res = do_lock_init(basic_unit, hashtable, offset_2base);
+            res = do_lock_init(basic_unit, layout);
             if (!(res == 0 || res == -EEXIST)) {
                 printf("%s %s: pid: %d do_lock_init() failed.\n", __FILE__, __func__, getpid());
                 return res;
@@ -491,28 +819,27 @@ int shm_cache::do_init(const bool create, const bool check) {
         if (res != 0) {
             printf("%s %s: pid: %d open_val_segment() failed.\n", __FILE__, __func__, getpid());
         }
-        if (res == 0 && m_context.memory->basic_unit.segment.current < m_context.memory->basic_unit.segment.max) {
-            if ((res = shm_lock::write_lock(m_context, m_config, m_context.memory->global_stats)) != 0) {
+        // hand out the preallocated segments round-robin so every shard starts with its share
+        while (res == 0 && m_context.memory->basic_unit.segment.current < m_context.memory->basic_unit.segment.max &&
+               m_context.ht_segment.item.size + (uint64_t)m_context.memory->basic_unit.segment.current *
+                                                    (uint64_t)m_context.memory->basic_unit.segment.size <
+                   (uint64_t)m_config.min_mem_mb * 1024 * 1024) {
+            shard &shard = m_context.shards[m_context.memory->basic_unit.segment.current % layout.shard_count];
+            if ((res = shm_lock::write_lock(m_context, m_config, shard.lock, m_context.memory->global_stats)) != 0) {
                 printf("%s %s: pid: %d w_lock() failed.\n", __FILE__, __func__, getpid());
                 return res;
             }
-            while (m_context.ht_segment.item.size +
-                       (uint64_t)m_context.val_segments.current * (uint64_t)m_context.memory->basic_unit.segment.size <
-                   (uint64_t)m_config.min_mem_mb * 1024 * 1024) {
-                if ((res = shm_allocator::create_val_segment(m_context, m_config)) != 0) {
-                    break;
-                }
-                if (m_context.memory->basic_unit.segment.current >= m_context.memory->basic_unit.segment.max) {
-                    break;
-                }
-            }
-            shm_lock::write_unlock(m_context);
+            res = shm_allocator::create_val_segment(m_context, m_config, shard);
+            shm_lock::write_unlock(m_context, shard.lock);
+        }
+        if (res == ENOSPC) {
+            res = 0;
         }
     }
     return res;
 }
 
-int shm_cache::do_lock_init(const basic_unit &basic_unit, const hashtable &hashtable, uint32_t &offset_2base) {
+int shm_cache::do_lock_init(const basic_unit &basic_unit, const ht_layout &layout) {
     int res;
     if ((res = shm_lock::file_lock(m_context, m_config)) != 0) {
         return res;
@@ -522,22 +849,57 @@ int shm_cache::do_lock_init(const basic_unit &basic_unit, const hashtable &hasht
         res = -EEXIST;
     } else {
         m_context.memory->basic_unit = basic_unit;
-        m_context.memory->hashtable = hashtable;
-        m_context.memory->busy_list.entry_size = sizeof(hash_entry);
-        m_context.memory->busy_list.offset_f2base =
-            (char *)&m_context.memory->busy_list.fake_entry - m_context.ht_segment.item.base;
-        m_context.memory->busy_list.reset();
-        m_context.memory->idle_list.block_size = basic_unit.block.size;
-        m_context.memory->idle_list.offset_f2base =
-            (char *)&m_context.memory->idle_list.fake_block - m_context.ht_segment.item.base;
-        m_context.memory->idle_list.reset(m_context.val_segments, m_context.memory->basic_unit.block.max_of_each);
-        m_context.memory->entry_queue.capacity = m_config.max_key_count;
-        m_context.memory->entry_queue.offset_2base = offset_2base;
-        m_context.memory->entry_queue.reset();
-        if ((res = shm_lock::lock_init(m_context)) != 0) {
+        m_context.memory->layout = layout;
+        char *base = m_context.ht_segment.item.base;
+        memset((void *)m_context.processes, 0, sizeof(process_slot) * SHM_MAX_PROCESSES);
+        m_context.memory->process_limit = 0;
+        for (uint32_t index = 0; index < layout.shard_count && res == 0; ++index) {
+            shard &shard = m_context.shards[index];
+            shard.hashtable.index_type = layout.index_type;
+            shard.hashtable.bucket_type = layout.bucket_type;
+            shard.hashtable.max_capacity = layout.capacity_of_each;
+            shard.hashtable.capacity = layout.capacity_of_each;
+            shard.hashtable.offset_2base = layout.offset_2bucket + (int64_t)layout.index_size * index;
+            shard.hashtable.offset_2old = 0;
+            if (layout.grow_index != 0) {
+                shard.hashtable.capacity = std::min(
+                    shm_hashtable::get_capacity(std::min(layout.entry_of_each, (uint32_t)SHM_GROW_MIN_CAPACITY),
+                                                layout.bucket_type),
+                    layout.capacity_of_each);
+                shard.hashtable.offset_2old = shard.hashtable.offset_2base + layout.index_size / 2;
+            }
+            shard.hashtable.bucket_shift = shm_hashtable::get_shift(layout.bucket_type, shard.hashtable.capacity);
+            shard.hashtable.old_capacity = 0;
+            shard.hashtable.rehash_index = 0;
+            shard.hashtable.reset(base);
+            shard.busy_list.entry_size = sizeof(hash_entry);
+            shard.busy_list.offset_f2base = (char *)&shard.busy_list.fake_entry - base;
+            shard.busy_list.reset();
+            shard.idle_list.block_size = basic_unit.block.size;
+            shard.idle_list.offset_f2base = (char *)&shard.idle_list.fake_block - base;
+            shard.idle_list.reset(m_context.val_segments, basic_unit.block.max_of_each, m_context.segment_owner,
+                                  (int32_t)index);
+            shard.entry_queue.capacity = layout.entry_of_each;
+            shard.entry_queue.offset_2base =
+                layout.offset_2entry + (int64_t)sizeof(hash_entry) * layout.entry_of_each * index;
+            shard.entry_queue.reset();
+            shard.journal.reset();
+            shard.access_ring.reset();
+            shard.pins.reset();
+            shard.slabs.reset();
+            shard.extents.reset();
+            shard.combiner = 0;
+            shard.combine_waiters = 0;
+            shard.combine_pending = 0;
+            if ((res = shm_lock::lock_init(shard.lock, m_config.lock_type, (int32_t)index)) != 0) {
+                printf("%s %s: pid: %d lock_init() failed.\n", __FILE__, __func__, getpid());
+            }
+        }
+        if (res == 0 && (res = shm_lock::lock_init(m_context.memory->global_lock, SHM_LOCK_TYPE_MUTEX, -1)) != 0) {
             printf("%s %s: pid: %d lock_init() failed.\n", __FILE__, __func__, getpid());
-        } else {
-            if ((res = shm_allocator::create_val_segment(m_context, m_config)) != 0) {
+        }
+        if (res == 0) {
+            if ((res = shm_allocator::create_val_segment(m_context, m_config, m_context.shards[0])) != 0) {
                 printf("%s %s: pid: %d create_val_segment() failed.\n", __FILE__, __func__, getpid());
             } else {
                 m_context.memory->global_stats.reset();
@@ -552,7 +914,7 @@ int shm_cache::do_lock_init(const basic_unit &basic_unit, const hashtable &hasht
     return res;
 }
 
-int shm_cache::check_ht_segment(const basic_unit &basic_unit, uint32_t &offset_2base) const {
+int shm_cache::check_ht_segment(const basic_unit &basic_unit, const ht_layout &layout) const {
     if (m_context.memory->size != (int32_t)sizeof(memory_info)) {
         return EINVAL;
     }
@@ -562,39 +924,111 @@ int shm_cache::check_ht_segment(const basic_unit &basic_unit, uint32_t &offset_2
     if (m_context.memory->max_key_count != m_config.max_key_count) {
         return EINVAL;
     }
-    if (m_context.memory->basic_unit.segment.size != basic_unit.segment.size ||
-        m_context.memory->basic_unit.segment.max != basic_unit.segment.max) {
+    if (m_context.memory->layout.hash_type != layout.hash_type) {
+        printf("%s %s: pid: %d cache uses hash_type %u, config asks for %u.\n", __FILE__, __func__, getpid(),
+               m_context.memory->layout.hash_type, layout.hash_type);
         return EINVAL;
     }
-    if (m_context.memory->basic_unit.block.size != basic_unit.block.size ||
-        m_context.memory->basic_unit.block.max_of_each != basic_unit.block.max_of_each) {
+    if (!(m_context.memory->layout == layout)) {
         return EINVAL;
     }
-    if (m_context.memory->busy_list.entry_size != sizeof(hash_entry) ||
-        m_context.memory->idle_list.block_size != basic_unit.block.size) {
+    if (m_context.memory->basic_unit.segment.size != basic_unit.segment.size ||
+        m_context.memory->basic_unit.segment.max != basic_unit.segment.max) {
         return EINVAL;
     }
-    if (m_context.memory->busy_list.offset_f2base !=
-            (char *)&m_context.memory->busy_list.fake_entry - m_context.ht_segment.item.base ||
-        m_context.memory->idle_list.offset_f2base !=
-            (char *)&m_context.memory->idle_list.fake_block - m_context.ht_segment.item.base ||
-        m_context.memory->entry_queue.offset_2base != offset_2base) {
+    if (m_context.memory->basic_unit.block.size != basic_unit.block.size ||
+        m_context.memory->basic_unit.block.max_of_each != basic_unit.block.max_of_each ||
+        m_context.memory->basic_unit.block.slab_classes != basic_unit.block.slab_classes ||
+        m_context.memory->basic_unit.block.extents != basic_unit.block.extents) {
         return EINVAL;
     }
+    char *base = m_context.ht_segment.item.base;
+    for (uint32_t index = 0; index < layout.shard_count; ++index) {
+        const shard &shard = m_context.shards[index];
+        // a growing index swaps its two regions and changes its capacity on the way, other processes may be at it
+        int64_t region = layout.offset_2bucket + (int64_t)layout.index_size * index;
+        if (layout.grow_index != 0) {
+            int64_t half = layout.index_size / 2;
+            if ((shard.hashtable.offset_2base != region && shard.hashtable.offset_2base != region + half) ||
+                (shard.hashtable.offset_2old != region && shard.hashtable.offset_2old != region + half) ||
+                shard.hashtable.capacity > layout.capacity_of_each) {
+                return EINVAL;
+            }
+        } else if (shard.hashtable.offset_2base != region || shard.hashtable.capacity != layout.capacity_of_each) {
+            return EINVAL;
+        }
+        if (shard.lock.type != m_config.lock_type || shard.lock.shard_id != (int32_t)index) {
+            return EINVAL;
+        }
+        if (shard.busy_list.entry_size != sizeof(hash_entry) || shard.idle_list.block_size != basic_unit.block.size) {
+            return EINVAL;
+        }
+        if (shard.busy_list.offset_f2base != (char *)&shard.busy_list.fake_entry - base ||
+            shard.idle_list.offset_f2base != (char *)&shard.idle_list.fake_block - base ||
+            shard.hashtable.index_type != layout.index_type || shard.hashtable.bucket_type != layout.bucket_type ||
+            shard.hashtable.max_capacity != layout.capacity_of_each ||
+            shard.entry_queue.offset_2base !=
+                layout.offset_2entry + (int64_t)sizeof(hash_entry) * layout.entry_of_each * index) {
+            return EINVAL;
+        }
+    }
     return 0;
 }
 
-void shm_cache::get_unit_and_ht(basic_unit &basic_unit, hashtable &hashtable, uint32_t &total_size,
-                                uint32_t &offset_2base) {
-    total_size = 0;
+bool shm_cache::get_unit_and_layout(basic_unit &basic_unit, ht_layout &layout) {
     calc_basic_uint(basic_unit, (uint64_t)m_config.max_mem_mb * 1024 * 1024);
-    hashtable.inserted = 0;
-    hashtable.capacity = shm_hashtable::get_capacity(m_config.max_key_count);
-    total_size += (uint32_t)sizeof(memory_info);
-    total_size += (uint32_t)sizeof(int64_t) * (hashtable.capacity);
-    offset_2base = total_size;
-    total_size += (uint32_t)sizeof(hash_entry) * (m_config.max_key_count);
-    calc_basic_uint(basic_unit, (uint64_t)m_config.max_mem_mb * 1024 * 1024 - total_size);
+    uint32_t segment_max = basic_unit.segment.max;
+    // every shard owns whole segments, so there can not be more shards than segments
+    if (!calc_layout(layout, m_config.shard_count, segment_max)) {
+        return false;
+    }
+    calc_basic_uint(basic_unit, (uint64_t)m_config.max_mem_mb * 1024 * 1024 - layout.total_size);
+    if (basic_unit.segment.max < layout.shard_count) {
+        printf("%s %s: pid: %d only %u segments for %u shards, use %u shards.\n", __FILE__, __func__, getpid(),
+               basic_unit.segment.max, layout.shard_count, basic_unit.segment.max);
+        m_config.shard_count = basic_unit.segment.max;
+        return calc_layout(layout, m_config.shard_count, segment_max);
+    }
+    return true;
+}
+
+bool shm_cache::calc_layout(ht_layout &layout, uint32_t shard_count, uint32_t segment_max) {
+    memset(&layout, 0, sizeof(ht_layout));
+    layout.shard_count = shard_count;
+    layout.entry_of_each = (m_config.max_key_count + shard_count - 1) / shard_count;
+    layout.hash_type = m_config.hash_type;
+    layout.index_type = m_config.index_type;
+    // the swiss index probes power of two groups of its own, bucket_type only shapes the chained one
+    layout.bucket_type = layout.index_type == SHM_INDEX_TYPE_SWISS ? SHM_BUCKET_TYPE_PRIME : m_config.bucket_type;
+    layout.capacity_of_each = layout.index_type == SHM_INDEX_TYPE_SWISS
+                                  ? shm_swiss_index::get_capacity(layout.entry_of_each)
+                                  : shm_hashtable::get_capacity(layout.entry_of_each, layout.bucket_type);
+    layout.grow_index = layout.index_type == SHM_INDEX_TYPE_CHAIN && m_config.grow_index ? 1 : 0;
+    layout.index_size = hashtable::index_size(layout.index_type, layout.capacity_of_each) * (layout.grow_index + 1);
+    layout.segment_max = segment_max;
+    // summed up in 64 bits, a layout whose offsets do not fit the 32 bit fields is refused
+    auto line = (uint64_t)SHM_CACHE_LINE_SIZE;
+    uint64_t offset_2shard = SHM_MEM_ALIGN((uint64_t)sizeof(memory_info), line);
+    uint64_t offset_2process = offset_2shard + (uint64_t)sizeof(shard) * shard_count;
+    uint64_t offset_2bucket = SHM_MEM_ALIGN(offset_2process + (uint64_t)sizeof(process_slot) * SHM_MAX_PROCESSES, line);
+    // every hash entry starts on a cache line of its own
+    uint64_t offset_2entry = SHM_MEM_ALIGN(offset_2bucket + (uint64_t)layout.index_size * shard_count, line);
+    uint64_t offset_2owner = offset_2entry + (uint64_t)sizeof(hash_entry) * layout.entry_of_each * shard_count;
+    uint64_t offset_2scratch = SHM_MEM_ALIGN(offset_2owner + (uint64_t)sizeof(int32_t) * segment_max, line);
+    uint64_t scratch_size = SHM_MEM_ALIGN((uint64_t)m_config.combine_size, line);
+    uint64_t total_size = offset_2scratch + scratch_size * SHM_MAX_PROCESSES;
+    if (total_size > UINT32_MAX) {
+        return false;
+    }
+    layout.offset_2shard = (uint32_t)offset_2shard;
+    layout.offset_2process = (uint32_t)offset_2process;
+    layout.offset_2bucket = (uint32_t)offset_2bucket;
+    layout.offset_2entry = (uint32_t)offset_2entry;
+    layout.offset_2owner = (uint32_t)offset_2owner;
+    layout.offset_2scratch = (uint32_t)offset_2scratch;
+    layout.scratch_size = (uint32_t)scratch_size;
+    layout.total_size = (uint32_t)total_size;
+    return true;
 }
 
 void shm_cache::calc_basic_uint(basic_unit &basic_uint, uint64_t max_memory) {
@@ -612,6 +1046,8 @@ void shm_cache::calc_basic_uint(basic_unit &basic_uint, uint64_t max_memory) {
         basic_uint.block.size = SHM_BLOCK_SIZE;
     }
     basic_uint.block.max_of_each = basic_uint.segment.size / basic_uint.block.size;
+    basic_uint.block.slab_classes = m_config.slab ? shm_allocator::slab_classes(basic_uint.block.size) : 0;
+    basic_uint.block.extents = m_config.extent ? 1 : 0;
     basic_uint.segment.max = (uint32_t)(max_memory / basic_uint.segment.size);
     if (basic_uint.segment.max == 0) {
         basic_uint.segment.max = 1;
@@ -645,6 +1081,186 @@ void shm_cache::clear_local_stats() {
     }
 }
 
+shard &shm_cache::select_shard(uint32_t hash_code) {
+    return m_context.shards[shm_hashtable::shard_index(m_context, hash_code)];
+}
+
+int shm_cache::combine_set(shard &shard, const key_info &key_info, const value_info &value_info, uint32_t hash_code) {
+    int res;
+    if ((res = shm_lock::attach_process(m_context)) != 0) {
+        return res;
+    }
+    combine_request &request = m_context.processes[m_context.process_index].request;
+    char *scratch = m_context.ht_segment.item.base + m_context.memory->layout.offset_2scratch +
+                    (size_t)m_context.memory->layout.scratch_size * (uint32_t)m_context.process_index;
+    memcpy(scratch, key_info.data, key_info.length);
+    memcpy(scratch + key_info.length, value_info.data, value_info.length);
+    request.shard_id = shard.lock.shard_id;
+    request.hash_code = hash_code;
+    request.key_len = key_info.length;
+    request.value_len = value_info.length;
+    request.options = value_info.options;
+    request.expires = value_info.expires;
+    request.result = 0;
+    __sync_synchronize();
+    request.state = SHM_COMBINE_PENDING;
+    __sync_add_and_fetch(&shard.combine_pending, 1);
+    uint64_t timeout_us = (uint64_t)m_config.try_w_lk_interval * m_config.detect_w_dl_ticks;
+    timespec timeout{(time_t)(timeout_us / 1000000), (long)(timeout_us % 1000000 * 1000)};
+    for (bool waited = false; request.state != SHM_COMBINE_DONE;) {
+        pid_t combiner = shard.combiner;
+        // whoever finds no combiner applies the whole batch, a dead combiner is replaced after a timeout
+        if ((combiner == 0 || (waited && shm_lock::owner_dead(combiner))) &&
+            __sync_bool_compare_and_swap(&shard.combiner, combiner, m_context.process_pid)) {
+            // without the lock we withdraw the request, unless another combiner took it meanwhile
+            if ((res = combine(shard)) != 0 &&
+                __sync_bool_compare_and_swap(&request.state, SHM_COMBINE_PENDING, SHM_COMBINE_IDLE)) {
+                __sync_sub_and_fetch(&shard.combine_pending, 1);
+                return res;
+            }
+            continue;
+        }
+        // a batch is short, spin a little before sleeping
+        for (uint32_t spin = 0; spin < SHM_LOCK_MAX_SPIN && request.state != SHM_COMBINE_DONE && shard.combiner != 0;
+             ++spin) {
+            SHM_CPU_PAUSE();
+        }
+        if (request.state == SHM_COMBINE_DONE) {
+            break;
+        }
+        uint32_t epoch = shard.combine_epoch;
+        __sync_add_and_fetch(&shard.combine_waiters, 1);
+        if (request.state != SHM_COMBINE_DONE && shard.combiner != 0) {
+            waited = syscall(SYS_futex, &shard.combine_epoch, FUTEX_WAIT, epoch, &timeout, nullptr, 0) != 0 &&
+                     errno == ETIMEDOUT;
+        }
+        __sync_sub_and_fetch(&shard.combine_waiters, 1);
+    }
+    __sync_synchronize();
+    res = request.result;
+    request.state = SHM_COMBINE_IDLE;
+    return res;
+}
+
+int shm_cache::combine(shard &shard) {
+    int res;
+    if ((res = shm_lock::write_lock(m_context, m_config, shard.lock, m_context.memory->global_stats)) == 0) {
+        check_consistence();
+        uint32_t served = 0;
+        char *scratch = m_context.ht_segment.item.base + m_context.memory->layout.offset_2scratch;
+        // requests published while we are inside are served as well, for a few passes
+        for (uint32_t pass = 0; pass < SHM_COMBINE_PASSES && shard.combine_pending > 0; ++pass) {
+            uint32_t found = 0;
+            for (uint32_t index = 0; index < m_context.memory->process_limit; ++index) {
+                combine_request &request = m_context.processes[index].request;
+                // a request still taken was left by a combiner that died, it is served again
+                uint32_t state = request.state;
+                if ((state != SHM_COMBINE_PENDING && state != SHM_COMBINE_TAKEN) ||
+                    request.shard_id != shard.lock.shard_id ||
+                    !__sync_bool_compare_and_swap(&request.state, state, SHM_COMBINE_TAKEN)) {
+                    continue;
+                }
+                __sync_synchronize();
+                char *staged = scratch + (size_t)m_context.memory->layout.scratch_size * index;
+                key_info key_tmp(request.key_len, staged);
+                value_info value_tmp(request.value_len, staged + request.key_len, request.options, 0);
+                value_tmp.expires = request.expires;
+                __sync_add_and_fetch(&m_context.memory->global_stats.set.total, 1);
+                request.result =
+                    shm_hashtable::ht_set(m_context, m_config, shard, key_tmp, request.hash_code, value_tmp);
+                if (request.result == 0) {
+                    __sync_add_and_fetch(&m_context.memory->global_stats.set.success, 1);
+                }
+                __sync_synchronize();
+                request.state = SHM_COMBINE_DONE;
+                __sync_sub_and_fetch(&shard.combine_pending, 1);
+                ++found;
+            }
+            if (found == 0) {
+                break;
+            }
+            served += found;
+        }
+        shm_lock::write_unlock(m_context, shard.lock);
+        __sync_add_and_fetch(&m_context.memory->global_stats.combine_batch, 1);
+        __sync_add_and_fetch(&m_context.memory->global_stats.combine_op, served);
+    }
+    shard.combiner = 0;
+    __sync_add_and_fetch(&shard.combine_epoch, 1);
+    if (shard.combine_waiters != 0) {
+        syscall(SYS_futex, &shard.combine_epoch, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+    }
+    return res;
+}
+
+void shm_cache::group_by_shard(const key_info *keys, const value_info *values, int *results, uint32_t count,
+                               std::vector<uint32_t> &hashes, std::vector<uint32_t> &order,
+                               std::vector<uint32_t> &bounds) {
+    // a counting sort: bounds[s] .. bounds[s + 1] is where the keys of shard s sit in 'order'
+    uint32_t shard_count = m_context.memory->layout.shard_count;
+    hashes.assign(count, 0);
+    bounds.assign(shard_count + 1, 0);
+    for (uint32_t i = 0; i < count; ++i) {
+        results[i] = EAGAIN;
+        if (keys[i].length > m_config.max_key_size) {
+            results[i] = ENAMETOOLONG;
+        } else if (values != nullptr && values[i].length > m_config.max_value_size) {
+            results[i] = EINVAL;
+        } else {
+            hashes[i] = shm_hashtable::hash_key(m_context, keys[i].data, keys[i].length);
+            ++bounds[shm_hashtable::shard_index(m_context, hashes[i]) + 1];
+        }
+    }
+    for (uint32_t index = 0; index < shard_count; ++index) {
+        bounds[index + 1] += bounds[index];
+    }
+    order.resize(bounds[shard_count]);
+    std::vector<uint32_t> fill(bounds.begin(), bounds.end() - 1);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (results[i] == EAGAIN) {
+            order[fill[shm_hashtable::shard_index(m_context, hashes[i])]++] = i;
+        }
+    }
+}
+
+void shm_cache::count_batch(out_call_counter &counter, uint32_t keys, uint32_t success, uint32_t start) {
+    if (!m_context.enable_stats || keys == 0) {
+        return;
+    }
+    // the keys share the cost of the call evenly, a batch has no cost of its own per key
+    uint32_t cost = local_stats::get_cpu_cycle() - start;
+    uint32_t key_cost = cost / keys;
+    counter.call_count += keys;
+    counter.all_cost += cost;
+    if (success > 0) {
+        counter.call_ok_count += success;
+        counter.all_ok_cost += key_cost * success;
+        counter.max_ok_cost = std::max(key_cost, counter.max_ok_cost);
+    }
+}
+
+int shm_cache::lock_shard(shard &shard, bool write) {
+    int res;
+    uint32_t lock_start{}, lock_end{};
+    if (m_context.enable_stats) {
+        lock_start = local_stats::get_cpu_cycle();
+    }
+    res = write ? shm_lock::write_lock(m_context, m_config, shard.lock, m_context.memory->global_stats)
+                : shm_lock::read_lock(m_context, m_config, shard.lock, m_context.memory->global_stats);
+    if (res != 0) {
+        return res;
+    }
+    if (m_context.enable_stats) {
+        lock_end = local_stats::get_cpu_cycle();
+        auto &lock_stats = write ? m_context.local_stats.w_lock : m_context.local_stats.r_lock;
+        lock_stats.all_cost += lock_end - lock_start;
+        ++lock_stats.call_count;
+        lock_stats.max_cost = std::max(lock_end - lock_start, lock_stats.max_cost);
+    }
+    check_consistence();
+    return 0;
+}
+
 int shm_cache::check_consistence() {
     if (shm_allocator::open_val_segment(m_context, m_config) != 0) {
         printf("%s %s: pid: %d open_val_segment()failed.\n", __FILE__, __func__, getpid());
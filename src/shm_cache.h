@@ -2,6 +2,7 @@
 #define SHMCACHE_SHM_CACHE_H
 
 #include "common_types.h"
+#include <vector>
 
 class shm_cache {
 public:
@@ -20,12 +21,32 @@ public:
     int set_ttl(const key_info &key_info, uint32_t ttl);
     int set_expires(const key_info &key_info, uint32_t expires);
     int get(const key_info &key_info, value_info &value_info, uint32_t lru);
+    // length, options and expires of the value, nothing is copied
+    int stat(const key_info &key_info, value_info &value_info);
+    // copies at most 'capacity' bytes, ENOBUFS with the length needed in value_info.length if the value is longer
+    int get_bounded(const key_info &key_info, value_info &value_info, uint32_t capacity, uint32_t lru);
+    // copies up to 'length' bytes of the value from 'offset' on, value_info.length is what was copied
+    int get_range(const key_info &key_info, value_info &value_info, uint32_t offset, uint32_t length, uint32_t lru);
+    // value_info.data is taken from 'allocator' and sized for the value, the caller owns it afterwards. An empty
+    // value takes nothing from it and leaves value_info.data nullptr.
+    int get_alloc(const key_info &key_info, value_info &value_info, const value_allocator &allocator, uint32_t lru);
     int del(const key_info &key_info);
+    // the value in place instead of a copy, 'view.iov' stays valid until release_view()
+    int get_view(const key_info &key_info, value_view &view, uint32_t lru);
+    // 0 as well for a view whose pin a clear of the cache dropped meanwhile
+    int release_view(value_view &view);
+    // vectored calls, results[i] is what the single key call would have returned for keys[i]. The keys are grouped
+    // by shard and every shard is locked once for all of its keys. 0, or the error of the first shard that could not
+    // be locked (its keys carry it as well).
+    int multi_set(const key_info *keys, const value_info *values, int *results, uint32_t count);
+    int multi_get(const key_info *keys, value_info *values, int *results, uint32_t count, uint32_t lru);
+    int multi_del(const key_info *keys, int *results, uint32_t count);
 
     int destroy();
     int remove();
 
 public:
+    // the number of entries cleared, or the error of the first shard that could not be locked
     int clear_hashtable();
     time_t get_last_ht_clear_time() const;
     stats_output get_global_stats();
@@ -38,14 +59,29 @@ private:
     void reset();
     int load_config(const char *file);
     int do_init(bool create, bool check);
-    int do_lock_init(const basic_unit &basic_unit, const hashtable &hashtable, uint32_t &offset_2base);
+    int do_lock_init(const basic_unit &basic_unit, const ht_layout &layout);
+    // 'counted' false leaves the get stats to the caller, see count_get()
+    int do_get(const key_info &key_info, value_info &value_info, const value_range &range, uint32_t lru,
+               bool counted);
+    // one get in the global and local stats, 'start' is the cycle count the call began at
+    void count_get(int res, uint32_t length, uint32_t start);
 
 private:
-    inline int check_ht_segment(const basic_unit &basic_unit, uint32_t &offset_2base) const;
-    inline void get_unit_and_ht(basic_unit &basic_unit, hashtable &hashtable, uint32_t &total_size,
-                                uint32_t &offset_2base);
+    inline int check_ht_segment(const basic_unit &basic_unit, const ht_layout &layout) const;
+    // false when the ht segment would outgrow the 32 bit offsets of its layout
+    inline bool get_unit_and_layout(basic_unit &basic_unit, ht_layout &layout);
+    inline bool calc_layout(ht_layout &layout, uint32_t shard_count, uint32_t segment_max);
     inline void calc_basic_uint(basic_unit &basic_uint, uint64_t max_memory);
     inline int check_consistence();
+    inline shard &select_shard(uint32_t hash_code);
+    inline void group_by_shard(const key_info *keys, const value_info *values, int *results, uint32_t count,
+                               std::vector<uint32_t> &hashes, std::vector<uint32_t> &order,
+                               std::vector<uint32_t> &bounds);
+    inline int lock_shard(shard &shard, bool write);
+    // the keys of a vectored call in the local stats, each one costs its share of the call since 'start'
+    inline void count_batch(out_call_counter &counter, uint32_t keys, uint32_t success, uint32_t start);
+    inline int combine_set(shard &shard, const key_info &key_info, const value_info &value_info, uint32_t hash_code);
+    inline int combine(shard &shard);
 
 private:
     config m_config;
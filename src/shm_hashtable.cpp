@@ -1,9 +1,18 @@
 #include "shm_hashtable.h"
 #include "shm_allocator.h"
+#include "shm_swiss_index.h"
 #include <algorithm>
 #include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+#include <string>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
 const std::vector<uint32_t> shm_hashtable::prime_array = {
     1,          /* 0 */
@@ -38,225 +47,523 @@ const std::vector<uint32_t> shm_hashtable::prime_array = {
     2147483647  /* 29 (largest signed int prime) */
 };
 
-int shm_hashtable::ht_set(context &context, const config &config, const key_info &key_info,
-                          const value_info &value_info) {
-    if (context.memory->hashtable.inserted >= config.max_key_count) {
-        uint32_t total = SHM_MEM_ALIGN_BYTE(key_info.length) + SHM_MEM_ALIGN_BYTE(value_info.length);
-        uint32_t rest_of_block = context.memory->basic_unit.block.size - (uint32_t)sizeof(block_entry);
-        uint32_t block_used = (total + rest_of_block - 1) / rest_of_block;
-        int res = ht_recycle(context, config, block_used, true);
+int shm_hashtable::ht_set(context &context, const config &config, shard &shard, const key_info &key_info,
+                          uint32_t hash_code, const value_info &value_info) {
+    apply_access(context, shard);
+    if (shard.pins.starved != 0) {
+        shm_allocator::reap_pins(context, shard);
+    }
+    index_cursor cursor{};
+    int64_t old_offset = find_entry(context, shard, key_info, hash_code, cursor);
+    // an overwrite keeps its entry, its place in the index and as many of its blocks as it can
+    if (old_offset > 0 && shm_allocator::rewrite_hash_entry(context, shard, old_offset, value_info)) {
+        promote_entry(context, shard, (hash_entry *)(context.ht_segment.item.base + old_offset), old_offset);
+        __sync_add_and_fetch(&context.memory->global_stats.set_in_place, 1);
+        return 0;
+    }
+    if (shard.hashtable.inserted >= shard.entry_queue.capacity) {
+        uint32_t size_class = shm_allocator::class_of(context, key_info.length, value_info.length);
+        uint32_t block_used =
+            size_class != 0 ? 0 : shm_allocator::blocks_of(context, key_info.length, value_info.length);
+        int res = ht_recycle(context, config, shard, size_class, block_used, true);
         if (res != 0) {
             printf("%s %s: pid: %d reach max key count but ht_recycle(force) failed.\n", __FILE__, __func__, getpid());
             return res;
         }
     }
-    hash_entry *new_entry = shm_allocator::alloc_hash_entry(context, config, key_info, value_info);
+    hash_entry *new_entry = shm_allocator::alloc_hash_entry(context, config, shard, key_info, hash_code, value_info);
     if (new_entry == nullptr) {
         printf("%s %s: pid: %d alloc_hash_entry() failed.\n", __FILE__, __func__, getpid());
         return -1;
     }
-    uint32_t ht_index = bucket_index(context, key_info);
-    int64_t old_offset = context.memory->hashtable.bucket[ht_index];
-    bool found = false;
-    hash_entry *prev_entry = nullptr;
-    hash_entry *old_entry = nullptr;
-    while (old_offset > 0) {
-        old_entry = (hash_entry *)(context.ht_segment.item.base + old_offset);
-        if (same_key(context, old_entry, key_info)) {
-            found = true;
-            break;
-        }
-        old_offset = old_entry->hash_next;
-        prev_entry = old_entry;
+    begin_update(context, shard);
+    if (shard.hashtable.index_type == SHM_INDEX_TYPE_SWISS) {
+        shm_swiss_index::reserve(context, shard);
+    } else {
+        grow_index(context, shard);
     }
+    auto new_offset = (char *)new_entry - context.ht_segment.item.base;
+    old_offset = find_entry(context, shard, key_info, hash_code, cursor);
+    bool found = old_offset > 0;
     if (found) {
-        new_entry->hash_next = old_entry->hash_next;
+        // the new entry may sit in a lower (recycled) slot than the old one, only the journal tells ht_repair() which
+        // of the two a set dying from here on was replacing
+        shard.journal.victim = old_offset;
+        __sync_synchronize();
+        auto *old_entry = (hash_entry *)(context.ht_segment.item.base + old_offset);
         int64_t prev_lru_offset = old_entry->lru_prev;
         auto *prev_lru_entry = (hash_entry *)(context.ht_segment.item.base + prev_lru_offset);
         int64_t next_lru_offset = old_entry->lru_next;
         auto *next_lru_entry = (hash_entry *)(context.ht_segment.item.base + next_lru_offset);
         prev_lru_entry->lru_next = next_lru_offset;
         next_lru_entry->lru_prev = prev_lru_offset;
-    } else {
-        new_entry->hash_next = 0;
-    }
-    auto new_offset = (char *)new_entry - context.ht_segment.item.base;
-    if (prev_entry != nullptr) {
-        prev_entry->hash_next = new_offset;
-    } else {
-        context.memory->hashtable.bucket[ht_index] = new_offset;
+        replace_entry(context, shard, cursor, old_offset, new_offset);
+    } else if (!insert_entry(context, shard, hash_code, new_offset)) {
+        printf("%s %s: pid: %d insert_entry() failed, clear hashtable...\n", __FILE__, __func__, getpid());
+        shm_hashtable::ht_clear(context, shard, context.memory->global_stats);
+        end_update(context, shard);
+        return -1;
     }
-    auto *fake_entry = &context.memory->busy_list.fake_entry;
-    int64_t last_lru_offset = context.memory->busy_list.fake_entry.lru_prev;
+    auto *fake_entry = &shard.busy_list.fake_entry;
+    int64_t last_lru_offset = shard.busy_list.fake_entry.lru_prev;
     auto *last_lru_entry = (hash_entry *)(context.ht_segment.item.base + last_lru_offset);
     last_lru_entry->lru_next = new_offset;
     fake_entry->lru_prev = new_offset;
     new_entry->lru_prev = last_lru_offset;
-    new_entry->lru_next = context.memory->busy_list.offset_f2base;
-    ++context.memory->hashtable.inserted;
-    ++context.memory->busy_list.entry_current;
+    new_entry->lru_next = shard.busy_list.offset_f2base;
+    ++shard.hashtable.inserted;
+    ++shard.busy_list.entry_current;
+    SHM_CRASH_POINT("ht_set_replaced");
     if (found) {
-        if (shm_allocator::free_hash_entry(context, old_offset) != 0) {
-            shm_hashtable::ht_clear(context, context.memory->global_stats);
+        if (shm_allocator::free_hash_entry(context, shard, old_offset) != 0) {
+            shm_hashtable::ht_clear(context, shard, context.memory->global_stats);
+            end_update(context, shard);
             return -1;
         }
     }
+    end_update(context, shard);
     return 0;
 }
 
-int shm_hashtable::ht_set_expires(context &context, const key_info &key_info, uint32_t expires) {
-    int res = ENOENT;
-    uint32_t ht_index = shm_hashtable::bucket_index(context, key_info);
-    int64_t entry_offset = context.memory->hashtable.bucket[ht_index];
-    hash_entry *current_entry = nullptr;
-    while (entry_offset > 0) {
-        current_entry = (hash_entry *)(context.ht_segment.item.base + entry_offset);
-        if (shm_hashtable::same_key(context, current_entry, key_info)) {
-            if (shm_hashtable::valid_key(current_entry)) {
-                current_entry->expires = expires;
-                res = 0;
-            } else {
-                res = ETIMEDOUT;
-            }
-            break;
+int shm_hashtable::ht_set_expires(context &context, shard &shard, const key_info &key_info, uint32_t hash_code,
+                                  uint32_t expires) {
+    index_cursor cursor{};
+    int64_t entry_offset = find_entry(context, shard, key_info, hash_code, cursor);
+    if (entry_offset == 0) {
+        return ENOENT;
+    }
+    auto *current_entry = (hash_entry *)(context.ht_segment.item.base + entry_offset);
+    if (!shm_hashtable::valid_key(current_entry)) {
+        return ETIMEDOUT;
+    }
+    current_entry->begin_update();
+    current_entry->expires = expires;
+    current_entry->end_update();
+    return 0;
+}
+
+int shm_hashtable::ht_get(context &context, shard &shard, const key_info &key_info, uint32_t hash_code,
+                          value_info &value_info, const value_range &range, uint32_t lru) {
+    index_cursor cursor{};
+    int64_t entry_offset = find_entry(context, shard, key_info, hash_code, cursor);
+    if (entry_offset == 0) {
+        return ENOENT;
+    }
+    auto *current_entry = (hash_entry *)(context.ht_segment.item.base + entry_offset);
+    if (!shm_hashtable::valid_key(current_entry)) {
+        return ETIMEDOUT;
+    }
+    if (range.size_of(current_entry->value_len) > range.capacity) {
+        current_entry->read_header(value_info);
+        return ENOBUFS;
+    }
+    uint32_t read_start{}, read_end{};
+    if (context.enable_stats) {
+        read_start = local_stats::get_cpu_cycle();
+    }
+    if (!current_entry->read_data(context.val_segments, value_info, context.memory->basic_unit.block.size,
+                                  UINT32_MAX, range)) {
+        printf("%s %s: pid: %d read_data() failed.\n", __FILE__, __func__, getpid());
+        return EFAULT;
+    }
+    if (context.enable_stats) {
+        read_end = local_stats::get_cpu_cycle();
+        context.local_stats.r_data.all_cost += read_end - read_start;
+        ++context.local_stats.r_data.call_count;
+        context.local_stats.r_data.max_cost = std::max(read_end - read_start, context.local_stats.r_data.max_cost);
+    }
+    record_access(context, shard, entry_offset, current_entry->version, lru);
+    return 0;
+}
+
+int shm_hashtable::ht_get_view(context &context, shard &shard, const key_info &key_info, uint32_t hash_code,
+                               value_view &view, uint32_t lru) {
+    index_cursor cursor{};
+    int64_t entry_offset = find_entry(context, shard, key_info, hash_code, cursor);
+    if (entry_offset == 0) {
+        return ENOENT;
+    }
+    auto *current_entry = (hash_entry *)(context.ht_segment.item.base + entry_offset);
+    if (!valid_key(current_entry)) {
+        return ETIMEDOUT;
+    }
+    if (current_entry->inlined != 0) {
+        // an overwrite in place or the next user of a freed slot rewrites the entry itself, the few bytes are copied
+        // instead of pinned
+        if (!current_entry->read_view(context.val_segments, view, context.memory->basic_unit.block.size)) {
+            return EFAULT;
+        }
+        view.inline_copy.resize(view.length);
+        if (view.length > 0) {
+            memcpy(view.inline_copy.data(), view.iov[0].iov_base, view.length);
+            view.iov[0].iov_base = view.inline_copy.data();
         }
-        entry_offset = current_entry->hash_next;
+        view.pin = SHM_PIN_SLOTS;
+        view.tag = 0;
+        view.shard_id = shard.lock.shard_id;
+        record_access(context, shard, entry_offset, current_entry->version, lru);
+        return 0;
     }
-    return res;
+    if (!shm_allocator::pin_blocks(context, shard, *current_entry, view.pin, view.tag)) {
+        return EBUSY;
+    }
+    if (!current_entry->read_view(context.val_segments, view, context.memory->basic_unit.block.size)) {
+        printf("%s %s: pid: %d read_view() failed.\n", __FILE__, __func__, getpid());
+        shm_allocator::unpin_blocks(context, shard, view.pin, view.tag, false);
+        view.iov.clear();
+        return EFAULT;
+    }
+    view.shard_id = shard.lock.shard_id;
+    record_access(context, shard, entry_offset, current_entry->version, lru);
+    return 0;
 }
 
-int shm_hashtable::ht_get(context &context, const key_info &key_info, value_info &value_info, uint32_t lru) {
-    int res = ENOENT;
-    uint32_t ht_index = shm_hashtable::bucket_index(context, key_info);
-    int64_t entry_offset = context.memory->hashtable.bucket[ht_index];
-    hash_entry *current_entry = nullptr;
-    while (entry_offset > 0) {
-        current_entry = (hash_entry *)(context.ht_segment.item.base + entry_offset);
-        if (!shm_hashtable::same_key(context, current_entry, key_info)) {
-            entry_offset = current_entry->hash_next;
-        } else {
-            if (!shm_hashtable::valid_key(current_entry)) {
-                res = ETIMEDOUT;
-                break;
+int shm_hashtable::ht_get_optimistic(context &context, const config &config, shard &shard, const key_info &key_info,
+                                     uint32_t hash_code, value_info &value_info, const value_range &range,
+                                     uint32_t lru) {
+    hashtable &table = shard.hashtable;
+    for (uint32_t attempt = 0; attempt < SHM_OPTIMISTIC_RETRY; ++attempt) {
+        if (attempt > 0) {
+            __sync_add_and_fetch(&context.memory->global_stats.optimistic_retry, 1);
+            sched_yield();
+        }
+        uint32_t table_version = table.version;
+        __sync_synchronize();
+        if ((table_version & 1u) != 0) {
+            continue;
+        }
+        int64_t current_offset = 0;
+        hash_entry *current_entry = nullptr;
+        bool broken = false;
+        if (table.index_type == SHM_INDEX_TYPE_SWISS) {
+            uint32_t position;
+            current_offset = shm_swiss_index::find(context, shard, key_info, hash_code, position);
+            if (current_offset > 0) {
+                current_entry = (hash_entry *)(context.ht_segment.item.base + current_offset);
             }
-            uint32_t read_start{}, read_end{};
-            if (context.enable_stats) {
-                read_start = local_stats::get_cpu_cycle();
+        } else {
+            // chains may be relinked under our feet, every offset is checked before it is dereferenced
+            index_cursor cursor{};
+            uint32_t steps = 0;
+            for (uint32_t round = 0; round < 2 && current_entry == nullptr && !broken; ++round) {
+                if (!select_table(context, shard, hash_code, round == 1, cursor)) {
+                    break;
+                }
+                current_offset = cursor.bucket[cursor.ht_index];
+                while (current_offset > 0) {
+                    if (!valid_entry_offset(shard, current_offset) || ++steps > shard.entry_queue.capacity) {
+                        broken = true;
+                        break;
+                    }
+                    auto *entry = (hash_entry *)(context.ht_segment.item.base + current_offset);
+                    if (same_key(context, entry, key_info, hash_code)) {
+                        current_entry = entry;
+                        break;
+                    }
+                    current_offset = entry->hash_next;
+                }
             }
-            current_entry->read_data(context.val_segments, value_info, context.memory->basic_unit.block.size);
-            if (context.enable_stats) {
-                read_end = local_stats::get_cpu_cycle();
-                context.local_stats.r_data.all_cost += read_end - read_start;
-                ++context.local_stats.r_data.call_count;
-                context.local_stats.r_data.max_cost =
-                    std::max(read_end - read_start, context.local_stats.r_data.max_cost);
+        }
+        uint32_t current_version = current_entry != nullptr ? current_entry->version : 0;
+        __sync_synchronize();
+        if (broken || table.version != table_version || (current_version & 1u) != 0) {
+            continue;
+        }
+        if (current_entry == nullptr) {
+            return ENOENT;
+        }
+        if (!valid_key(current_entry)) {
+            __sync_synchronize();
+            if (current_entry->version != current_version) {
+                continue;
             }
-            res = 0;
-
-            if (++current_entry->popular < lru)
-                break;
-            auto *fake_entry = (hash_entry *)(context.ht_segment.item.base + context.memory->busy_list.offset_f2base);
-            int64_t last_offset = fake_entry->lru_prev;
-            if (last_offset != entry_offset) {
-                auto *last_entry = (hash_entry *)(context.ht_segment.item.base + last_offset);
-                last_entry->lru_next = entry_offset;
-                fake_entry->lru_prev = entry_offset;
-                int64_t prev_lru_offset = current_entry->lru_prev;
-                auto *prev_lru_entry = (hash_entry *)(context.ht_segment.item.base + prev_lru_offset);
-                int64_t next_lru_offset = current_entry->lru_next;
-                auto *next_lru_entry = (hash_entry *)(context.ht_segment.item.base + next_lru_offset);
-                prev_lru_entry->lru_next = next_lru_offset;
-                next_lru_entry->lru_prev = prev_lru_offset;
-                current_entry->lru_next = context.memory->busy_list.offset_f2base;
-                current_entry->lru_prev = last_offset;
-                ++context.memory->global_stats.lru_count;
+            return ETIMEDOUT;
+        }
+        // a length beyond max_value_size is torn, read_data() turns it down and we go round again
+        uint32_t value_len = current_entry->value_len;
+        if (range.size_of(value_len) > range.capacity && value_len <= config.max_value_size) {
+            current_entry->read_header(value_info);
+            __sync_synchronize();
+            if (current_entry->version != current_version) {
+                continue;
             }
-            break;
+            return ENOBUFS;
+        }
+        uint32_t read_start{}, read_end{};
+        if (context.enable_stats) {
+            read_start = local_stats::get_cpu_cycle();
+        }
+        bool complete = current_entry->read_data(context.val_segments, value_info,
+                                                 context.memory->basic_unit.block.size, config.max_value_size, range);
+        __sync_synchronize();
+        if (!complete || current_entry->version != current_version) {
+            continue;
         }
+        if (context.enable_stats) {
+            read_end = local_stats::get_cpu_cycle();
+            context.local_stats.r_data.all_cost += read_end - read_start;
+            ++context.local_stats.r_data.call_count;
+            context.local_stats.r_data.max_cost = std::max(read_end - read_start, context.local_stats.r_data.max_cost);
+        }
+        record_access(context, shard, current_offset, current_version, lru);
+        return 0;
     }
-    return res;
+    __sync_add_and_fetch(&context.memory->global_stats.optimistic_fallback, 1);
+    return EAGAIN;
 }
 
-int shm_hashtable::ht_del(context &context, const key_info &key_info, bool by_recycle) {
-    uint32_t ht_index = bucket_index(context, key_info);
-    int64_t removed_offset = context.memory->hashtable.bucket[ht_index];
-    bool found = false;
-    hash_entry *prev_entry = nullptr;
-    hash_entry *removed_entry = nullptr;
-    while (removed_offset > 0) {
-        removed_entry = (hash_entry *)(context.ht_segment.item.base + removed_offset);
-        if (same_key(context, removed_entry, key_info)) {
-            found = true;
-            break;
-        }
-        removed_offset = removed_entry->hash_next;
-        prev_entry = removed_entry;
+void shm_hashtable::ht_get_batch(context &context, const config &config, batch_lookup *lookups, uint32_t count,
+                                 uint32_t lru) {
+    // a window of keys is walked round robin, one dependent load per visit, so while one key waits for its line
+    // the others issue theirs. A finished key hands its window slot to the next one.
+    batch_state window[SHM_BATCH_WINDOW];
+    uint32_t active = std::min(count, (uint32_t)SHM_BATCH_WINDOW);
+    uint32_t next = active;
+    for (uint32_t i = 0; i < active; ++i) {
+        window[i] = batch_state{&lookups[i], SHM_BATCH_START, 0, 0, nullptr, 0};
     }
-    if (!found) {
-        if (by_recycle) {
-            printf("%s %s: pid: %d ht_recycle() call ht_del() failed, clear hashtable...\n", __FILE__, __func__,
-                   getpid());
-            ht_clear(context, context.memory->global_stats);
+    uint32_t width = active;
+    for (uint32_t i = 0; active > 0; i = i + 1 == width ? 0 : i + 1) {
+        batch_state &state = window[i];
+        if (state.lookup == nullptr || !step_lookup(context, config, state, lru)) {
+            continue;
+        }
+        if (next < count) {
+            state = batch_state{&lookups[next++], SHM_BATCH_START, 0, 0, nullptr, 0};
+        } else {
+            state.lookup = nullptr;
+            --active;
         }
-        return -1;
-    }
-    if (prev_entry != nullptr) {
-        prev_entry->hash_next = removed_entry->hash_next;
-    } else {
-        context.memory->hashtable.bucket[ht_index] = removed_entry->hash_next;
     }
-    int64_t prev_lru_offset = removed_entry->lru_prev;
-    auto *prev_lru_entry = (hash_entry *)(context.ht_segment.item.base + prev_lru_offset);
-    int64_t next_lru_offset = removed_entry->lru_next;
-    auto *next_lru_entry = (hash_entry *)(context.ht_segment.item.base + next_lru_offset);
-    prev_lru_entry->lru_next = removed_entry->lru_next;
-    next_lru_entry->lru_prev = removed_entry->lru_prev;
-    if (shm_allocator::free_hash_entry(context, removed_offset) != 0) {
-        shm_hashtable::ht_clear(context, context.memory->global_stats);
-        return -1;
+}
+
+int shm_hashtable::ht_del(context &context, shard &shard, const key_info &key_info, uint32_t hash_code) {
+    begin_update(context, shard);
+    if (shard.hashtable.index_type == SHM_INDEX_TYPE_CHAIN) {
+        grow_index(context, shard);
     }
-    return 0;
+    index_cursor cursor{};
+    int64_t removed_offset = find_entry(context, shard, key_info, hash_code, cursor);
+    int res = removed_offset > 0 ? unlink_entry(context, shard, cursor, removed_offset) : -1;
+    end_update(context, shard);
+    return res;
 }
 
-int shm_hashtable::ht_recycle(context &context, const config &config, uint32_t block_used, bool force) {
-    int64_t current_offset = context.memory->busy_list.fake_entry.lru_next;
-    while (current_offset != context.memory->busy_list.offset_f2base) {
+int shm_hashtable::ht_recycle(context &context, const config &config, shard &shard, uint32_t size_class,
+                              uint32_t block_used, bool force) {
+    // evict by the latest order, not by the one of the last write
+    apply_access(context, shard);
+    shm_allocator::drain_magazines(context, shard, false);
+    int64_t current_offset = shard.busy_list.fake_entry.lru_next;
+    while (current_offset != shard.busy_list.offset_f2base) {
         auto *current_entry = (hash_entry *)(context.ht_segment.item.base + current_offset);
         int64_t current_next = current_entry->lru_next;
         if (config.recycle_valid || force || !valid_key(current_entry)) {
-            context.memory->global_stats.survive_duration += (uint32_t)(time(nullptr) - current_entry->born);
-            ++context.memory->global_stats.eliminate_count;
-            char *key_data = context.val_segments.items[current_entry->first_addr.index].base +
-                             (uint32_t)current_entry->first_addr.number * context.memory->basic_unit.block.size +
-                             sizeof(block_entry);
-            key_info temp_key_info(current_entry->key_len, key_data);
-            if (ht_del(context, temp_key_info, true) != 0) {
-                printf("%s %s: pid: %d ht_del() failed, force = %d.\n", __FILE__, __func__, getpid(), force);
+            __sync_add_and_fetch(&context.memory->global_stats.survive_duration,
+                                 (uint32_t)(time(nullptr) - current_entry->born));
+            __sync_add_and_fetch(&context.memory->global_stats.eliminate_count, 1);
+            if (evict_entry(context, shard, current_offset) != 0) {
+                printf("%s %s: pid: %d evict_entry() failed, force = %d.\n", __FILE__, __func__, getpid(), force);
             }
         }
         current_offset = current_next;
-        if (context.memory->idle_list.block_current >= block_used) {
+        if (shm_allocator::has_room(context, shard, size_class, block_used)) {
             break;
         }
     }
-    if (context.memory->idle_list.block_current < block_used) {
+    if (!shm_allocator::has_room(context, shard, size_class, block_used)) {
         printf("%s %s: pid: %d fail to recycle enough block.\n", __FILE__, __func__, getpid());
         return -1;
     }
     return 0;
 }
 
-int shm_hashtable::ht_clear(context &context, global_stats &global_stats) {
+int shm_hashtable::ht_clear(context &context, shard &shard, global_stats &global_stats) {
     global_stats.last_clear_time = time(nullptr);
-    auto cleared_hash_entry = (int)context.memory->busy_list.entry_current;
-    context.memory->hashtable.reset();
-    context.memory->entry_queue.reset();
-    context.memory->idle_list.reset(context.val_segments, context.memory->basic_unit.block.max_of_each);
-    context.memory->busy_list.reset();
+    auto cleared_hash_entry = (int)shard.busy_list.entry_current;
+    begin_update(context, shard);
+    shard.journal.clearing = 1;
+    // every block goes back to the idle list, optimistic readers of any entry must notice
+    auto *entries = (hash_entry *)(context.ht_segment.item.base + shard.entry_queue.offset_2base);
+    for (uint32_t index = 0; index < shard.entry_queue.capacity; ++index) {
+        entries[index].version = (entries[index].version | 1u) + 1u;
+    }
+    shard.hashtable.reset(context.ht_segment.item.base);
+    shard.entry_queue.reset();
+    shm_allocator::drain_magazines(context, shard, true);
+    shm_allocator::reset_idle(context, shard);
+    shard.busy_list.reset();
+    shard.journal.reset();
+    shard.access_ring.discard();
+    // every block is idle again, views still out read whatever lands there next
+    shard.pins.reset();
+    shard.slabs.reset();
+    end_update(context, shard);
     return cleared_hash_entry;
 }
 
-uint32_t shm_hashtable::get_capacity(uint32_t max_key_count) {
+int shm_hashtable::ht_repair(context &context, shard &shard, global_stats &global_stats) {
+    if (shard.journal.clearing != 0) {
+        return ht_clear(context, shard, global_stats);
+    }
+    char *base = context.ht_segment.item.base;
+    entry_queue &queue = shard.entry_queue;
+    auto *entries = (hash_entry *)(base + queue.offset_2base);
+    uint32_t max_of_each = context.memory->basic_unit.block.max_of_each;
+    uint32_t segment_count = std::min(context.val_segments.current, context.memory->basic_unit.segment.current);
+    begin_update(context, shard);
+
+    // the live entries are among the slots handed out so far, minus what the journal says was half done or being
+    // replaced; free entries were reset and claim no blocks
+    uint32_t count = std::min(queue.fresh, queue.capacity);
+    int64_t dead_fresh = shard.journal.fresh;
+    int64_t dead_victim = shard.journal.victim;
+    std::vector<uint8_t> claimed((size_t)segment_count * max_of_each, 0);
+    std::unordered_map<size_t, slab_claim> pages;
+    std::vector<hash_entry> survivors;
+    std::vector<bool> alive;
+    std::unordered_map<int64_t, size_t> by_offset;
+    std::unordered_map<std::string, size_t> by_key;
+    for (uint32_t slot = 0; slot < count; ++slot) {
+        int64_t offset = queue.offset_2base + (int64_t)sizeof(hash_entry) * slot;
+        hash_entry &entry = entries[slot];
+        if (offset == dead_fresh || offset == dead_victim ||
+            !claim_blocks(context, shard, entry, claimed, pages, segment_count)) {
+            continue;
+        }
+        uint32_t payload;
+        std::string key(entry.first_block(context.val_segments, context.memory->basic_unit.block.size, payload)->data,
+                        entry.key_len);
+        auto iter = by_key.find(key);
+        if (iter != by_key.end()) {
+            // a set replacing an entry journals it as the victim, so this takes a torn header; slots are reused in
+            // any order, keep the later born entry
+            if (entry.born < survivors[iter->second].born) {
+                release_blocks(context, entry, claimed, pages);
+                continue;
+            }
+            release_blocks(context, survivors[iter->second], claimed, pages);
+            alive[iter->second] = false;
+        }
+        by_key[key] = survivors.size();
+        by_offset[offset] = survivors.size();
+        survivors.push_back(entry);
+        alive.push_back(true);
+    }
+
+    // blocks of freed entries still read through a view stay claimed, live entries claimed theirs above
+    for (auto &slot : shard.pins.slots) {
+        uint64_t current = slot.tag;
+        if ((uint32_t)current == SHM_PIN_FREE) {
+            continue;
+        }
+        hash_entry pinned(0);
+        pinned.first_addr = slot.first_addr;
+        pinned.block_used = slot.block_used;
+        pinned.size_class = slot.size_class;
+        pinned.slab_slot = slot.slab_slot;
+        pinned.extent = slot.extent;
+        if (claim_blocks(context, shard, pinned, claimed, pages, segment_count)) {
+            slot.last_addr = pinned.last_addr;
+            slot.tag = (current & ~0xffffffffull) | SHM_PIN_RETIRED;
+        }
+    }
+
+    // keep the lru order for every entry still reachable from the head of the old list
+    std::vector<size_t> order;
+    std::vector<bool> placed(survivors.size(), false);
+    int64_t cursor = shard.busy_list.fake_entry.lru_next;
+    while (cursor != shard.busy_list.offset_f2base) {
+        auto iter = by_offset.find(cursor);
+        if (iter == by_offset.end() || placed[iter->second]) {
+            break;
+        }
+        placed[iter->second] = true;
+        if (alive[iter->second]) {
+            order.push_back(iter->second);
+        }
+        cursor = ((hash_entry *)(base + cursor))->lru_next;
+    }
+    for (size_t index = 0; index < survivors.size(); ++index) {
+        if (alive[index] && !placed[index]) {
+            order.push_back(index);
+        }
+    }
+
+    // write the survivors back compacted to the front of the slots and relink everything, the free stack starts
+    // empty again
+    for (uint32_t index = 0; index < queue.capacity; ++index) {
+        entries[index].version = (entries[index].version | 1u) + 1u;
+    }
+    shard.hashtable.reset(base);
+    auto *fake_entry = &shard.busy_list.fake_entry;
+    int64_t last_offset = shard.busy_list.offset_f2base;
+    for (uint32_t index = 0; index < order.size(); ++index) {
+        hash_entry &entry = entries[index];
+        int64_t offset = queue.offset_2base + (int64_t)sizeof(hash_entry) * index;
+        entry.update(survivors[order[index]]);
+        // the header may be torn, take the hash and the prefix from the key itself
+        uint32_t payload;
+        const char *key_data =
+            entry.first_block(context.val_segments, context.memory->basic_unit.block.size, payload)->data;
+        entry.hash_code = hash_key(context, key_data, entry.key_len);
+        memset(entry.key_prefix, 0, SHM_KEY_PREFIX_SIZE);
+        memcpy(entry.key_prefix, key_data, std::min(entry.key_len, SHM_KEY_PREFIX_SIZE));
+        insert_entry(context, shard, entry.hash_code, offset);
+        entry.lru_prev = last_offset;
+        entry.lru_next = shard.busy_list.offset_f2base;
+        ((hash_entry *)(base + last_offset))->lru_next = offset;
+        last_offset = offset;
+    }
+    fake_entry->lru_prev = last_offset;
+    if (order.empty()) {
+        fake_entry->lru_next = shard.busy_list.offset_f2base;
+    }
+    queue.free_entry = 0;
+    queue.fresh = (uint32_t)order.size();
+    shard.hashtable.inserted = (uint32_t)order.size();
+    shard.busy_list.entry_current = (uint32_t)order.size();
+    shard.access_ring.discard();
+
+    rebuild_slabs(context, shard, claimed, pages);
+    // every block of the shard's segments that no survivor uses is idle, in runs as long as they come
+    shm_allocator::drain_magazines(context, shard, true);
+    shard.idle_list.block_current = 0;
+    shard.idle_list.segment_count = 0;
+    shard.idle_list.fake_block.reset();
+    shard.extents.reset();
+    for (uint32_t index = 0; index < segment_count; ++index) {
+        if (context.segment_owner[index] != shard.lock.shard_id) {
+            continue;
+        }
+        ++shard.idle_list.segment_count;
+        for (uint32_t number = 0; number < max_of_each;) {
+            uint32_t end = number;
+            while (end < max_of_each && claimed[(size_t)index * max_of_each + end] == 0) {
+                ++end;
+            }
+            if (end > number) {
+                shm_allocator::add_idle_run(context, shard, index, number, end - number);
+            }
+            number = end + 1;
+        }
+    }
+    shard.journal.reset();
+    end_update(context, shard);
+    return (int)order.size();
+}
+
+uint32_t shm_hashtable::get_capacity(uint32_t max_key_count, uint32_t bucket_type) {
+    if (bucket_type == SHM_BUCKET_TYPE_POW2) {
+        uint32_t capacity = 1;
+        while (capacity < max_key_count && capacity < (1u << 31)) {
+            capacity <<= 1;
+        }
+        return capacity;
+    }
+    if (bucket_type == SHM_BUCKET_TYPE_FASTRANGE) {
+        return std::max(max_key_count, 1u);
+    }
     auto iter = std::upper_bound(prime_array.begin(), prime_array.end(), max_key_count);
     if (iter == prime_array.end()) {
         return prime_array.back();
@@ -264,6 +571,23 @@ uint32_t shm_hashtable::get_capacity(uint32_t max_key_count) {
     return *iter;
 }
 
+uint32_t shm_hashtable::hash_key(const context &context, const char *key, uint32_t len) {
+    return hash_by(context.memory->layout.hash_type, key, len);
+}
+
+uint32_t shm_hashtable::hash_by(uint32_t hash_type, const char *key, uint32_t len) {
+    switch (hash_type) {
+    case SHM_HASH_TYPE_WYHASH:
+        return wy_hash(key, len);
+#ifdef __SSE4_2__
+    case SHM_HASH_TYPE_CRC32C:
+        return crc32c_hash(key, len);
+#endif
+    default:
+        return simple_hash(key, len);
+    }
+}
+
 uint32_t shm_hashtable::simple_hash(const char *key, uint32_t len) {
     uint32_t hash = 0;
     const char *pEnd = key + len;
@@ -273,21 +597,665 @@ uint32_t shm_hashtable::simple_hash(const char *key, uint32_t len) {
     return hash;
 }
 
-uint32_t shm_hashtable::bucket_index(context &context, const key_info &key_info) {
-    uint32_t hash_code = simple_hash(key_info.data, key_info.length);
-    return (hash_code % context.memory->hashtable.capacity);
+namespace {
+const uint64_t wy_secret[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+                               0x589965cc75374cc3ull};
+
+inline uint64_t wy_mix(uint64_t a, uint64_t b) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+inline uint64_t wy_read8(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
 }
 
-bool shm_hashtable::same_key(context &context, hash_entry *old_entry, const key_info &key_info) {
-    if (old_entry->key_len != key_info.length) {
+inline uint64_t wy_read4(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+} // namespace
+
+uint32_t shm_hashtable::wy_hash(const char *key, uint32_t len) {
+    // wyhash (final version), folded to 32 bits
+    auto *p = (const uint8_t *)key;
+    uint64_t seed = wy_mix(wy_secret[0], wy_secret[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wy_read4(p) << 32) | wy_read4(p + ((len >> 3) << 2));
+            b = (wy_read4(p + len - 4) << 32) | wy_read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        uint32_t rest = len;
+        if (rest > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mix(wy_read8(p) ^ wy_secret[1], wy_read8(p + 8) ^ seed);
+                see1 = wy_mix(wy_read8(p + 16) ^ wy_secret[2], wy_read8(p + 24) ^ see1);
+                see2 = wy_mix(wy_read8(p + 32) ^ wy_secret[3], wy_read8(p + 40) ^ see2);
+                p += 48;
+                rest -= 48;
+            } while (rest > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (rest > 16) {
+            seed = wy_mix(wy_read8(p) ^ wy_secret[1], wy_read8(p + 8) ^ seed);
+            p += 16;
+            rest -= 16;
+        }
+        a = wy_read8(p + rest - 16);
+        b = wy_read8(p + rest - 8);
+    }
+    a ^= wy_secret[1];
+    b ^= seed;
+    __uint128_t product = (__uint128_t)a * b;
+    uint64_t hash = wy_mix((uint64_t)product ^ wy_secret[0] ^ len, (uint64_t)(product >> 64) ^ wy_secret[1]);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+uint32_t shm_hashtable::crc32c_hash(const char *key, uint32_t len) {
+#ifdef __SSE4_2__
+    // 8 bytes per crc32 instruction, then a murmur3 finalizer because crc bits are linear in the key bits
+    auto *p = (const uint8_t *)key;
+    uint64_t crc = ~0ull;
+    uint32_t rest = len;
+    for (; rest >= 8; rest -= 8, p += 8) {
+        crc = _mm_crc32_u64(crc, wy_read8(p));
+    }
+    auto hash = (uint32_t)crc;
+    if (rest >= 4) {
+        hash = _mm_crc32_u32(hash, (uint32_t)wy_read4(p));
+        p += 4;
+        rest -= 4;
+    }
+    for (; rest > 0; --rest, ++p) {
+        hash = _mm_crc32_u8(hash, *p);
+    }
+    hash ^= len;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+#else
+    return wy_hash(key, len);
+#endif
+}
+
+uint32_t shm_hashtable::shard_index(const context &context, uint32_t hash_code) {
+    // buckets take 'hash_code % capacity', so scramble the bits first to keep both choices independent
+    hash_code ^= hash_code >> 16;
+    hash_code *= 0x85ebca6bu;
+    hash_code ^= hash_code >> 13;
+    hash_code *= 0xc2b2ae35u;
+    hash_code ^= hash_code >> 16;
+    return hash_code % context.memory->layout.shard_count;
+}
+
+uint32_t shm_hashtable::get_shift(uint32_t bucket_type, uint32_t capacity) {
+    uint32_t shift = 32;
+    if (bucket_type == SHM_BUCKET_TYPE_POW2) {
+        while (capacity > 1) {
+            capacity >>= 1;
+            --shift;
+        }
+    }
+    return shift;
+}
+
+uint32_t shm_hashtable::bucket_index(const shard &shard, uint32_t hash_code) {
+    return bucket_of(shard.hashtable, hash_code);
+}
+
+uint32_t shm_hashtable::bucket_of(const hashtable &table, uint32_t hash_code) {
+    return reduce(table.bucket_type, table.capacity, table.bucket_shift, hash_code);
+}
+
+uint32_t shm_hashtable::reduce(uint32_t bucket_type, uint32_t capacity, uint32_t shift, uint32_t hash_code) {
+    if (bucket_type == SHM_BUCKET_TYPE_PRIME) {
+        return hash_code % capacity;
+    }
+    // no division: fibonacci hashing spreads a difference in any bit of the key hash into the high bits, then take
+    // the top bits (power of two) or multiply-shift them into [0, capacity) (lemire's fast range reduction)
+    uint32_t mixed = hash_code * 0x9e3779b1u;
+    if (bucket_type == SHM_BUCKET_TYPE_POW2) {
+        return (uint32_t)((uint64_t)mixed >> shift);
+    }
+    return (uint32_t)(((uint64_t)mixed * capacity) >> 32);
+}
+
+bool shm_hashtable::same_key(context &context, hash_entry *old_entry, const key_info &key_info, uint32_t hash_code) {
+    if (!same_header(old_entry, key_info, hash_code)) {
+        return false;
+    }
+    uint32_t prefix_len = std::min(key_info.length, SHM_KEY_PREFIX_SIZE);
+    if (key_info.length == prefix_len) {
+        return true;
+    }
+    uint32_t payload = 0;
+    const block_entry *first_block =
+        old_entry->first_block(context.val_segments, context.memory->basic_unit.block.size, payload);
+    if (first_block == nullptr || key_info.length > payload) {
         return false;
     }
-    const char *key_data = context.val_segments.items[old_entry->first_addr.index].base +
-                           (uint32_t)old_entry->first_addr.number * context.memory->basic_unit.block.size +
-                           sizeof(block_entry);
-    return memcmp(key_data, key_info.data, (uint32_t)key_info.length) == 0;
+    return memcmp(first_block->data + prefix_len, key_info.data + prefix_len, key_info.length - prefix_len) == 0;
+}
+
+bool shm_hashtable::same_header(const hash_entry *old_entry, const key_info &key_info, uint32_t hash_code) {
+    if (old_entry->hash_code != hash_code || old_entry->key_len != key_info.length) {
+        return false;
+    }
+    return memcmp(old_entry->key_prefix, key_info.data, std::min(key_info.length, SHM_KEY_PREFIX_SIZE)) == 0;
 }
 
 bool shm_hashtable::valid_key(hash_entry *old_entry) {
     return (old_entry->expires == 0 || old_entry->expires > time(nullptr));
-}
\ No newline at end of file
+}
+
+void shm_hashtable::begin_update(context &context, shard &shard) {
+    if (context.update_depth++ == 0) {
+        __sync_fetch_and_or(&shard.hashtable.version, 1u);
+    }
+}
+
+void shm_hashtable::end_update(context &context, shard &shard) {
+    if (--context.update_depth == 0) {
+        __sync_add_and_fetch(&shard.hashtable.version, 1u);
+    }
+}
+
+bool shm_hashtable::step_lookup(context &context, const config &config, batch_state &state, uint32_t lru) {
+    char *base = context.ht_segment.item.base;
+    batch_lookup &lookup = *state.lookup;
+    hashtable &table = lookup.shard->hashtable;
+    switch (state.stage) {
+    case SHM_BATCH_START:
+        state.table_version = table.version;
+        __sync_synchronize();
+        // swiss groups and a rehash in flight are left to ht_get_optimistic()
+        if ((state.table_version & 1u) != 0 || table.index_type != SHM_INDEX_TYPE_CHAIN || table.old_capacity != 0) {
+            lookup.result = EAGAIN;
+            return true;
+        }
+        state.bucket = table.bucket(base) + bucket_index(*lookup.shard, lookup.hash_code);
+        __builtin_prefetch(state.bucket);
+        state.stage = SHM_BATCH_BUCKET;
+        return false;
+    case SHM_BATCH_BUCKET:
+        state.entry_offset = *state.bucket;
+        return follow_chain(context, state);
+    case SHM_BATCH_ENTRY: {
+        auto *entry = (hash_entry *)(base + state.entry_offset);
+        if (!same_header(entry, *lookup.key, lookup.hash_code)) {
+            state.entry_offset = entry->hash_next;
+            return follow_chain(context, state);
+        }
+        // the rest of the key and the start of the value share the first block
+        uint32_t payload;
+        const block_entry *first_block =
+            entry->first_block(context.val_segments, context.memory->basic_unit.block.size, payload);
+        if (first_block != nullptr) {
+            __builtin_prefetch(first_block);
+        }
+        state.stage = SHM_BATCH_KEY;
+        return false;
+    }
+    default:
+        break;
+    }
+    auto *entry = (hash_entry *)(base + state.entry_offset);
+    if (!same_key(context, entry, *lookup.key, lookup.hash_code)) {
+        state.entry_offset = entry->hash_next;
+        return follow_chain(context, state);
+    }
+    uint32_t entry_version = entry->version;
+    __sync_synchronize();
+    lookup.result = EAGAIN;
+    if (table.version != state.table_version || (entry_version & 1u) != 0) {
+        return true;
+    }
+    if (!valid_key(entry)) {
+        __sync_synchronize();
+        if (entry->version == entry_version) {
+            lookup.result = ETIMEDOUT;
+        }
+        return true;
+    }
+    bool complete = entry->read_data(context.val_segments, *lookup.value, context.memory->basic_unit.block.size,
+                                     config.max_value_size, value_range(0, UINT32_MAX, UINT32_MAX));
+    __sync_synchronize();
+    if (complete && entry->version == entry_version) {
+        record_access(context, *lookup.shard, state.entry_offset, entry_version, lru);
+        lookup.result = 0;
+    }
+    return true;
+}
+
+bool shm_hashtable::follow_chain(context &context, batch_state &state) {
+    batch_lookup &lookup = *state.lookup;
+    const shard &shard = *lookup.shard;
+    if (state.entry_offset == 0) {
+        // the end of the chain only means a miss if no writer relinked it meanwhile
+        __sync_synchronize();
+        lookup.result = shard.hashtable.version == state.table_version ? ENOENT : EAGAIN;
+        return true;
+    }
+    if (!valid_entry_offset(shard, state.entry_offset) || ++state.steps > shard.entry_queue.capacity) {
+        lookup.result = EAGAIN;
+        return true;
+    }
+    __builtin_prefetch(context.ht_segment.item.base + state.entry_offset);
+    state.stage = SHM_BATCH_ENTRY;
+    return false;
+}
+
+void shm_hashtable::record_access(context &context, shard &shard, int64_t entry_offset, uint32_t entry_version,
+                                  uint32_t lru) {
+    access_ring &ring = shard.access_ring;
+    uint32_t ticket;
+    do {
+        ticket = ring.head;
+        // the lru order is a hint, a hit that finds the ring full is not worth waiting for
+        if (ticket - ring.tail >= SHM_ACCESS_RING_SIZE) {
+            __sync_add_and_fetch(&context.memory->global_stats.access_dropped, 1);
+            return;
+        }
+    } while (!__sync_bool_compare_and_swap(&ring.head, ticket, ticket + 1));
+    access_record &record = ring.records[ticket % SHM_ACCESS_RING_SIZE];
+    record.offset = entry_offset;
+    record.version = entry_version;
+    record.lru = lru;
+    __sync_synchronize();
+    record.sequence = ticket + 1;
+}
+
+void shm_hashtable::apply_access(context &context, shard &shard) {
+    access_ring &ring = shard.access_ring;
+    uint32_t head = ring.head;
+    for (uint32_t ticket = ring.tail; ticket != head; ++ticket) {
+        access_record &record = ring.records[ticket % SHM_ACCESS_RING_SIZE];
+        // a reader between taking its ticket and publishing is given a moment, then its hit is lost
+        for (uint32_t spin = 0; record.sequence != ticket + 1 && spin < SHM_LOCK_MAX_SPIN; ++spin) {
+            SHM_CPU_PAUSE();
+        }
+        __sync_synchronize();
+        if (record.sequence != ticket + 1 || !valid_entry_offset(shard, record.offset)) {
+            continue;
+        }
+        // an entry freed or reused since the hit has a newer version
+        auto *current_entry = (hash_entry *)(context.ht_segment.item.base + record.offset);
+        if (current_entry->version == record.version && ++current_entry->popular >= record.lru) {
+            promote_entry(context, shard, current_entry, record.offset);
+        }
+    }
+    __sync_synchronize();
+    ring.tail = head;
+}
+
+void shm_hashtable::promote_entry(context &context, shard &shard, hash_entry *current_entry, int64_t entry_offset) {
+    auto *fake_entry = (hash_entry *)(context.ht_segment.item.base + shard.busy_list.offset_f2base);
+    int64_t last_offset = fake_entry->lru_prev;
+    if (last_offset != entry_offset) {
+        auto *last_entry = (hash_entry *)(context.ht_segment.item.base + last_offset);
+        last_entry->lru_next = entry_offset;
+        fake_entry->lru_prev = entry_offset;
+        int64_t prev_lru_offset = current_entry->lru_prev;
+        auto *prev_lru_entry = (hash_entry *)(context.ht_segment.item.base + prev_lru_offset);
+        int64_t next_lru_offset = current_entry->lru_next;
+        auto *next_lru_entry = (hash_entry *)(context.ht_segment.item.base + next_lru_offset);
+        prev_lru_entry->lru_next = next_lru_offset;
+        next_lru_entry->lru_prev = prev_lru_offset;
+        current_entry->lru_next = shard.busy_list.offset_f2base;
+        current_entry->lru_prev = last_offset;
+        __sync_add_and_fetch(&context.memory->global_stats.lru_count, 1);
+    }
+}
+
+int shm_hashtable::evict_entry(context &context, shard &shard, int64_t entry_offset) {
+    begin_update(context, shard);
+    index_cursor cursor{};
+    if (!locate_entry(context, shard, entry_offset, cursor)) {
+        printf("%s %s: pid: %d entry is not in the index, clear hashtable...\n", __FILE__, __func__, getpid());
+        ht_clear(context, shard, context.memory->global_stats);
+        end_update(context, shard);
+        return -1;
+    }
+    int res = unlink_entry(context, shard, cursor, entry_offset);
+    end_update(context, shard);
+    return res;
+}
+
+int shm_hashtable::unlink_entry(context &context, shard &shard, const index_cursor &cursor, int64_t removed_offset) {
+    auto *removed_entry = (hash_entry *)(context.ht_segment.item.base + removed_offset);
+    remove_entry(context, shard, cursor, removed_offset);
+    int64_t prev_lru_offset = removed_entry->lru_prev;
+    auto *prev_lru_entry = (hash_entry *)(context.ht_segment.item.base + prev_lru_offset);
+    int64_t next_lru_offset = removed_entry->lru_next;
+    auto *next_lru_entry = (hash_entry *)(context.ht_segment.item.base + next_lru_offset);
+    prev_lru_entry->lru_next = removed_entry->lru_next;
+    next_lru_entry->lru_prev = removed_entry->lru_prev;
+    if (shm_allocator::free_hash_entry(context, shard, removed_offset) != 0) {
+        shm_hashtable::ht_clear(context, shard, context.memory->global_stats);
+        return -1;
+    }
+    return 0;
+}
+
+int64_t shm_hashtable::find_entry(context &context, const shard &shard, const key_info &key_info, uint32_t hash_code,
+                                  index_cursor &cursor) {
+    if (shard.hashtable.index_type == SHM_INDEX_TYPE_SWISS) {
+        return shm_swiss_index::find(context, shard, key_info, hash_code, cursor.ht_index);
+    }
+    // while the index grows a key is either still in the old table or already in the current one
+    for (uint32_t round = 0; round < 2 && select_table(context, shard, hash_code, round == 1, cursor); ++round) {
+        int64_t current_offset = cursor.bucket[cursor.ht_index];
+        while (current_offset > 0) {
+            auto *current_entry = (hash_entry *)(context.ht_segment.item.base + current_offset);
+            if (same_key(context, current_entry, key_info, hash_code)) {
+                return current_offset;
+            }
+            cursor.prev_entry = current_entry;
+            current_offset = current_entry->hash_next;
+        }
+    }
+    return 0;
+}
+
+bool shm_hashtable::locate_entry(context &context, const shard &shard, int64_t entry_offset, index_cursor &cursor) {
+    // the stored hash leads to the chain or the probe sequence, the entry itself is matched by offset
+    uint32_t hash_code = ((hash_entry *)(context.ht_segment.item.base + entry_offset))->hash_code;
+    if (shard.hashtable.index_type == SHM_INDEX_TYPE_SWISS) {
+        return shm_swiss_index::locate(context, shard, hash_code, entry_offset, cursor.ht_index);
+    }
+    for (uint32_t round = 0; round < 2 && select_table(context, shard, hash_code, round == 1, cursor); ++round) {
+        int64_t current_offset = cursor.bucket[cursor.ht_index];
+        while (current_offset > 0 && current_offset != entry_offset) {
+            cursor.prev_entry = (hash_entry *)(context.ht_segment.item.base + current_offset);
+            current_offset = cursor.prev_entry->hash_next;
+        }
+        if (current_offset == entry_offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool shm_hashtable::insert_entry(context &context, shard &shard, uint32_t hash_code, int64_t entry_offset) {
+    if (shard.hashtable.index_type == SHM_INDEX_TYPE_SWISS) {
+        return shm_swiss_index::insert(context, shard, hash_code, entry_offset);
+    }
+    int64_t *bucket = shard.hashtable.bucket(context.ht_segment.item.base);
+    uint32_t ht_index = bucket_index(shard, hash_code);
+    ((hash_entry *)(context.ht_segment.item.base + entry_offset))->hash_next = bucket[ht_index];
+    bucket[ht_index] = entry_offset;
+    return true;
+}
+
+void shm_hashtable::replace_entry(context &context, shard &shard, const index_cursor &cursor, int64_t old_offset,
+                                  int64_t new_offset) {
+    if (shard.hashtable.index_type == SHM_INDEX_TYPE_SWISS) {
+        shm_swiss_index::assign(context, shard, cursor.ht_index, new_offset);
+        return;
+    }
+    ((hash_entry *)(context.ht_segment.item.base + new_offset))->hash_next =
+        ((hash_entry *)(context.ht_segment.item.base + old_offset))->hash_next;
+    if (cursor.prev_entry != nullptr) {
+        cursor.prev_entry->hash_next = new_offset;
+    } else {
+        cursor.bucket[cursor.ht_index] = new_offset;
+    }
+}
+
+void shm_hashtable::remove_entry(context &context, shard &shard, const index_cursor &cursor, int64_t removed_offset) {
+    if (shard.hashtable.index_type == SHM_INDEX_TYPE_SWISS) {
+        shm_swiss_index::erase(context, shard, cursor.ht_index);
+        return;
+    }
+    int64_t next_offset = ((hash_entry *)(context.ht_segment.item.base + removed_offset))->hash_next;
+    if (cursor.prev_entry != nullptr) {
+        cursor.prev_entry->hash_next = next_offset;
+    } else {
+        cursor.bucket[cursor.ht_index] = next_offset;
+    }
+}
+
+void shm_hashtable::grow_index(context &context, shard &shard) {
+    hashtable &table = shard.hashtable;
+    if (table.offset_2old == 0) {
+        return;
+    }
+    char *base = context.ht_segment.item.base;
+    if (table.old_capacity == 0) {
+        if (table.inserted < table.capacity || table.capacity >= table.max_capacity) {
+            return;
+        }
+        // the other region is clean: a finished rehash emptied it bucket by bucket
+        table.old_capacity = table.capacity;
+        table.old_shift = table.bucket_shift;
+        table.rehash_index = 0;
+        std::swap(table.offset_2base, table.offset_2old);
+        table.capacity = std::min(get_capacity(table.capacity * 2, table.bucket_type), table.max_capacity);
+        table.bucket_shift = get_shift(table.bucket_type, table.capacity);
+    }
+    // every write moves a few old buckets, so no single operation pays for the whole rehash
+    int64_t *old_bucket = table.old_bucket(base);
+    int64_t *bucket = table.bucket(base);
+    for (uint32_t step = 0; step < SHM_REHASH_STEP && table.rehash_index < table.old_capacity; ++step) {
+        int64_t current_offset = old_bucket[table.rehash_index];
+        old_bucket[table.rehash_index] = 0;
+        while (current_offset > 0) {
+            auto *entry = (hash_entry *)(base + current_offset);
+            int64_t next_offset = entry->hash_next;
+            uint32_t ht_index = bucket_index(shard, entry->hash_code);
+            entry->hash_next = bucket[ht_index];
+            bucket[ht_index] = current_offset;
+            current_offset = next_offset;
+        }
+        ++table.rehash_index;
+    }
+    if (table.rehash_index >= table.old_capacity) {
+        table.old_capacity = 0;
+        table.rehash_index = 0;
+    }
+}
+
+bool shm_hashtable::select_table(context &context, const shard &shard, uint32_t hash_code, bool old,
+                                 index_cursor &cursor) {
+    const hashtable &table = shard.hashtable;
+    cursor.prev_entry = nullptr;
+    if (!old) {
+        cursor.bucket = table.bucket(context.ht_segment.item.base);
+        cursor.ht_index = bucket_index(shard, hash_code);
+        return true;
+    }
+    uint32_t old_capacity = table.old_capacity;
+    if (old_capacity == 0) {
+        return false;
+    }
+    cursor.bucket = table.old_bucket(context.ht_segment.item.base);
+    cursor.ht_index = reduce(table.bucket_type, old_capacity, table.old_shift, hash_code);
+    return true;
+}
+
+bool shm_hashtable::claim_blocks(context &context, const shard &shard, hash_entry &entry,
+                                 std::vector<uint8_t> &claimed, std::unordered_map<size_t, slab_claim> &pages,
+                                 uint32_t segment_count) {
+    if (entry.inlined != 0) {
+        entry.last_addr.reset();
+        return entry.size_class == 0 && entry.block_used == 0 &&
+               shm_allocator::fits_inline(entry.key_len, entry.value_len);
+    }
+    if (entry.size_class != 0) {
+        return claim_slot(context, shard, entry, claimed, pages, segment_count);
+    }
+    if (entry.extent != 0) {
+        entry.last_addr = entry.first_addr;
+        entry.last_addr.number += (int32_t)entry.block_used - 1;
+        return claim_run(context, shard, entry, claimed, segment_count);
+    }
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    uint32_t rest_of_block = block_size - (uint32_t)sizeof(block_entry);
+    if (entry.block_used == 0 || SHM_MEM_ALIGN_BYTE(entry.key_len) > rest_of_block ||
+        (uint64_t)SHM_MEM_ALIGN_BYTE(entry.key_len) + entry.value_len > (uint64_t)rest_of_block * entry.block_used) {
+        return false;
+    }
+    // the chain must have exactly 'block_used' blocks of this shard that nobody else uses
+    block_addr cursor_addr = entry.first_addr;
+    uint32_t count = 0;
+    bool valid = true;
+    for (; count < entry.block_used; ++count) {
+        auto *cursor_entry = (block_entry *)context.val_segments.block(cursor_addr, block_size);
+        if (cursor_entry == nullptr || (uint32_t)cursor_addr.index >= segment_count ||
+            context.segment_owner[cursor_addr.index] != shard.lock.shard_id) {
+            valid = false;
+            break;
+        }
+        uint8_t &bit = claimed[(size_t)cursor_addr.index * context.memory->basic_unit.block.max_of_each +
+                               (uint32_t)cursor_addr.number];
+        if (bit != 0) {
+            valid = false;
+            break;
+        }
+        bit = 1;
+        entry.last_addr = cursor_addr;
+        cursor_addr = cursor_entry->next;
+    }
+    if (valid && !cursor_addr.valid_addr()) {
+        return true;
+    }
+    cursor_addr = entry.first_addr;
+    for (uint32_t index = 0; index < count; ++index) {
+        auto *cursor_entry = (block_entry *)context.val_segments.block(cursor_addr, block_size);
+        claimed[(size_t)cursor_addr.index * context.memory->basic_unit.block.max_of_each +
+                (uint32_t)cursor_addr.number] = 0;
+        cursor_addr = cursor_entry->next;
+    }
+    return false;
+}
+
+bool shm_hashtable::claim_slot(context &context, const shard &shard, const hash_entry &entry,
+                               std::vector<uint8_t> &claimed, std::unordered_map<size_t, slab_claim> &pages,
+                               uint32_t segment_count) {
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    uint32_t payload = 0;
+    if (entry.size_class > context.memory->basic_unit.block.slab_classes || entry.block_used != 0 ||
+        entry.first_block(context.val_segments, block_size, payload) == nullptr ||
+        (uint64_t)SHM_MEM_ALIGN_BYTE(entry.key_len) + entry.value_len > payload ||
+        (uint32_t)entry.first_addr.index >= segment_count ||
+        context.segment_owner[entry.first_addr.index] != shard.lock.shard_id) {
+        return false;
+    }
+    // a page holds slots of one size class only, and each slot belongs to one entry
+    size_t page_index = (size_t)entry.first_addr.index * context.memory->basic_unit.block.max_of_each +
+                        (uint32_t)entry.first_addr.number;
+    if (claimed[page_index] == 1) {
+        return false;
+    }
+    slab_claim &page = pages[page_index];
+    if (claimed[page_index] == 0) {
+        claimed[page_index] = 2;
+        page.size_class = entry.size_class;
+        page.slots.assign(slab_page::capacity(block_size, entry.size_class), 0);
+    }
+    if (page.size_class != entry.size_class || page.slots[entry.slab_slot] != 0) {
+        return false;
+    }
+    page.slots[entry.slab_slot] = 1;
+    return true;
+}
+
+bool shm_hashtable::claim_run(context &context, const shard &shard, const hash_entry &entry,
+                              std::vector<uint8_t> &claimed, uint32_t segment_count) {
+    uint32_t max_of_each = context.memory->basic_unit.block.max_of_each;
+    uint32_t payload = 0;
+    if (entry.block_used == 0 || (uint32_t)entry.first_addr.index >= segment_count ||
+        context.segment_owner[entry.first_addr.index] != shard.lock.shard_id ||
+        entry.first_block(context.val_segments, context.memory->basic_unit.block.size, payload) == nullptr ||
+        (uint32_t)entry.first_addr.number + entry.block_used > max_of_each ||
+        (uint64_t)SHM_MEM_ALIGN_BYTE(entry.key_len) + entry.value_len > payload) {
+        return false;
+    }
+    uint8_t *first = claimed.data() + (size_t)entry.first_addr.index * max_of_each + (uint32_t)entry.first_addr.number;
+    // a run is claimed whole or not at all
+    if (std::any_of(first, first + entry.block_used, [](uint8_t bit) { return bit != 0; })) {
+        return false;
+    }
+    std::fill(first, first + entry.block_used, 1);
+    return true;
+}
+
+void shm_hashtable::release_blocks(context &context, const hash_entry &entry, std::vector<uint8_t> &claimed,
+                                   std::unordered_map<size_t, slab_claim> &pages) {
+    if (entry.inlined != 0) {
+        return;
+    }
+    if (entry.size_class != 0) {
+        // the page itself stays claimed, rebuild_slabs() lets it go if this was its last slot
+        pages[(size_t)entry.first_addr.index * context.memory->basic_unit.block.max_of_each +
+              (uint32_t)entry.first_addr.number]
+            .slots[entry.slab_slot] = 0;
+        return;
+    }
+    if (entry.extent != 0) {
+        size_t first = (size_t)entry.first_addr.index * context.memory->basic_unit.block.max_of_each +
+                       (uint32_t)entry.first_addr.number;
+        std::fill(claimed.data() + first, claimed.data() + first + entry.block_used, 0);
+        return;
+    }
+    block_addr cursor_addr = entry.first_addr;
+    for (uint32_t index = 0; index < entry.block_used; ++index) {
+        auto *cursor_entry =
+            (block_entry *)context.val_segments.block(cursor_addr, context.memory->basic_unit.block.size);
+        claimed[(size_t)cursor_addr.index * context.memory->basic_unit.block.max_of_each +
+                (uint32_t)cursor_addr.number] = 0;
+        cursor_addr = cursor_entry->next;
+    }
+}
+
+bool shm_hashtable::valid_entry_offset(const shard &shard, int64_t entry_offset) {
+    int64_t first = shard.entry_queue.offset_2base;
+    int64_t last = first + (int64_t)sizeof(hash_entry) * shard.entry_queue.capacity;
+    return entry_offset >= first && entry_offset < last && (entry_offset - first) % (int64_t)sizeof(hash_entry) == 0;
+}
+
+void shm_hashtable::rebuild_slabs(context &context, shard &shard, std::vector<uint8_t> &claimed,
+                                  std::unordered_map<size_t, slab_claim> &pages) {
+    uint32_t block_size = context.memory->basic_unit.block.size;
+    uint32_t max_of_each = context.memory->basic_unit.block.max_of_each;
+    shard.slabs.reset();
+    for (auto &claim : pages) {
+        block_addr page_addr;
+        page_addr.index = (int32_t)(claim.first / max_of_each);
+        page_addr.number = (int32_t)(claim.first % max_of_each);
+        auto capacity = (uint32_t)claim.second.slots.size();
+        auto used = (uint32_t)std::count(claim.second.slots.begin(), claim.second.slots.end(), 1);
+        if (used == 0) {
+            claimed[claim.first] = 0;
+            continue;
+        }
+        slab_page *page = shard.slabs.page(context.val_segments, block_size, page_addr);
+        page->reset(claim.second.size_class);
+        page->used = used;
+        page->fresh = capacity;
+        for (uint32_t slot = capacity; slot-- > 0;) {
+            if (claim.second.slots[slot] == 0) {
+                *(uint32_t *)((block_entry *)page->slot(slot))->data = page->free_slot;
+                page->free_slot = slot;
+            }
+        }
+        ++shard.slabs.pages;
+        if (used < capacity) {
+            shard.slabs.link(context.val_segments, block_size, page_addr);
+        }
+    }
+}
@@ -2,21 +2,116 @@
 #define SHMCACHE_SHM_HASHTABLE_H
 
 #include "common_types.h"
+#include <unordered_map>
 #include <vector>
 
+// where an entry hangs in the index: its bucket (in the current or the old table) and chain predecessor, or its
+// lane in a swiss index
+struct index_cursor {
+    int64_t *bucket;
+    uint32_t ht_index;
+    hash_entry *prev_entry;
+};
+
+// one key of a batched lookup, see shm_hashtable::ht_get_batch()
+struct batch_lookup {
+    const key_info *key;
+    value_info *value;
+    struct shard *shard;
+    uint32_t hash_code;
+    // 0, ENOENT or ETIMEDOUT, EAGAIN if the key has to be looked up on its own
+    int result;
+};
+
+// a key of ht_get_batch() on its way down the chain, each stage ends with a prefetch of what the next one reads
+struct batch_state {
+    batch_lookup *lookup;
+    uint32_t stage;
+    uint32_t table_version;
+    uint32_t steps;
+    int64_t *bucket;
+    int64_t entry_offset;
+};
+
+// slots of one slab page in use by the entries ht_repair() keeps
+struct slab_claim {
+    uint32_t size_class;
+    std::vector<uint8_t> slots;
+};
+
 class shm_hashtable {
 public:
-    static int ht_set(context &context, const config &config, const key_info &key_info, const value_info &value_info);
-    static int ht_set_expires(context &context, const key_info &key_info, uint32_t expires);
-    static int ht_get(context &context, const key_info &key_info, value_info &value_info, uint32_t lru);
-    static int ht_del(context &context, const key_info &key_info, bool by_recycle);
-    static int ht_recycle(context &context, const config &config, uint32_t block_used, bool force);
-    static int ht_clear(context &context, global_stats &global_stats);
-    static uint32_t get_capacity(uint32_t max_key_count);
+    static int ht_set(context &context, const config &config, shard &shard, const key_info &key_info,
+                      uint32_t hash_code, const value_info &value_info);
+    static int ht_set_expires(context &context, shard &shard, const key_info &key_info, uint32_t hash_code,
+                              uint32_t expires);
+    // ENOBUFS and the header of the value in 'value_info' if the range does not fit its capacity
+    static int ht_get(context &context, shard &shard, const key_info &key_info, uint32_t hash_code,
+                      value_info &value_info, const value_range &range, uint32_t lru);
+    // pins the blocks of the value instead of copying it, see shm_allocator::pin_blocks()
+    static int ht_get_view(context &context, shard &shard, const key_info &key_info, uint32_t hash_code,
+                           value_view &view, uint32_t lru);
+    static int ht_get_optimistic(context &context, const config &config, shard &shard, const key_info &key_info,
+                                 uint32_t hash_code, value_info &value_info, const value_range &range, uint32_t lru);
+    // lock free lookup of many keys at once, their chain walks are interleaved so the cache misses overlap
+    static void ht_get_batch(context &context, const config &config, batch_lookup *lookups, uint32_t count,
+                             uint32_t lru);
+    static int ht_del(context &context, shard &shard, const key_info &key_info, uint32_t hash_code);
+    // evicts until a slot of 'size_class' or 'block_used' blocks are free
+    static int ht_recycle(context &context, const config &config, shard &shard, uint32_t size_class,
+                          uint32_t block_used, bool force);
+    static int ht_clear(context &context, shard &shard, global_stats &global_stats);
+    static int ht_repair(context &context, shard &shard, global_stats &global_stats);
+    static uint32_t get_capacity(uint32_t max_key_count, uint32_t bucket_type);
+    static uint32_t get_shift(uint32_t bucket_type, uint32_t capacity);
+    static uint32_t hash_key(const context &context, const char *key, uint32_t len);
+    static uint32_t hash_by(uint32_t hash_type, const char *key, uint32_t len);
     static uint32_t simple_hash(const char *key, uint32_t len);
-    static uint32_t bucket_index(context &context, const key_info &key_info);
-    static bool same_key(context &context, hash_entry *old_entry, const key_info &key_info);
+    static uint32_t wy_hash(const char *key, uint32_t len);
+    static uint32_t crc32c_hash(const char *key, uint32_t len);
+    static uint32_t shard_index(const context &context, uint32_t hash_code);
+    static uint32_t bucket_index(const shard &shard, uint32_t hash_code);
+    static uint32_t bucket_of(const hashtable &table, uint32_t hash_code);
+    static uint32_t reduce(uint32_t bucket_type, uint32_t capacity, uint32_t shift, uint32_t hash_code);
+    static bool same_key(context &context, hash_entry *old_entry, const key_info &key_info, uint32_t hash_code);
     static bool valid_key(hash_entry *old_entry);
+    static void begin_update(context &context, shard &shard);
+    static void end_update(context &context, shard &shard);
+
+private:
+    static void record_access(context &context, shard &shard, int64_t entry_offset, uint32_t entry_version,
+                              uint32_t lru);
+    static bool step_lookup(context &context, const config &config, batch_state &state, uint32_t lru);
+    static bool follow_chain(context &context, batch_state &state);
+    static bool same_header(const hash_entry *old_entry, const key_info &key_info, uint32_t hash_code);
+    static void apply_access(context &context, shard &shard);
+    static int evict_entry(context &context, shard &shard, int64_t entry_offset);
+    static void grow_index(context &context, shard &shard);
+    static bool select_table(context &context, const shard &shard, uint32_t hash_code, bool old, index_cursor &cursor);
+    static int unlink_entry(context &context, shard &shard, const index_cursor &cursor, int64_t removed_offset);
+    static int64_t find_entry(context &context, const shard &shard, const key_info &key_info, uint32_t hash_code,
+                              index_cursor &cursor);
+    static bool locate_entry(context &context, const shard &shard, int64_t entry_offset, index_cursor &cursor);
+    static bool insert_entry(context &context, shard &shard, uint32_t hash_code, int64_t entry_offset);
+    static void replace_entry(context &context, shard &shard, const index_cursor &cursor, int64_t old_offset,
+                              int64_t new_offset);
+    static void remove_entry(context &context, shard &shard, const index_cursor &cursor, int64_t removed_offset);
+    static void promote_entry(context &context, shard &shard, hash_entry *current_entry, int64_t entry_offset);
+    static bool valid_entry_offset(const shard &shard, int64_t entry_offset);
+    // 'claimed' is 1 for a block of a chain and 2 for a slab page, whose slots are in 'pages'
+    // also sets 'last_addr' from the blocks it walked
+    static bool claim_blocks(context &context, const shard &shard, hash_entry &entry,
+                             std::vector<uint8_t> &claimed, std::unordered_map<size_t, slab_claim> &pages,
+                             uint32_t segment_count);
+    static bool claim_slot(context &context, const shard &shard, const hash_entry &entry, std::vector<uint8_t> &claimed,
+                           std::unordered_map<size_t, slab_claim> &pages, uint32_t segment_count);
+    static bool claim_run(context &context, const shard &shard, const hash_entry &entry, std::vector<uint8_t> &claimed,
+                          uint32_t segment_count);
+    static void release_blocks(context &context, const hash_entry &entry, std::vector<uint8_t> &claimed,
+                               std::unordered_map<size_t, slab_claim> &pages);
+    // pages without a claimed slot go back to the idle blocks, the others get their free slots and lists back
+    static void rebuild_slabs(context &context, shard &shard, std::vector<uint8_t> &claimed,
+                              std::unordered_map<size_t, slab_claim> &pages);
 
 private:
     static const std::vector<uint32_t> prime_array;
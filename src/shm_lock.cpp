@@ -1,13 +1,20 @@
 #include "shm_lock.h"
+#include "shm_allocator.h"
 #include "shm_hashtable.h"
+#include <algorithm>
 #include <cerrno>
 #include <csignal>
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
-int shm_lock::lock_init(context &context) {
+pid_t shm_lock::self_pid = 0;
+
+int shm_lock::lock_init(memory_lock &lock, uint32_t type, int32_t shard_id) {
     int res;
     pthread_mutexattr_t mat;
     if ((res = pthread_mutexattr_init(&mat)) != 0) {
@@ -22,85 +29,162 @@ int shm_lock::lock_init(context &context) {
         printf("%s %s: pid: %d pthread_mutexattr_settype() failed.\n", __FILE__, __func__, getpid());
         return res;
     }
-    if ((res = pthread_mutex_init(&context.memory->global_lock.mutex, &mat)) != 0) {
+    // the next locker gets EOWNERDEAD instead of waiting forever on a lock whose owner died
+    if ((res = pthread_mutexattr_setrobust(&mat, PTHREAD_MUTEX_ROBUST)) != 0) {
+        printf("%s %s: pid: %d pthread_mutexattr_setrobust() failed.\n", __FILE__, __func__, getpid());
+        return res;
+    }
+    if ((res = pthread_mutex_init(&lock.mutex, &mat)) != 0) {
         printf("%s %s: pid: %d pthread_mutex_init() failed.\n", __FILE__, __func__, getpid());
         return res;
     }
     pthread_mutexattr_destroy(&mat);
-    context.memory->global_lock.owner = -1;
+    lock.reset();
+    lock.type = type;
+    lock.shard_id = shard_id;
     return 0;
 }
 
-int shm_lock::read_lock(context &context, const config &config, global_stats &global_stats) {
+int shm_lock::read_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats) {
     int res;
-    __sync_add_and_fetch(&global_stats.r_lock_total, 1);
-    uint32_t ticks = 0;
-    while ((res = pthread_mutex_trylock(&context.memory->global_lock.mutex)) == EBUSY) {
-        __sync_add_and_fetch(&global_stats.r_lock_retry, 1);
-        usleep(config.try_r_lk_interval);
-        ++ticks;
-        if (ticks > config.detect_r_dl_ticks) {
-            ticks = 0;
-            pid_t pid = context.memory->global_lock.owner;
-            if ((pid == -1) || ((kill(pid, 0) != 0) && (errno == ESRCH || errno == ENOENT))) {
-                __sync_add_and_fetch(&global_stats.detect_deadlock, 1);
-                handle_deadlock(context, config, global_stats);
-            }
-        }
+    if (lock.type == SHM_LOCK_TYPE_RWLOCK) {
+        return rw_read_lock(context, config, lock, global_stats);
     }
-    if (res != 0) {
-        printf("%s %s: pid: %d error %d.\n", __FILE__, __func__, getpid(), res);
+    if (lock.type == SHM_LOCK_TYPE_FUTEX) {
+        res = futex_lock(config, lock, global_stats, true);
+    } else if (lock.type == SHM_LOCK_TYPE_MCS) {
+        res = mcs_lock(context, config, lock, global_stats, true);
     } else {
-        context.memory->global_lock.owner = getpid();
+        res = mutex_lock(context, config, lock, global_stats, true);
+    }
+    if (res == 0) {
+        check_repair(context, config, lock, global_stats);
     }
     return res;
 }
 
-int shm_lock::read_unlock(context &context) {
+int shm_lock::read_unlock(context &context, memory_lock &lock) {
     int res;
-    context.memory->global_lock.owner = -1;
-    res = pthread_mutex_unlock(&context.memory->global_lock.mutex);
+    if (lock.type == SHM_LOCK_TYPE_RWLOCK) {
+        if (context.reader_slot < 0) {
+            printf("%s %s: pid: %d read_unlock() without reader slot.\n", __FILE__, __func__, getpid());
+            return EPERM;
+        }
+        __sync_lock_release(&lock.readers[context.reader_slot].pid);
+        context.reader_slot = -1;
+        return 0;
+    }
+    if (lock.type == SHM_LOCK_TYPE_FUTEX) {
+        futex_unlock(context, lock);
+        return 0;
+    }
+    if (lock.type == SHM_LOCK_TYPE_MCS) {
+        mcs_unlock(context, lock);
+        return 0;
+    }
+    lock.owner = -1;
+    res = pthread_mutex_unlock(&lock.mutex);
     if (res != 0) {
         printf("%s %s: pid: %d read_unlock() failed.\n", __FILE__, __func__, getpid());
     }
     return res;
 }
 
-int shm_lock::write_lock(context &context, const config &config, global_stats &global_stats) {
+int shm_lock::write_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats) {
     int res;
-    __sync_add_and_fetch(&global_stats.w_lock_total, 1);
-    uint32_t ticks = 0;
-    while ((res = pthread_mutex_trylock(&context.memory->global_lock.mutex)) == EBUSY) {
-        __sync_add_and_fetch(&global_stats.w_lock_retry, 1);
-        usleep(config.try_w_lk_interval);
-        ++ticks;
-        if (ticks > config.detect_w_dl_ticks) {
-            ticks = 0;
-            pid_t pid = context.memory->global_lock.owner;
-            if ((pid == -1) || ((kill(pid, 0) != 0) && (errno == ESRCH || errno == ENOENT))) {
-                __sync_add_and_fetch(&global_stats.detect_deadlock, 1);
-                handle_deadlock(context, config, global_stats);
-            }
-        }
-    }
-    if (res != 0) {
-        printf("%s %s: pid: %d error %d.\n", __FILE__, __func__, getpid(), res);
+    if (lock.type == SHM_LOCK_TYPE_RWLOCK) {
+        res = rw_write_lock(context, config, lock, global_stats);
+    } else if (lock.type == SHM_LOCK_TYPE_FUTEX) {
+        res = futex_lock(config, lock, global_stats, false);
+    } else if (lock.type == SHM_LOCK_TYPE_MCS) {
+        res = mcs_lock(context, config, lock, global_stats, false);
     } else {
-        context.memory->global_lock.owner = getpid();
+        res = mutex_lock(context, config, lock, global_stats, false);
+    }
+    if (res == 0) {
+        check_repair(context, config, lock, global_stats);
     }
     return res;
 }
 
-int shm_lock::write_unlock(context &context) {
+int shm_lock::write_unlock(context &context, memory_lock &lock) {
     int res;
-    context.memory->global_lock.owner = -1;
-    res = pthread_mutex_unlock(&context.memory->global_lock.mutex);
+    if (lock.type == SHM_LOCK_TYPE_FUTEX) {
+        futex_unlock(context, lock);
+        return 0;
+    }
+    if (lock.type == SHM_LOCK_TYPE_MCS) {
+        mcs_unlock(context, lock);
+        return 0;
+    }
+    if (lock.type == SHM_LOCK_TYPE_RWLOCK) {
+        rw_write_unlock(lock);
+    }
+    lock.owner = -1;
+    res = pthread_mutex_unlock(&lock.mutex);
     if (res != 0) {
         printf("%s %s: pid: %d w_lock() failed.\n", __FILE__, __func__, getpid());
     }
     return res;
 }
 
+int shm_lock::attach_process(context &context) {
+    pid_t pid = current_pid();
+    if (context.process_pid == pid) {
+        return 0;
+    }
+    int res = claim_process(context, pid);
+    if (res == 0) {
+        uint32_t limit;
+        while ((limit = context.memory->process_limit) <= (uint32_t)context.process_index &&
+               !__sync_bool_compare_and_swap(&context.memory->process_limit, limit,
+                                             (uint32_t)context.process_index + 1)) {
+        }
+    }
+    return res;
+}
+
+int shm_lock::claim_process(context &context, pid_t pid) {
+    // a forked child must not queue on the node of its parent
+    context.process_index = -1;
+    context.process_pid = 0;
+    for (uint32_t index = 0; index < SHM_MAX_PROCESSES; ++index) {
+        process_slot &slot = context.processes[index];
+        if (slot.pid == 0 && __sync_bool_compare_and_swap(&slot.pid, 0, pid)) {
+            context.process_index = (int32_t)index;
+            context.process_pid = pid;
+            return 0;
+        }
+    }
+    // the slot of a dead process is reusable once nobody can be queued behind its node and no combiner can still
+    // pick up its request
+    for (uint32_t index = 0; index < SHM_MAX_PROCESSES; ++index) {
+        process_slot &slot = context.processes[index];
+        pid_t old = slot.pid;
+        if (old != 0 && slot.node.busy == 0 && slot.request.state != SHM_COMBINE_PENDING && owner_dead(old) &&
+            __sync_bool_compare_and_swap(&slot.pid, old, pid)) {
+            slot.request.state = SHM_COMBINE_IDLE;
+            context.process_index = (int32_t)index;
+            context.process_pid = pid;
+            return 0;
+        }
+    }
+    printf("%s %s: pid: %d more than %d processes attached.\n", __FILE__, __func__, pid, SHM_MAX_PROCESSES);
+    return EUSERS;
+}
+
+void shm_lock::detach_process(context &context) {
+    if (context.process_index < 0 || context.process_pid != current_pid()) {
+        return;
+    }
+    process_slot &slot = context.processes[context.process_index];
+    if (slot.node.busy == 0) {
+        __sync_bool_compare_and_swap(&slot.pid, context.process_pid, 0);
+    }
+    context.process_index = -1;
+    context.process_pid = 0;
+}
+
 int shm_lock::file_lock(context &context, const config &config) {
     int res;
     if (context.lock_fd > 0) {
@@ -129,18 +213,18 @@ void shm_lock::file_unlock(context &context) {
     context.lock_fd = -1;
 }
 
-int shm_lock::handle_deadlock(context &context, const config &config, global_stats &global_stats) {
+int shm_lock::handle_deadlock(context &context, const config &config, memory_lock &lock, global_stats &global_stats) {
     int res;
     if ((res = file_lock(context, config)) != 0) {
         printf("%s %s: pid: %d file_lock() failed.\n", __FILE__, __func__, getpid());
         return res;
     }
-    printf("%s %s: pid: %d memset mutex.\n", __FILE__, __func__, getpid());
-    shm_hashtable::ht_clear(context, global_stats);
-    memset(&context.memory->global_lock.mutex, 0, sizeof(pthread_mutex_t));
-    res = lock_init(context);
+    printf("%s %s: pid: %d memset mutex of shard %d.\n", __FILE__, __func__, getpid(), lock.shard_id);
+    repair_shard(context, config, lock, global_stats);
+    memset(&lock.mutex, 0, sizeof(pthread_mutex_t));
+    res = lock_init(lock, lock.type, lock.shard_id);
     if (res == 0) {
-        ++global_stats.unlock_deadlock;
+        __sync_add_and_fetch(&global_stats.unlock_deadlock, 1);
         printf("%s %s: pid: %d unlock deadlock.\n", __FILE__, __func__, getpid());
     } else {
         printf("%s %s: pid: %d handle deadlock failed.\n", __FILE__, __func__, getpid());
@@ -154,6 +238,8 @@ int shm_lock::file_write_lock(const int fd) {
     struct flock lock;
     lock.l_type = F_WRLCK;
     lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0;
     do {
         if ((res = fcntl(fd, F_SETLKW, &lock)) != 0) {
             res = (errno != 0 ? errno : ENOMEM);
@@ -162,3 +248,391 @@ int shm_lock::file_write_lock(const int fd) {
     } while (res == EINTR);
     return res;
 }
+
+int shm_lock::mutex_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats,
+                         bool read) {
+    int res;
+    __sync_add_and_fetch(read ? &global_stats.r_lock_total : &global_stats.w_lock_total, 1);
+    uint32_t interval = read ? config.try_r_lk_interval : config.try_w_lk_interval;
+    while (true) {
+        while ((res = pthread_mutex_trylock(&lock.mutex)) == EBUSY) {
+            __sync_add_and_fetch(read ? &global_stats.r_lock_retry : &global_stats.w_lock_retry, 1);
+            usleep(interval);
+        }
+        if (res != ENOTRECOVERABLE) {
+            break;
+        }
+        // somebody died while recovering the lock, nothing but a fresh mutex helps
+        __sync_add_and_fetch(&global_stats.detect_deadlock, 1);
+        handle_deadlock(context, config, lock, global_stats);
+    }
+    if (res == EOWNERDEAD) {
+        // the shard is repaired as soon as no reader is left inside, see check_repair()
+        __sync_add_and_fetch(&global_stats.detect_deadlock, 1);
+        printf("%s %s: pid: %d owner %d of shard %d died.\n", __FILE__, __func__, getpid(), lock.owner, lock.shard_id);
+        lock.dirty = 1;
+        if ((res = pthread_mutex_consistent(&lock.mutex)) != 0) {
+            printf("%s %s: pid: %d pthread_mutex_consistent() failed.\n", __FILE__, __func__, getpid());
+        }
+    }
+    if (res != 0) {
+        printf("%s %s: pid: %d error %d.\n", __FILE__, __func__, getpid(), res);
+    } else {
+        lock.owner = getpid();
+    }
+    return res;
+}
+
+int shm_lock::rw_read_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats) {
+    pid_t pid = getpid();
+    __sync_add_and_fetch(&global_stats.r_lock_total, 1);
+    uint32_t ticks = 0;
+    bool waiting = false;
+    while (true) {
+        int32_t slot = claim_reader_slot(lock, pid);
+        if (slot >= 0) {
+            // the slot is published before 'writer' is read, a writer publishes 'writer' before scanning slots
+            bool acquired = lock.writer == 0;
+            uint32_t grant = lock.reader_grant;
+            while (!acquired && grant > 0) {
+                acquired = __sync_bool_compare_and_swap(&lock.reader_grant, grant, grant - 1);
+                grant = lock.reader_grant;
+            }
+            if (acquired) {
+                context.reader_slot = slot;
+                break;
+            }
+            __sync_lock_release(&lock.readers[slot].pid);
+        }
+        if (!waiting) {
+            waiting = true;
+            __sync_add_and_fetch(&lock.readers_waiting, 1);
+        }
+        __sync_add_and_fetch(&global_stats.r_lock_retry, 1);
+        if (ticks < SHM_LOCK_DRAIN_YIELDS) {
+            sched_yield();
+        } else {
+            usleep(config.try_r_lk_interval);
+        }
+        ++ticks;
+        if (ticks == SHM_LOCK_DRAIN_YIELDS || ticks > config.detect_r_dl_ticks + SHM_LOCK_DRAIN_YIELDS) {
+            ticks = SHM_LOCK_DRAIN_YIELDS;
+            pid_t owner = lock.owner;
+            if (lock.writer != 0 && owner != -1 && owner_dead(owner)) {
+                // the writer died with 'writer' set, taking the robust mutex repairs the shard and clears it
+                if (write_lock(context, config, lock, global_stats) == 0) {
+                    write_unlock(context, lock);
+                }
+            }
+        }
+    }
+    if (waiting && __sync_sub_and_fetch(&lock.readers_waiting, 1) < 0) {
+        __sync_bool_compare_and_swap(&lock.readers_waiting, -1, 0);
+    }
+    return 0;
+}
+
+int shm_lock::rw_write_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats) {
+    int res;
+    if ((res = mutex_lock(context, config, lock, global_stats, false)) != 0) {
+        return res;
+    }
+    __sync_fetch_and_or(&lock.writer, 1);
+    uint32_t ticks = 0;
+    while (true) {
+        // waiting readers granted by the last writer may still join, but only until the grant is used up
+        if (!readers_present(lock) && (lock.reader_grant == 0 || lock.readers_waiting <= 0)) {
+            __sync_lock_test_and_set(&lock.reader_grant, 0);
+            if (!readers_present(lock)) {
+                break;
+            }
+            continue;
+        }
+        __sync_add_and_fetch(&global_stats.w_lock_retry, 1);
+        // readers leave within one read_data(), yield to them before falling back to sleep
+        if (ticks < SHM_LOCK_DRAIN_YIELDS) {
+            sched_yield();
+        } else {
+            usleep(config.try_w_lk_interval);
+        }
+        ++ticks;
+        if (ticks > config.detect_w_dl_ticks + SHM_LOCK_DRAIN_YIELDS) {
+            ticks = 0;
+            lock.reader_grant = 0;
+            lock.readers_waiting = 0;
+            uint32_t reaped = reap_dead_readers(lock);
+            if (reaped > 0) {
+                __sync_add_and_fetch(&global_stats.detect_deadlock, reaped);
+                __sync_add_and_fetch(&global_stats.unlock_deadlock, reaped);
+                printf("%s %s: pid: %d reap %u dead reader(s).\n", __FILE__, __func__, getpid(), reaped);
+            }
+        }
+    }
+    return 0;
+}
+
+void shm_lock::rw_write_unlock(memory_lock &lock) {
+    int32_t waiting = lock.readers_waiting;
+    lock.reader_grant = waiting > 0 ? std::min((uint32_t)waiting, (uint32_t)SHM_LOCK_READER_BATCH) : 0;
+    __sync_fetch_and_and(&lock.writer, 0);
+}
+
+int shm_lock::futex_lock(const config &config, memory_lock &lock, global_stats &global_stats, bool read) {
+    __sync_add_and_fetch(read ? &global_stats.r_lock_total : &global_stats.w_lock_total, 1);
+    auto pid = (uint32_t)getpid();
+    // spin a little longer than it took the last times, owners usually leave within one memcpy
+    uint32_t max_spin = std::min((uint32_t)SHM_LOCK_MAX_SPIN, lock.spins * 2 + 10);
+    uint32_t spin = 0;
+    for (; spin < max_spin; ++spin) {
+        if (lock.futex == 0 && __sync_bool_compare_and_swap(&lock.futex, 0, pid)) {
+            break;
+        }
+        SHM_CPU_PAUSE();
+    }
+    lock.spins = (uint32_t)((int32_t)lock.spins + ((int32_t)spin - (int32_t)lock.spins) / 8);
+    if (spin < max_spin) {
+        if (spin > 0) {
+            __sync_add_and_fetch(&global_stats.futex_spin, 1);
+        }
+        lock.owner = (pid_t)pid;
+        return 0;
+    }
+    uint64_t timeout_us = (uint64_t)(read ? config.try_r_lk_interval : config.try_w_lk_interval) *
+                          (read ? config.detect_r_dl_ticks : config.detect_w_dl_ticks);
+    timespec timeout{(time_t)(timeout_us / 1000000), (long)(timeout_us % 1000000 * 1000)};
+    while (true) {
+        uint32_t value = lock.futex;
+        if (value == 0) {
+            // others may still be parked, keep the flag so that our unlock wakes the next one
+            if (__sync_bool_compare_and_swap(&lock.futex, 0, pid | SHM_LOCK_FUTEX_WAITERS)) {
+                break;
+            }
+            continue;
+        }
+        if ((value & SHM_LOCK_FUTEX_WAITERS) == 0 &&
+            !__sync_bool_compare_and_swap(&lock.futex, value, value | SHM_LOCK_FUTEX_WAITERS)) {
+            continue;
+        }
+        __sync_add_and_fetch(read ? &global_stats.r_lock_retry : &global_stats.w_lock_retry, 1);
+        __sync_add_and_fetch(&global_stats.futex_park, 1);
+        if (syscall(SYS_futex, &lock.futex, FUTEX_WAIT, value | SHM_LOCK_FUTEX_WAITERS, &timeout, nullptr, 0) != 0 &&
+            errno == ETIMEDOUT) {
+            // the owner pid lives in the futex word itself, so a dead owner is taken over atomically
+            value = lock.futex;
+            auto owner = (pid_t)(value & ~SHM_LOCK_FUTEX_WAITERS);
+            if (owner != 0 && owner_dead(owner) &&
+                __sync_bool_compare_and_swap(&lock.futex, value, pid | SHM_LOCK_FUTEX_WAITERS)) {
+                __sync_add_and_fetch(&global_stats.detect_deadlock, 1);
+                printf("%s %s: pid: %d owner %d of shard %d died.\n", __FILE__, __func__, getpid(), owner,
+                       lock.shard_id);
+                lock.dirty = 1;
+                break;
+            }
+        }
+    }
+    lock.owner = (pid_t)pid;
+    return 0;
+}
+
+void shm_lock::futex_unlock(context &context, memory_lock &lock) {
+    lock.owner = -1;
+    uint32_t value = lock.futex;
+    if ((value & SHM_LOCK_FUTEX_WAITERS) == 0 && __sync_bool_compare_and_swap(&lock.futex, value, 0)) {
+        return;
+    }
+    __sync_lock_release(&lock.futex);
+    syscall(SYS_futex, &lock.futex, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+    __sync_add_and_fetch(&context.memory->global_stats.futex_wake, 1);
+}
+
+int shm_lock::mcs_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats,
+                       bool read) {
+    int res;
+    __sync_add_and_fetch(read ? &global_stats.r_lock_total : &global_stats.w_lock_total, 1);
+    if ((res = attach_process(context)) != 0) {
+        return res;
+    }
+    auto me = (uint32_t)context.process_index + 1;
+    mcs_node &node = context.processes[context.process_index].node;
+    node.next = 0;
+    node.prev = 0;
+    node.locked = 1;
+    node.parked = 0;
+    node.busy = 1;
+    __sync_synchronize();
+    // a process killed between the exchange and publishing 'prev' stalls the queue, the window is two stores
+    uint32_t prev = __sync_lock_test_and_set(&lock.tail, me);
+    if (prev == 0) {
+        node.locked = 0;
+        lock.owner = context.process_pid;
+        return 0;
+    }
+    node.prev_pid = context.processes[prev - 1].pid;
+    node.prev = prev;
+    __sync_synchronize();
+    context.processes[prev - 1].node.next = me;
+    uint32_t max_spin = std::min((uint32_t)SHM_LOCK_MAX_SPIN, lock.spins * 2 + 10);
+    uint32_t spin = 0;
+    for (; spin < max_spin && node.locked != 0; ++spin) {
+        SHM_CPU_PAUSE();
+    }
+    lock.spins = (uint32_t)((int32_t)lock.spins + ((int32_t)spin - (int32_t)lock.spins) / 8);
+    if (node.locked == 0) {
+        __sync_add_and_fetch(&global_stats.mcs_spin, 1);
+        lock.owner = context.process_pid;
+        return 0;
+    }
+    uint64_t timeout_us = (uint64_t)(read ? config.try_r_lk_interval : config.try_w_lk_interval) *
+                          (read ? config.detect_r_dl_ticks : config.detect_w_dl_ticks);
+    timespec timeout{(time_t)(timeout_us / 1000000), (long)(timeout_us % 1000000 * 1000)};
+    while (true) {
+        node.parked = 1;
+        __sync_synchronize();
+        if (node.locked == 0) {
+            break;
+        }
+        __sync_add_and_fetch(read ? &global_stats.r_lock_retry : &global_stats.w_lock_retry, 1);
+        __sync_add_and_fetch(&global_stats.mcs_park, 1);
+        if (syscall(SYS_futex, &node.locked, FUTEX_WAIT, 1, &timeout, nullptr, 0) == 0 || errno != ETIMEDOUT ||
+            node.locked == 0) {
+            continue;
+        }
+        // walk back over dead waiters, the lock is stuck at the first dead node it was handed to
+        uint32_t id = node.prev;
+        pid_t pid = node.prev_pid;
+        while (id != 0 && owner_dead(pid) && context.processes[id - 1].node.locked != 0) {
+            pid = context.processes[id - 1].node.prev_pid;
+            id = context.processes[id - 1].node.prev;
+        }
+        if (id == 0 || !owner_dead(pid)) {
+            continue;
+        }
+        __sync_add_and_fetch(&global_stats.detect_deadlock, 1);
+        printf("%s %s: pid: %d owner %d of shard %d died.\n", __FILE__, __func__, getpid(), pid, lock.shard_id);
+        // a process that died before it took over the owner field has not touched the shard
+        if (lock.owner == pid) {
+            lock.dirty = 1;
+        }
+        // nobody is queued behind the dead nodes any more, their slots may be reclaimed
+        for (uint32_t dead = node.prev; dead != id;) {
+            mcs_node &gone = context.processes[dead - 1].node;
+            dead = gone.prev;
+            gone.busy = 0;
+        }
+        context.processes[id - 1].node.busy = 0;
+        node.locked = 0;
+        break;
+    }
+    lock.owner = context.process_pid;
+    return 0;
+}
+
+void shm_lock::mcs_unlock(context &context, memory_lock &lock) {
+    lock.owner = -1;
+    auto me = (uint32_t)context.process_index + 1;
+    mcs_node &node = context.processes[context.process_index].node;
+    if (node.next == 0) {
+        if (__sync_bool_compare_and_swap(&lock.tail, me, 0)) {
+            node.busy = 0;
+            return;
+        }
+        // the successor swapped the tail but has not linked itself to us yet
+        for (uint32_t ticks = 0; node.next == 0; ++ticks) {
+            if (ticks < SHM_LOCK_MAX_SPIN) {
+                SHM_CPU_PAUSE();
+                continue;
+            }
+            sched_yield();
+            uint32_t next;
+            if (ticks % SHM_LOCK_DRAIN_YIELDS == 0 && (next = find_unlinked(context, me)) != 0) {
+                node.next = next;
+            }
+        }
+    }
+    // hand the lock over directly, the successor is the only one that wakes up
+    mcs_node &next = context.processes[node.next - 1].node;
+    next.locked = 0;
+    __sync_synchronize();
+    if (next.parked != 0) {
+        syscall(SYS_futex, &next.locked, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+        __sync_add_and_fetch(&context.memory->global_stats.mcs_wake, 1);
+    }
+    node.busy = 0;
+}
+
+uint32_t shm_lock::find_unlinked(context &context, uint32_t id) {
+    // a successor that died after queueing but before linking itself never sets our 'next'
+    for (uint32_t index = 0; index < context.memory->process_limit; ++index) {
+        const process_slot &slot = context.processes[index];
+        if (index + 1 != id && slot.node.busy != 0 && slot.node.prev == id && owner_dead(slot.pid)) {
+            return index + 1;
+        }
+    }
+    return 0;
+}
+
+int32_t shm_lock::claim_reader_slot(memory_lock &lock, pid_t pid) {
+    auto first = (uint32_t)pid % SHM_LOCK_READER_SLOTS;
+    for (uint32_t i = 0; i < SHM_LOCK_READER_SLOTS; ++i) {
+        uint32_t slot = (first + i) % SHM_LOCK_READER_SLOTS;
+        if (lock.readers[slot].pid == 0 && __sync_bool_compare_and_swap(&lock.readers[slot].pid, 0, pid)) {
+            return (int32_t)slot;
+        }
+    }
+    return -1;
+}
+
+bool shm_lock::readers_present(const memory_lock &lock) {
+    for (const auto &slot : lock.readers) {
+        if (slot.pid != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t shm_lock::reap_dead_readers(memory_lock &lock) {
+    uint32_t reaped = 0;
+    for (auto &slot : lock.readers) {
+        pid_t pid = slot.pid;
+        if (pid != 0 && owner_dead(pid) && __sync_bool_compare_and_swap(&slot.pid, pid, 0)) {
+            ++reaped;
+        }
+    }
+    return reaped;
+}
+
+pid_t shm_lock::current_pid() {
+    // getpid() is a system call, the pid is cached and refreshed in forked children
+    if (self_pid == 0) {
+        self_pid = getpid();
+        pthread_atfork(nullptr, nullptr, refresh_pid);
+    }
+    return self_pid;
+}
+
+void shm_lock::refresh_pid() { self_pid = getpid(); }
+
+bool shm_lock::owner_dead(pid_t pid) { return (kill(pid, 0) != 0) && (errno == ESRCH || errno == ENOENT); }
+
+int shm_lock::repair_shard(context &context, const config &config, memory_lock &lock, global_stats &global_stats) {
+    // the global lock guards no data, a shard is repaired from its entries instead of being cleared
+    if (lock.shard_id < 0) {
+        return 0;
+    }
+    shm_allocator::open_val_segment(context, config);
+    int kept = shm_hashtable::ht_repair(context, context.shards[lock.shard_id], global_stats);
+    printf("%s %s: pid: %d shard %d repaired, %d entries kept.\n", __FILE__, __func__, getpid(), lock.shard_id, kept);
+    return kept;
+}
+
+void shm_lock::check_repair(context &context, const config &config, memory_lock &lock, global_stats &global_stats) {
+    // called with nobody else inside, readers never modify the shard
+    if (lock.dirty == 0) {
+        return;
+    }
+    repair_shard(context, config, lock, global_stats);
+    // stays set if we die as well, the next owner repairs again
+    lock.dirty = 0;
+    __sync_add_and_fetch(&global_stats.unlock_deadlock, 1);
+}
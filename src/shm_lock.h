@@ -5,17 +5,46 @@
 
 class shm_lock {
 public:
-    static int lock_init(context &context);
-    static int read_lock(context &context, const config &config, global_stats &global_stats);
-    static int read_unlock(context &context);
-    static int write_lock(context &context, const config &config, global_stats &global_stats);
-    static int write_unlock(context &context);
+    static int lock_init(memory_lock &lock, uint32_t type, int32_t shard_id);
+    static int read_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats);
+    static int read_unlock(context &context, memory_lock &lock);
+    static int write_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats);
+    static int write_unlock(context &context, memory_lock &lock);
+    static int attach_process(context &context);
+    static void detach_process(context &context);
+    static bool owner_dead(pid_t pid);
+    static pid_t current_pid();
     static int file_lock(context &context, const config &config);
     static void file_unlock(context &context);
-    static int handle_deadlock(context &context, const config &config, global_stats &global_stats);
+    static int handle_deadlock(context &context, const config &config, memory_lock &lock, global_stats &global_stats);
 
 private:
     static inline int file_write_lock(int fd);
+    static inline int claim_process(context &context, pid_t pid);
+    static inline int mutex_lock(context &context, const config &config, memory_lock &lock,
+                                 global_stats &global_stats, bool read);
+    static inline int rw_read_lock(context &context, const config &config, memory_lock &lock,
+                                   global_stats &global_stats);
+    static inline int rw_write_lock(context &context, const config &config, memory_lock &lock,
+                                    global_stats &global_stats);
+    static inline void rw_write_unlock(memory_lock &lock);
+    static inline int futex_lock(const config &config, memory_lock &lock, global_stats &global_stats, bool read);
+    static inline void futex_unlock(context &context, memory_lock &lock);
+    static inline int mcs_lock(context &context, const config &config, memory_lock &lock, global_stats &global_stats,
+                               bool read);
+    static inline void mcs_unlock(context &context, memory_lock &lock);
+    static inline uint32_t find_unlinked(context &context, uint32_t id);
+    static inline int32_t claim_reader_slot(memory_lock &lock, pid_t pid);
+    static inline bool readers_present(const memory_lock &lock);
+    static inline uint32_t reap_dead_readers(memory_lock &lock);
+    static inline int repair_shard(context &context, const config &config, memory_lock &lock,
+                                   global_stats &global_stats);
+    static inline void check_repair(context &context, const config &config, memory_lock &lock,
+                                    global_stats &global_stats);
+    static void refresh_pid();
+
+private:
+    static pid_t self_pid;
 };
 
 #endif // SHMCACHE_SHM_LOCK_H
@@ -0,0 +1,169 @@
+#include "shm_swiss_index.h"
+#include "shm_hashtable.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+uint32_t shm_swiss_index::get_capacity(uint32_t max_key_count) {
+    // keep the load under 7/8 even when every entry of the shard is in, groups are a power of two for the probing
+    uint32_t lanes = max_key_count + max_key_count / 7 + SHM_GROUP_WIDTH;
+    uint32_t group_count = 1;
+    while (group_count * SHM_GROUP_WIDTH < lanes) {
+        group_count <<= 1;
+    }
+    return group_count * SHM_GROUP_WIDTH;
+}
+
+int64_t shm_swiss_index::find(context &context, const shard &shard, const key_info &key_info, uint32_t hash_code,
+                              uint32_t &position) {
+    char *base = context.ht_segment.item.base;
+    const index_group *groups = shard.hashtable.groups(base);
+    uint32_t mask = shard.hashtable.capacity / SHM_GROUP_WIDTH - 1;
+    uint64_t mixed = mix(hash_code);
+    auto tag = (uint8_t)(mixed >> 57);
+    auto group_index = (uint32_t)(mixed >> 32) & mask;
+    // the lock free reader runs this too: slots are checked before use and the probe length is bounded
+    for (uint32_t step = 0; step <= mask; ++step) {
+        const index_group &group = groups[group_index];
+        for (uint32_t hits = match(group, tag); hits != 0; hits &= hits - 1) {
+            auto lane = (uint32_t)__builtin_ctz(hits);
+            int64_t entry_offset = entry_offset_of(shard, group.slot[lane]);
+            if (entry_offset > 0 &&
+                shm_hashtable::same_key(context, (hash_entry *)(base + entry_offset), key_info, hash_code)) {
+                position = group_index * SHM_GROUP_WIDTH + lane;
+                return entry_offset;
+            }
+        }
+        if (match(group, SHM_CTRL_EMPTY) != 0) {
+            return 0;
+        }
+        group_index = (group_index + step + 1) & mask;
+    }
+    return 0;
+}
+
+bool shm_swiss_index::locate(context &context, const shard &shard, uint32_t hash_code, int64_t entry_offset,
+                             uint32_t &position) {
+    const index_group *groups = shard.hashtable.groups(context.ht_segment.item.base);
+    uint32_t mask = shard.hashtable.capacity / SHM_GROUP_WIDTH - 1;
+    uint64_t mixed = mix(hash_code);
+    auto tag = (uint8_t)(mixed >> 57);
+    auto group_index = (uint32_t)(mixed >> 32) & mask;
+    uint32_t slot = slot_of(shard, entry_offset);
+    for (uint32_t step = 0; step <= mask; ++step) {
+        const index_group &group = groups[group_index];
+        for (uint32_t hits = match(group, tag); hits != 0; hits &= hits - 1) {
+            auto lane = (uint32_t)__builtin_ctz(hits);
+            if (group.slot[lane] == slot) {
+                position = group_index * SHM_GROUP_WIDTH + lane;
+                return true;
+            }
+        }
+        if (match(group, SHM_CTRL_EMPTY) != 0) {
+            return false;
+        }
+        group_index = (group_index + step + 1) & mask;
+    }
+    return false;
+}
+
+bool shm_swiss_index::insert(context &context, shard &shard, uint32_t hash_code, int64_t entry_offset) {
+    index_group *groups = shard.hashtable.groups(context.ht_segment.item.base);
+    uint32_t mask = shard.hashtable.capacity / SHM_GROUP_WIDTH - 1;
+    uint64_t mixed = mix(hash_code);
+    auto group_index = (uint32_t)(mixed >> 32) & mask;
+    for (uint32_t step = 0; step <= mask; ++step) {
+        index_group &group = groups[group_index];
+        uint32_t frees = match_free(group);
+        if (frees != 0) {
+            auto lane = (uint32_t)__builtin_ctz(frees);
+            if (group.ctrl[lane] == SHM_CTRL_DELETED) {
+                --shard.hashtable.deleted;
+            }
+            group.slot[lane] = slot_of(shard, entry_offset);
+            __sync_synchronize();
+            group.ctrl[lane] = (uint8_t)(mixed >> 57);
+            return true;
+        }
+        group_index = (group_index + step + 1) & mask;
+    }
+    return false;
+}
+
+void shm_swiss_index::assign(context &context, shard &shard, uint32_t position, int64_t entry_offset) {
+    index_group &group = shard.hashtable.groups(context.ht_segment.item.base)[position / SHM_GROUP_WIDTH];
+    group.slot[position % SHM_GROUP_WIDTH] = slot_of(shard, entry_offset);
+}
+
+void shm_swiss_index::erase(context &context, shard &shard, uint32_t position) {
+    index_group &group = shard.hashtable.groups(context.ht_segment.item.base)[position / SHM_GROUP_WIDTH];
+    // a group that still has an empty lane never was full, so no probe went past it and no tombstone is needed
+    if (match(group, SHM_CTRL_EMPTY) != 0) {
+        group.ctrl[position % SHM_GROUP_WIDTH] = SHM_CTRL_EMPTY;
+    } else {
+        group.ctrl[position % SHM_GROUP_WIDTH] = SHM_CTRL_DELETED;
+        ++shard.hashtable.deleted;
+    }
+}
+
+void shm_swiss_index::reserve(context &context, shard &shard) {
+    if (shard.hashtable.inserted + shard.hashtable.deleted >= shard.hashtable.capacity - shard.hashtable.capacity / 8) {
+        rebuild(context, shard);
+    }
+}
+
+void shm_swiss_index::rebuild(context &context, shard &shard) {
+    char *base = context.ht_segment.item.base;
+    uint32_t inserted = shard.hashtable.inserted;
+    shard.hashtable.reset(base);
+    shard.hashtable.inserted = inserted;
+    // every indexed entry is on the lru list
+    int64_t cursor = shard.busy_list.fake_entry.lru_next;
+    while (cursor != shard.busy_list.offset_f2base) {
+        auto *entry = (hash_entry *)(base + cursor);
+        insert(context, shard, entry->hash_code, cursor);
+        cursor = entry->lru_next;
+    }
+}
+
+uint64_t shm_swiss_index::mix(uint32_t hash_code) {
+    // the high half picks the group, the top 7 bits are the tag
+    return (uint64_t)hash_code * 0x9e3779b97f4a7c15ull;
+}
+
+uint32_t shm_swiss_index::match(const index_group &group, uint8_t tag) {
+#if defined(__SSE2__)
+    __m128i ctrl = _mm_load_si128((const __m128i *)group.ctrl);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag))) & SHM_GROUP_LANES;
+#else
+    uint32_t hits = 0;
+    for (uint32_t lane = 0; lane < SHM_GROUP_WIDTH; ++lane) {
+        hits |= (uint32_t)(group.ctrl[lane] == tag) << lane;
+    }
+    return hits;
+#endif
+}
+
+uint32_t shm_swiss_index::match_free(const index_group &group) {
+    // empty and deleted are the only control bytes with the high bit set
+#if defined(__SSE2__)
+    return (uint32_t)_mm_movemask_epi8(_mm_load_si128((const __m128i *)group.ctrl)) & SHM_GROUP_LANES;
+#else
+    uint32_t frees = 0;
+    for (uint32_t lane = 0; lane < SHM_GROUP_WIDTH; ++lane) {
+        frees |= (uint32_t)(group.ctrl[lane] >> 7) << lane;
+    }
+    return frees;
+#endif
+}
+
+int64_t shm_swiss_index::entry_offset_of(const shard &shard, uint32_t slot) {
+    if (slot >= shard.entry_queue.capacity) {
+        return 0;
+    }
+    return shard.entry_queue.offset_2base + (int64_t)sizeof(hash_entry) * slot;
+}
+
+uint32_t shm_swiss_index::slot_of(const shard &shard, int64_t entry_offset) {
+    return (uint32_t)((entry_offset - shard.entry_queue.offset_2base) / (int64_t)sizeof(hash_entry));
+}
@@ -0,0 +1,33 @@
+#ifndef SHMCACHE_SHM_SWISS_INDEX_H
+#define SHMCACHE_SHM_SWISS_INDEX_H
+
+#include "common_types.h"
+
+// open addressing index of a shard (index_type = swiss), used instead of the bucket chains: a lookup compares the
+// control bytes of a group (one cache line) in one go and only visits entries whose 7 bit tag matches, so it usually
+// reads one group and one hash entry. Lanes of deleted entries become tombstones until rebuild() drops them.
+class shm_swiss_index {
+public:
+    static uint32_t get_capacity(uint32_t max_key_count);
+    // offset of the entry holding the key or 0, 'position' is the lane pointing at it
+    static int64_t find(context &context, const shard &shard, const key_info &key_info, uint32_t hash_code,
+                        uint32_t &position);
+    // lane pointing at the given entry, without reading its key
+    static bool locate(context &context, const shard &shard, uint32_t hash_code, int64_t entry_offset,
+                       uint32_t &position);
+    static bool insert(context &context, shard &shard, uint32_t hash_code, int64_t entry_offset);
+    static void assign(context &context, shard &shard, uint32_t position, int64_t entry_offset);
+    static void erase(context &context, shard &shard, uint32_t position);
+    // makes sure the next insert() finds a free lane close to its home group
+    static void reserve(context &context, shard &shard);
+    static void rebuild(context &context, shard &shard);
+
+private:
+    static uint64_t mix(uint32_t hash_code);
+    static uint32_t match(const index_group &group, uint8_t tag);
+    static uint32_t match_free(const index_group &group);
+    static int64_t entry_offset_of(const shard &shard, uint32_t slot);
+    static uint32_t slot_of(const shard &shard, int64_t entry_offset);
+};
+
+#endif // SHMCACHE_SHM_SWISS_INDEX_H
@@ -0,0 +1,183 @@
+#include "../src/shm_cache.h"
+#include "bench_common.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <linux/perf_event.h>
+#include <random>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+const char *BENCH_CONF = "/tmp/cache.batch.conf";
+const char *BENCH_FILE = "/tmp/shmcache_batch";
+const uint32_t VALUE_SIZE = 64;
+const uint32_t LOOKUPS = 1u << 20;
+const uint32_t BATCH = 32;
+// the largest set leaves the chains and the blocks far out of the last level cache
+const vector<uint32_t> KEY_COUNTS = {1000, 16000, 256000};
+
+struct result {
+    double ns;
+    double misses;
+    uint32_t failed;
+};
+
+int open_counter();
+result run(shm_cache &cache, vector<string> &keys, const vector<uint32_t> &order, uint32_t batch, int counter);
+double write_ns(shm_cache &cache, vector<string> &keys, uint32_t first, uint32_t last, string &value, uint32_t batch);
+
+int main() {
+    int counter = open_counter();
+    printf("%u random lookups of %u byte values, %u keys per multi_get(), misses are last level cache misses\n",
+           LOOKUPS, VALUE_SIZE, BATCH);
+    printf("%-10s%14s%14s%16s%16s%10s\n", "keys", "get ns/key", "multi ns/key", "get miss/key", "multi miss/key",
+           "speedup");
+    string value(VALUE_SIZE, 'v');
+    vector<string> lines;
+    for (uint32_t key_count : KEY_COUNTS) {
+        // every value takes a block of its own, a page at least, and each shard a segment of its own
+        if (!write_conf(BENCH_CONF, {{"filename", BENCH_FILE},
+                                     {"max_mem_mb", to_string((uint64_t)key_count * 2 * 4096 / 1024 / 1024 + 512)},
+                                     {"segment_size", "32M"},
+                                     {"block_size", "4K"},
+                                     {"max_key_count", to_string(key_count * 2)},
+                                     {"lock_type", "rwlock"},
+                                     {"optimistic_get", "true"},
+                                     {"shard_count", "16"}})) {
+            printf("write %s failed.\n", BENCH_CONF);
+            break;
+        }
+        shm_cache cache;
+        if (cache.init(BENCH_CONF, true, true) != 0) {
+            printf("cache init failed.\n");
+            break;
+        }
+        vector<string> keys;
+        keys.reserve(key_count);
+        for (uint32_t i = 0; i < key_count; ++i) {
+            keys.push_back("batch_key_" + to_string(i + 1));
+        }
+        // the first pass creates the segments, then one half of the keys is overwritten key by key and the other
+        // half through the vectored call
+        write_ns(cache, keys, 0, key_count, value, BATCH);
+        double set_ns = write_ns(cache, keys, 0, key_count / 2, value, 1);
+        double multi_set_ns = write_ns(cache, keys, key_count / 2, key_count, value, BATCH);
+        mt19937 gen(key_count);
+        vector<uint32_t> order(LOOKUPS);
+        for (auto &number : order) {
+            number = (uint32_t)(gen() % key_count);
+        }
+        result single = run(cache, keys, order, 1, counter);
+        result batched = run(cache, keys, order, BATCH, counter);
+        string no_value;
+        double del_ns = write_ns(cache, keys, 0, key_count / 2, no_value, 1);
+        double multi_del_ns = write_ns(cache, keys, key_count / 2, key_count, no_value, BATCH);
+        cache.remove();
+        char line[256];
+        snprintf(line, sizeof(line), "%-10u%14.1f%14.1f%14.1f%14.1f", key_count, set_ns, multi_set_ns, del_ns,
+                 multi_del_ns);
+        lines.emplace_back(line);
+        char single_misses[32] = "n/a", batched_misses[32] = "n/a";
+        if (counter >= 0) {
+            snprintf(single_misses, sizeof(single_misses), "%.2f", single.misses);
+            snprintf(batched_misses, sizeof(batched_misses), "%.2f", batched.misses);
+        }
+        printf("%-10u%14.1f%14.1f%16s%16s%9.2fx\n", key_count, single.ns, batched.ns, single_misses, batched_misses,
+               single.ns / batched.ns);
+        if (single.failed + batched.failed > 0) {
+            printf("%u single and %u batched lookups failed.\n", single.failed, batched.failed);
+        }
+    }
+    printf("\n%-10s%14s%14s%14s%14s\n", "keys", "set ns/key", "multi ns/key", "del ns/key", "multi ns/key");
+    for (auto &line : lines) {
+        printf("%s\n", line.c_str());
+    }
+    if (counter < 0) {
+        printf("no hardware cache counter available (perf_event_paranoid or a virtual machine), misses are n/a.\n");
+    } else {
+        close(counter);
+    }
+    return 0;
+}
+
+int open_counter() {
+    perf_event_attr attr{};
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+result run(shm_cache &cache, vector<string> &keys, const vector<uint32_t> &order, uint32_t batch, int counter) {
+    vector<key_info> key_batch(batch, key_info(0, nullptr));
+    vector<value_info> value_batch(batch, value_info(0, nullptr, 0, 0));
+    vector<int> results(batch);
+    vector<char> buffer((size_t)VALUE_SIZE * batch);
+    uint32_t failed = 0;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto begin = chrono::steady_clock::now();
+    for (uint32_t first = 0; first < LOOKUPS; first += batch) {
+        for (uint32_t i = 0; i < batch; ++i) {
+            string &key = keys[order[first + i]];
+            key_batch[i] = key_info((uint32_t)key.size(), &key[0]);
+            value_batch[i] = value_info(VALUE_SIZE, &buffer[(size_t)VALUE_SIZE * i], 0, 0);
+        }
+        if (batch == 1) {
+            results[0] = cache.get(key_batch[0], value_batch[0], 0);
+        } else {
+            cache.multi_get(key_batch.data(), value_batch.data(), results.data(), batch, 0);
+        }
+        for (uint32_t i = 0; i < batch; ++i) {
+            failed += results[i] != 0 || value_batch[i].length != VALUE_SIZE ? 1 : 0;
+        }
+    }
+    auto end = chrono::steady_clock::now();
+    uint64_t misses = 0;
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = 0;
+        }
+    }
+    return result{(double)chrono::duration_cast<chrono::nanoseconds>(end - begin).count() / LOOKUPS,
+                  (double)misses / LOOKUPS, failed};
+}
+
+double write_ns(shm_cache &cache, vector<string> &keys, uint32_t first, uint32_t last, string &value, uint32_t batch) {
+    // an empty value means delete
+    vector<key_info> key_batch(batch, key_info(0, nullptr));
+    vector<value_info> value_batch(batch, value_info((uint32_t)value.size(), &value[0], 0, 0));
+    vector<int> results(batch);
+    auto begin = chrono::steady_clock::now();
+    for (uint32_t cursor = first; cursor < last; cursor += batch) {
+        uint32_t size = min(batch, last - cursor);
+        for (uint32_t i = 0; i < size; ++i) {
+            key_batch[i] = key_info((uint32_t)keys[cursor + i].size(), &keys[cursor + i][0]);
+        }
+        if (batch == 1) {
+            results[0] = value.empty() ? cache.del(key_batch[0]) : cache.set(key_batch[0], value_batch[0]);
+        } else if (value.empty()) {
+            cache.multi_del(key_batch.data(), results.data(), size);
+        } else {
+            cache.multi_set(key_batch.data(), value_batch.data(), results.data(), size);
+        }
+        for (uint32_t i = 0; i < size; ++i) {
+            if (results[i] != 0) {
+                printf("%s of %s failed: %d.\n", value.empty() ? "del" : "set", keys[cursor + i].c_str(), results[i]);
+            }
+        }
+    }
+    auto end = chrono::steady_clock::now();
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end - begin).count() / max(last - first, 1u);
+}
@@ -0,0 +1,53 @@
+#ifndef SHMCACHE_BENCH_COMMON_H
+#define SHMCACHE_BENCH_COMMON_H
+
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// config keys a bench changes, in the order they are written behind the defaults they do not replace
+typedef std::vector<std::pair<std::string, std::string>> conf_overrides;
+
+// writes the config every bench starts from to 'path', with 'overrides' replacing or adding keys
+inline bool write_conf(const std::string &path, const conf_overrides &overrides) {
+    conf_overrides lines = {{"type", "mmap"},
+                            {"filename", "/tmp/shmcache_bench"},
+                            {"logdir", "/tmp"},
+                            {"recycle_valid", "true"},
+                            {"max_mem_mb", "256"},
+                            {"min_mem_mb", "0"},
+                            {"segment_size", "128M"},
+                            {"block_size", "128K"},
+                            {"max_key_size", "64"},
+                            {"max_key_count", "2000"},
+                            {"max_value_size", "1M"},
+                            {"try_r_lk_interval", "50"},
+                            {"try_w_lk_interval", "50"},
+                            {"detect_r_dl_ticks", "2000"},
+                            {"detect_w_dl_ticks", "2000"}};
+    for (auto &item : overrides) {
+        bool replaced = false;
+        for (auto &line : lines) {
+            if (line.first == item.first) {
+                line.second = item.second;
+                replaced = true;
+            }
+        }
+        if (!replaced) {
+            lines.push_back(item);
+        }
+    }
+    std::fstream conf;
+    conf.open(path, std::ios::out | std::ios::trunc);
+    if (!conf.is_open()) {
+        return false;
+    }
+    for (auto &line : lines) {
+        conf << line.first << " = " << line.second << "\n";
+    }
+    conf.close();
+    return true;
+}
+
+#endif // SHMCACHE_BENCH_COMMON_H
@@ -0,0 +1,137 @@
+#include "../src/shm_hashtable.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const vector<string> HASH_TYPES = {"simple", "wyhash", "crc32c"};
+const vector<uint32_t> BUCKET_TYPES = {SHM_BUCKET_TYPE_PRIME, SHM_BUCKET_TYPE_POW2, SHM_BUCKET_TYPE_FASTRANGE};
+const vector<uint32_t> KEY_SIZES = {8, 16, 32, 64, 128, 256};
+const uint32_t KEY_COUNT = 1u << 16;
+const uint32_t ROUNDS = 32;
+
+uint32_t hash_type_of(const string &name);
+double hash_ns(uint32_t hash_type, const vector<char> &keys, uint32_t key_size);
+double bucket_ns(uint32_t bucket_type);
+double bucket_ns(uint32_t bucket_type) {
+    hashtable table;
+    table.bucket_type = bucket_type;
+    table.capacity = shm_hashtable::get_capacity(KEY_COUNT, bucket_type);
+    table.bucket_shift = shm_hashtable::get_shift(bucket_type, table.capacity);
+    uint32_t bucket = 1;
+    auto begin = chrono::steady_clock::now();
+    for (uint32_t i = 0; i < KEY_COUNT * ROUNDS; ++i) {
+        bucket = shm_hashtable::bucket_of(table, bucket * 0x01000193u + i);
+    }
+    auto end = chrono::steady_clock::now();
+    if (bucket == 0x12345678u) {
+        printf("!");
+    }
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end - begin).count() / ((double)KEY_COUNT * ROUNDS);
+}
+
+vector<string> make_keys(const string &prefix, uint32_t count, uint32_t width);
+void print_quality(const string &title, const vector<string> &keys);
+
+int main() {
+    // throughput: the same keys hashed over and over, the checksum keeps the calls alive
+    printf("%-10s", "key size");
+    for (auto &name : HASH_TYPES) {
+        printf("%16s", (name + " ns/key").c_str());
+    }
+    printf("\n");
+    mt19937 gen(1);
+    for (uint32_t key_size : KEY_SIZES) {
+        vector<char> keys((size_t)key_size * KEY_COUNT);
+        for (auto &c : keys) {
+            c = (char)gen();
+        }
+        printf("%-10u", key_size);
+        for (auto &name : HASH_TYPES) {
+            printf("%16.2f", hash_ns(hash_type_of(name), keys, key_size));
+        }
+        printf("\n");
+    }
+
+    // range reduction alone, one dependent bucket_of() after another like a chain of lookups
+    printf("\n%-10s%16s%16s%16s\n", "bucket", "prime ns", "pow2 ns", "fastrange ns");
+    printf("%-10s", "");
+    for (uint32_t bucket_type : BUCKET_TYPES) {
+        printf("%16.2f", bucket_ns(bucket_type));
+    }
+    printf("\n");
+
+    // quality: longest chain and average chain walk for every bucket_type
+    printf("\n%-28s%-8s%18s%18s%18s\n", "keys", "hash", "prime max/avg", "pow2 max/avg", "fastrange max/avg");
+    print_quality("key_1..key_5000", make_keys("key_", 5000, 0));
+    print_quality("key_1..key_200000", make_keys("key_", 200000, 0));
+    print_quality("64b common prefix", make_keys(string(48, 'p') + ":", 100000, 64));
+    return 0;
+}
+
+uint32_t hash_type_of(const string &name) {
+    if (name == "wyhash") {
+        return SHM_HASH_TYPE_WYHASH;
+    }
+    if (name == "crc32c") {
+        return SHM_HASH_TYPE_CRC32C;
+    }
+    return SHM_HASH_TYPE_SIMPLE;
+}
+
+double hash_ns(uint32_t hash_type, const vector<char> &keys, uint32_t key_size) {
+    uint32_t checksum = 0;
+    auto begin = chrono::steady_clock::now();
+    for (uint32_t round = 0; round < ROUNDS; ++round) {
+        for (uint32_t i = 0; i < KEY_COUNT; ++i) {
+            checksum += shm_hashtable::hash_by(hash_type, keys.data() + (size_t)i * key_size, key_size);
+        }
+    }
+    auto end = chrono::steady_clock::now();
+    if (checksum == 0x12345678u) {
+        printf("!");
+    }
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end - begin).count() / ((double)KEY_COUNT * ROUNDS);
+}
+
+vector<string> make_keys(const string &prefix, uint32_t count, uint32_t width) {
+    vector<string> keys;
+    keys.reserve(count);
+    for (uint32_t i = 1; i <= count; ++i) {
+        string key = prefix + to_string(i);
+        if (key.size() < width) {
+            key.append(width - key.size(), '_');
+        }
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+void print_quality(const string &title, const vector<string> &keys) {
+    for (auto &name : HASH_TYPES) {
+        printf("%-28s%-8s", title.c_str(), name.c_str());
+        for (uint32_t bucket_type : BUCKET_TYPES) {
+            hashtable table;
+            table.bucket_type = bucket_type;
+            table.capacity = shm_hashtable::get_capacity((uint32_t)keys.size(), bucket_type);
+            table.bucket_shift = shm_hashtable::get_shift(bucket_type, table.capacity);
+            vector<uint32_t> loads(table.capacity, 0);
+            for (auto &key : keys) {
+                uint32_t hash = shm_hashtable::hash_by(hash_type_of(name), key.data(), (uint32_t)key.size());
+                ++loads[shm_hashtable::bucket_of(table, hash)];
+            }
+            // average number of entries compared by a successful lookup
+            uint64_t cost = 0;
+            uint32_t longest = 0;
+            for (uint32_t load : loads) {
+                cost += (uint64_t)load * (load + 1) / 2;
+                longest = max(longest, load);
+            }
+            printf("%10u%8.3f", longest, (double)cost / (double)keys.size());
+        }
+        printf("\n");
+    }
+}
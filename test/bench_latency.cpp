@@ -0,0 +1,182 @@
+#include "../src/shm_cache.h"
+#include "bench_common.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <wait.h>
+
+using namespace std;
+
+const char *BENCH_CONF = "/tmp/cache.latency.conf";
+const char *BENCH_FILE = "/tmp/shmcache_latency";
+const uint32_t MAX_KEY_SIZE = 64;
+const uint32_t VALUE_SIZE = 16 * 1024;
+const uint32_t KEY_COUNT = 1000;
+const uint32_t DURATION_MS = 2000;
+const uint32_t PROCESSES = 16;
+// one set for every SET_RATIO operations
+const uint32_t SET_RATIO = 4;
+const vector<string> LOCK_TYPES = {"mutex", "futex", "mcs"};
+
+struct sample {
+    uint32_t set;
+    uint32_t ns;
+};
+
+uint64_t now_ns();
+void run_worker(shm_cache &cache, char *key, char *value, int fd);
+bool run_workers(shm_cache &cache, char *key, char *value, vector<uint32_t> &get_ns, vector<uint32_t> &set_ns);
+double percentile(const vector<uint32_t> &sorted, double p);
+
+int main() {
+    char *const key = (char *)malloc(MAX_KEY_SIZE * KEY_COUNT);
+    memset(key, 0, MAX_KEY_SIZE * KEY_COUNT);
+    char *const value = (char *)malloc(VALUE_SIZE);
+    for (uint32_t i = 0; i < VALUE_SIZE; ++i) {
+        *(value + i) = (char)('a' + i % 26);
+    }
+    for (uint32_t i = 0; i < KEY_COUNT; ++i) {
+        string str = "key_" + to_string(i + 1);
+        memcpy(key + i * MAX_KEY_SIZE, str.data(), str.length());
+    }
+
+    vector<string> lines;
+    for (auto &lock_type : LOCK_TYPES) {
+        // a single shard and locked gets so that every process queues on the same lock
+        if (!write_conf(BENCH_CONF, {{"filename", BENCH_FILE},
+                                     {"block_size", "16K"},
+                                     {"max_key_count", to_string(KEY_COUNT * 2)},
+                                     {"shard_count", "1"},
+                                     {"lock_type", lock_type},
+                                     {"optimistic_get", "false"}})) {
+            printf("write %s failed.\n", BENCH_CONF);
+            break;
+        }
+        shm_cache cache;
+        if (cache.init(BENCH_CONF, true, true) != 0) {
+            printf("cache init failed.\n");
+            break;
+        }
+        for (uint32_t i = 0; i < KEY_COUNT; ++i) {
+            key_info key_tmp(key + i * MAX_KEY_SIZE);
+            value_info value_tmp(VALUE_SIZE, value, 1, 0);
+            int res = cache.set(key_tmp, value_tmp);
+            if (res != 0) {
+                printf("%d. set fail, errno: %d\n", i + 1, res);
+            }
+        }
+        vector<uint32_t> get_ns;
+        vector<uint32_t> set_ns;
+        if (!run_workers(cache, key, value, get_ns, set_ns)) {
+            printf("run workers failed.\n");
+        }
+        cache.remove();
+        for (auto *column : {&get_ns, &set_ns}) {
+            sort(column->begin(), column->end());
+            char line[256];
+            snprintf(line, sizeof(line), "%-8s%-6s%12.0f%10.1f%10.1f%10.1f%10.1f", lock_type.c_str(),
+                     column == &get_ns ? "get" : "set", (double)column->size() * 1000.0 / DURATION_MS,
+                     percentile(*column, 0.5), percentile(*column, 0.99), percentile(*column, 0.999),
+                     column->empty() ? 0.0 : column->back() / 1000.0);
+            lines.emplace_back(line);
+        }
+    }
+    printf("%u processes, %u%% sets, single shard, latency in us\n", PROCESSES, 100 / SET_RATIO);
+    printf("%-8s%-6s%12s%10s%10s%10s%10s\n", "lock", "op", "ops/s", "p50", "p99", "p999", "max");
+    for (auto &line : lines) {
+        printf("%s\n", line.c_str());
+    }
+    free(key);
+    free(value);
+    return 0;
+}
+
+uint64_t now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void run_worker(shm_cache &cache, char *key, char *value, int fd) {
+    std::mt19937 gen(getpid());
+    auto *val_str = (char *)malloc(VALUE_SIZE);
+    vector<sample> samples;
+    uint64_t end = now_ns() + (uint64_t)DURATION_MS * 1000000;
+    uint64_t begin;
+    uint64_t now;
+    do {
+        auto number = gen() % KEY_COUNT;
+        key_info key_tmp(key + number * MAX_KEY_SIZE);
+        bool set = gen() % SET_RATIO == 0;
+        begin = now_ns();
+        if (set) {
+            value_info val_tmp(VALUE_SIZE, value, 1, 0);
+            cache.set(key_tmp, val_tmp);
+        } else {
+            value_info val_tmp(VALUE_SIZE, val_str, 0, 0);
+            cache.get(key_tmp, val_tmp, 1);
+        }
+        now = now_ns();
+        samples.push_back({set ? 1u : 0u, (uint32_t)std::min(now - begin, (uint64_t)UINT32_MAX)});
+    } while (now < end);
+    free(val_str);
+    auto size = (ssize_t)(samples.size() * sizeof(sample));
+    if (write(fd, samples.data(), (size_t)size) != size) {
+        printf("pid: %d write() failed.\n", getpid());
+    }
+}
+
+bool run_workers(shm_cache &cache, char *key, char *value, vector<uint32_t> &get_ns, vector<uint32_t> &set_ns) {
+    // one pipe each, samples of a process arrive in one piece
+    vector<int> fds;
+    vector<pid_t> process;
+    fflush(stdout);
+    for (uint32_t i = 0; i < PROCESSES; ++i) {
+        int pair[2];
+        if (pipe(pair) != 0) {
+            break;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pair[0]);
+            run_worker(cache, key, value, pair[1]);
+            close(pair[1]);
+            exit(0);
+        }
+        close(pair[1]);
+        fds.push_back(pair[0]);
+        process.push_back(pid);
+    }
+    sample buffer[4096];
+    for (int fd : fds) {
+        ssize_t length;
+        size_t pending = 0;
+        while ((length = read(fd, (char *)buffer + pending, sizeof(buffer) - pending)) > 0) {
+            pending += (size_t)length;
+            size_t count = pending / sizeof(sample);
+            for (size_t i = 0; i < count; ++i) {
+                (buffer[i].set ? set_ns : get_ns).push_back(buffer[i].ns);
+            }
+            pending -= count * sizeof(sample);
+            memmove(buffer, (char *)buffer + count * sizeof(sample), pending);
+        }
+        close(fd);
+    }
+    for (pid_t pid : process) {
+        waitpid(pid, nullptr, 0);
+    }
+    return process.size() == PROCESSES;
+}
+
+double percentile(const vector<uint32_t> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    auto index = std::min((size_t)((double)sorted.size() * p), sorted.size() - 1);
+    return sorted[index] / 1000.0;
+}
@@ -0,0 +1,151 @@
+#include "../src/shm_cache.h"
+#include "bench_common.h"
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+#include <wait.h>
+
+using namespace std;
+
+const char *BENCH_CONF = "/tmp/cache.bench.conf";
+const char *BENCH_FILE = "/tmp/shmcache_bench";
+const uint32_t MAX_KEY_SIZE = 64;
+const uint32_t VALUE_SIZE = 64 * 1024;
+const uint32_t KEY_COUNT = 1000;
+const uint32_t DURATION_MS = 2000;
+const uint32_t LRU_K = 1;
+const vector<uint32_t> READERS = {1, 2, 4, 8};
+const vector<string> LOCK_TYPES = {"mutex", "rwlock", "futex", "mcs"};
+
+uint32_t rand_number(uint32_t min, uint32_t max);
+uint32_t delta_ms(timeval begin, timeval end);
+uint64_t rget(shm_cache &cache, char *key);
+double run_readers(shm_cache &cache, char *key, uint32_t readers);
+
+int main() {
+    char *const key = (char *)malloc(MAX_KEY_SIZE * KEY_COUNT);
+    memset(key, 0, MAX_KEY_SIZE * KEY_COUNT);
+    char *const value = (char *)malloc(VALUE_SIZE);
+    for (uint32_t i = 0; i < VALUE_SIZE; ++i) {
+        *(value + i) = (char)('a' + i % 26);
+    }
+    for (uint32_t i = 0; i < KEY_COUNT; ++i) {
+        string str = "key_" + to_string(i + 1);
+        memcpy(key + i * MAX_KEY_SIZE, str.data(), str.length());
+    }
+
+    printf("%-8s", "readers");
+    for (auto &lock_type : LOCK_TYPES) {
+        printf("%16s", (lock_type + " get/s").c_str());
+    }
+    printf("\n");
+    vector<vector<double>> result(LOCK_TYPES.size());
+    for (uint32_t t = 0; t < LOCK_TYPES.size(); ++t) {
+        // readers have to take the lock under test, an optimistic get would go around it
+        if (!write_conf(BENCH_CONF, {{"filename", BENCH_FILE},
+                                      {"max_key_count", to_string(KEY_COUNT * 2)},
+                                      {"lock_type", LOCK_TYPES[t]},
+                                      {"optimistic_get", "false"}})) {
+            printf("write %s failed.\n", BENCH_CONF);
+            break;
+        }
+        shm_cache cache;
+        if (cache.init(BENCH_CONF, true, true) != 0) {
+            printf("cache init failed.\n");
+            break;
+        }
+        for (uint32_t i = 0; i < KEY_COUNT; ++i) {
+            key_info key_tmp(key + i * MAX_KEY_SIZE);
+            value_info value_tmp(VALUE_SIZE, value, 1, 0);
+            int res = cache.set(key_tmp, value_tmp);
+            if (res != 0) {
+                printf("%d. set fail, errno: %d\n", i + 1, res);
+            }
+        }
+        for (uint32_t readers : READERS) {
+            result[t].push_back(run_readers(cache, key, readers));
+        }
+        cache.remove();
+    }
+    for (uint32_t r = 0; r < READERS.size(); ++r) {
+        printf("%-8u", READERS[r]);
+        for (auto &column : result) {
+            if (r < column.size()) {
+                printf("%16.0f", column[r]);
+            }
+        }
+        printf("\n");
+    }
+    free(key);
+    free(value);
+    return 0;
+}
+
+uint32_t rand_number(uint32_t min, uint32_t max) {
+    static std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<> uniform((int)min, (int)max);
+    return (uint32_t)uniform(gen);
+}
+
+uint32_t delta_ms(timeval begin, timeval end) {
+    return uint32_t((uint64_t)(end.tv_usec - begin.tv_usec) / 1000 + (uint64_t)(end.tv_sec - begin.tv_sec) * 1000);
+}
+
+uint64_t rget(shm_cache &cache, char *key) {
+    timeval begin;
+    timeval now;
+    auto *val_str = (char *)malloc(VALUE_SIZE);
+    value_info val_tmp(VALUE_SIZE, val_str, 0, 0);
+    uint64_t count = 0;
+    gettimeofday(&begin, nullptr);
+    do {
+        for (uint32_t i = 0; i < 64; ++i) {
+            auto number = rand_number(0u, KEY_COUNT - 1);
+            key_info key_tmp(key + number * MAX_KEY_SIZE);
+            if (cache.get(key_tmp, val_tmp, LRU_K) == 0) {
+                ++count;
+            }
+        }
+        gettimeofday(&now, nullptr);
+    } while (delta_ms(begin, now) < DURATION_MS);
+    free(val_str);
+    return count;
+}
+
+double run_readers(shm_cache &cache, char *key, uint32_t readers) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 0.0;
+    }
+    vector<pid_t> process;
+    fflush(stdout);
+    for (uint32_t i = 0; i < readers; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            uint64_t count = rget(cache, key);
+            if (write(fds[1], &count, sizeof(count)) != sizeof(count)) {
+                printf("pid: %d write() failed.\n", getpid());
+            }
+            close(fds[1]);
+            exit(0);
+        }
+        process.push_back(pid);
+    }
+    close(fds[1]);
+    uint64_t total = 0;
+    uint64_t count;
+    while (read(fds[0], &count, sizeof(count)) == sizeof(count)) {
+        total += count;
+    }
+    close(fds[0]);
+    for (pid_t pid : process) {
+        waitpid(pid, nullptr, 0);
+    }
+    return (double)total * 1000.0 / DURATION_MS;
+}
@@ -0,0 +1,167 @@
+#include "../src/shm_cache.h"
+#include "bench_common.h"
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+const char *BENCH_CONF = "/tmp/cache.view.conf";
+const char *BENCH_FILE = "/tmp/shmcache_view";
+const uint32_t KEY_COUNT = 16;
+const uint32_t ROUNDS = 200;
+const uint32_t RANGE_SIZE = 4096;
+const vector<uint32_t> VALUE_SIZES = {64 * 1024, 512 * 1024, 2 * 1024 * 1024, 4 * 1024 * 1024};
+
+bool same_value(const value_view &view, const string &value);
+double get_ns(shm_cache &cache, vector<string> &keys, uint32_t value_size, const string &how);
+bool long_chain();
+
+int main() {
+    if (!write_conf(BENCH_CONF, {{"filename", BENCH_FILE},
+                                 {"max_mem_mb", "512"},
+                                 {"block_size", "256K"},
+                                 {"max_key_count", to_string(KEY_COUNT * 4)},
+                                 {"max_value_size", "4M"},
+                                 {"lock_type", "rwlock"},
+                                 {"shard_count", "1"}})) {
+        printf("write %s failed.\n", BENCH_CONF);
+        return 1;
+    }
+    shm_cache cache;
+    if (cache.init(BENCH_CONF, true, true) != 0) {
+        printf("cache init failed.\n");
+        return 1;
+    }
+    vector<string> keys;
+    for (uint32_t i = 0; i < KEY_COUNT; ++i) {
+        keys.push_back("view_key_" + to_string(i + 1));
+    }
+    printf("%-12s%16s%16s%10s%18s\n", "value size", "get us/op", "get_view us/op", "speedup", "get_range us/op");
+    for (uint32_t value_size : VALUE_SIZES) {
+        string value(value_size, 'v');
+        for (auto &key : keys) {
+            key_info key_tmp((uint32_t)key.size(), &key[0]);
+            value_info value_tmp(value_size, &value[0], 0, 0);
+            if (cache.set(key_tmp, value_tmp) != 0) {
+                printf("set %s failed.\n", key.c_str());
+            }
+        }
+        double copy = get_ns(cache, keys, value_size, "get");
+        double in_place = get_ns(cache, keys, value_size, "get_view");
+        // the last RANGE_SIZE bytes, the worst case for the walk down the chain
+        double range = get_ns(cache, keys, value_size, "get_range");
+        printf("%-12u%16.1f%16.1f%9.1fx%18.1f\n", value_size, copy / 1000, in_place / 1000, copy / in_place,
+               range / 1000);
+    }
+
+    // a view keeps its blocks while the key is overwritten and deleted under it
+    string old_value(1024 * 1024, 'o');
+    string new_value(1024 * 1024, 'n');
+    key_info key_tmp((uint32_t)keys[0].size(), &keys[0][0]);
+    value_info old_tmp((uint32_t)old_value.size(), &old_value[0], 0, 0);
+    value_info new_tmp((uint32_t)new_value.size(), &new_value[0], 0, 0);
+    value_view view;
+    bool kept = cache.set(key_tmp, old_tmp) == 0 && cache.get_view(key_tmp, view, 0) == 0;
+    for (uint32_t i = 0; kept && i < 64; ++i) {
+        cache.set(key_tmp, new_tmp);
+        cache.del(key_tmp);
+    }
+    kept = kept && same_value(view, old_value);
+    printf("view kept over overwrites: %s, release: %d\n", kept ? "ok" : "FAILED", cache.release_view(view));
+    cache.remove();
+    printf("chain longer than the magazine: %s\n", long_chain() ? "ok" : "FAILED");
+    return 0;
+}
+
+bool long_chain() {
+    // one segment of 256 blocks, most of the free ones parked in our magazine when the 250 block value comes
+    if (!write_conf(BENCH_CONF, {{"filename", BENCH_FILE},
+                                 {"max_mem_mb", "1"},
+                                 {"segment_size", "1M"},
+                                 {"block_size", "4K"},
+                                 {"max_key_count", "256"},
+                                 {"max_value_size", "2M"},
+                                 {"lock_type", "rwlock"},
+                                 {"shard_count", "1"},
+                                 {"slab", "false"},
+                                 {"extent", "false"}})) {
+        return false;
+    }
+    shm_cache cache;
+    if (cache.init(BENCH_CONF, true, true) != 0) {
+        return false;
+    }
+    string big = "long_chain_key";
+    key_info big_key((uint32_t)big.size(), &big[0]);
+    string value(200 * 4000, 'c');
+    value_info value_tmp((uint32_t)value.size(), &value[0], 0, 0);
+    bool done = cache.set(big_key, value_tmp) == 0;
+    string small_value(200, 's');
+    value_info small_tmp((uint32_t)small_value.size(), &small_value[0], 0, 0);
+    for (uint32_t i = 0; i < 40; ++i) {
+        string key = "small_key_" + to_string(i);
+        key_info key_tmp((uint32_t)key.size(), &key[0]);
+        done = done && cache.set(key_tmp, small_tmp) == 0;
+    }
+    for (uint32_t i = 0; i < 40; ++i) {
+        string key = "small_key_" + to_string(i);
+        key_info key_tmp((uint32_t)key.size(), &key[0]);
+        done = done && cache.del(key_tmp) == 0;
+    }
+    done = done && cache.del(big_key) == 0;
+    value.assign(250 * 4000, 'l');
+    value_tmp = value_info((uint32_t)value.size(), &value[0], 0, 0);
+    done = done && cache.set(big_key, value_tmp) == 0;
+    vector<char> buffer(value.size());
+    value_info read_tmp((uint32_t)buffer.size(), buffer.data(), 0, 0);
+    done = done && cache.get(big_key, read_tmp, 0) == 0 && read_tmp.length == value.size() &&
+           memcmp(buffer.data(), value.data(), value.size()) == 0;
+    cache.remove();
+    return done;
+}
+
+bool same_value(const value_view &view, const string &value) {
+    size_t offset = 0;
+    for (auto &part : view.iov) {
+        if (offset + part.iov_len > value.size() || memcmp(part.iov_base, value.data() + offset, part.iov_len) != 0) {
+            return false;
+        }
+        offset += part.iov_len;
+    }
+    return offset == value.size() && view.length == value.size();
+}
+
+double get_ns(shm_cache &cache, vector<string> &keys, uint32_t value_size, const string &how) {
+    vector<char> buffer(value_size);
+    value_view view;
+    uint64_t checksum = 0;
+    auto begin = chrono::steady_clock::now();
+    for (uint32_t round = 0; round < ROUNDS; ++round) {
+        string &key = keys[round % KEY_COUNT];
+        key_info key_tmp((uint32_t)key.size(), &key[0]);
+        if (how == "get_view") {
+            // touch the last byte, like a parser that walks the value would
+            if (cache.get_view(key_tmp, view, 0) == 0) {
+                checksum += (uint8_t)((char *)view.iov.back().iov_base)[view.iov.back().iov_len - 1];
+                cache.release_view(view);
+            }
+        } else if (how == "get_range") {
+            value_info value_tmp(RANGE_SIZE, buffer.data(), 0, 0);
+            if (cache.get_range(key_tmp, value_tmp, value_size - RANGE_SIZE, RANGE_SIZE, 0) == 0) {
+                checksum += (uint8_t)buffer[value_tmp.length - 1];
+            }
+        } else {
+            value_info value_tmp(value_size, buffer.data(), 0, 0);
+            if (cache.get(key_tmp, value_tmp, 0) == 0) {
+                checksum += (uint8_t)buffer[value_tmp.length - 1];
+            }
+        }
+    }
+    auto end = chrono::steady_clock::now();
+    if (checksum != (uint64_t)'v' * ROUNDS) {
+        printf("%s: %u lookups failed.\n", how.c_str(), ROUNDS - (uint32_t)(checksum / 'v'));
+    }
+    return (double)chrono::duration_cast<chrono::nanoseconds>(end - begin).count() / ROUNDS;
+}
@@ -0,0 +1,79 @@
+#include "../src/shm_cache.h"
+#include "bench_common.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <wait.h>
+
+using namespace std;
+
+// built with SHM_CRASH_TEST, every case kills a process at one SHM_CRASH_POINT and checks what ht_repair() kept
+const char *CRASH_CONF = "/tmp/cache.crash.conf";
+const char *CRASH_FILE = "/tmp/shmcache_crash";
+
+bool set_in(const char *crash_at, const string &key, const string &value);
+bool replaced_in_lower_slot();
+
+int main() {
+    if (!write_conf(CRASH_CONF, {{"filename", CRASH_FILE},
+                                 {"max_mem_mb", "4"},
+                                 {"segment_size", "1M"},
+                                 {"block_size", "4K"},
+                                 {"max_key_count", "64"},
+                                 {"max_value_size", "64K"},
+                                 {"lock_type", "mutex"},
+                                 {"shard_count", "1"},
+                                 {"optimistic_get", "false"}})) {
+        printf("write %s failed.\n", CRASH_CONF);
+        return 1;
+    }
+    bool replaced = replaced_in_lower_slot();
+    printf("set dying between the replace and the free of a lower slot: %s\n", replaced ? "ok" : "FAILED");
+    return replaced ? 0 : 1;
+}
+
+// sets 'key' in a child process that dies at 'crash_at' with the shard lock held
+bool set_in(const char *crash_at, const string &key, const string &value) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        shm_cache cache;
+        if (cache.init(CRASH_CONF, false, true) != 0) {
+            _exit(1);
+        }
+        setenv("SHM_CRASH_AT", crash_at, 1);
+        key_info key_tmp((uint32_t)key.size(), (char *)key.data());
+        value_info value_tmp((uint32_t)value.size(), (char *)value.data(), 0, 0);
+        cache.set(key_tmp, value_tmp);
+        _exit(1);
+    }
+    int status = 0;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+bool replaced_in_lower_slot() {
+    shm_cache cache;
+    if (cache.init(CRASH_CONF, true, true) != 0) {
+        return false;
+    }
+    // 'freed_key' takes the first entry slot and 'crash_key' the second, the delete puts the first on the free stack
+    string freed = "freed_key";
+    string key = "crash_key";
+    string old_value(16, 'o');
+    key_info freed_tmp((uint32_t)freed.size(), &freed[0]);
+    key_info key_tmp((uint32_t)key.size(), &key[0]);
+    value_info old_tmp((uint32_t)old_value.size(), &old_value[0], 0, 0);
+    bool done = cache.set(freed_tmp, old_tmp) == 0 && cache.set(key_tmp, old_tmp) == 0 && cache.del(freed_tmp) == 0;
+    // the old value is inline and the new one is not, so the set takes a new entry in the freed first slot
+    string new_value(3 * 4096, 'n');
+    done = done && set_in("ht_set_replaced", key, new_value);
+    vector<char> buffer(new_value.size());
+    value_info read_tmp((uint32_t)buffer.size(), buffer.data(), 0, 0);
+    done = done && cache.get(key_tmp, read_tmp, 0) == 0 && read_tmp.length == new_value.size() &&
+           memcmp(buffer.data(), new_value.data(), new_value.size()) == 0;
+    value_info freed_read((uint32_t)buffer.size(), buffer.data(), 0, 0);
+    done = done && cache.get(freed_tmp, freed_read, 0) == ENOENT;
+    cache.remove();
+    return done;
+}
@@ -34,6 +34,8 @@ uint32_t delta_us(timeval begin, timeval end);
 void fset(shm_cache &cache, len_vector &key_len, len_vector &value_len, char *key, char *value);
 void rset(shm_cache &cache, len_vector &key_len, len_vector &value_len, char *key, char *value);
 void rget(shm_cache &cache, len_vector &key_len, char *key);
+char *alloc_value(uint32_t size, void *arg);
+void release_value(char *data, void *arg);
 void rdel(shm_cache &cache, len_vector &key_len, char *key);
 
 int main() {
@@ -147,23 +149,30 @@ void rget(shm_cache &cache, len_vector &key_len, char *key) {
     timeval begin;
     timeval end;
     gettimeofday(&now, nullptr);
-    auto *val_str = (char *)malloc(MAX_VALUE_SIZE);
-    memset(val_str, 0, MAX_VALUE_SIZE);
-    value_info val_tmp(MAX_VALUE_SIZE, val_str, 0, 0);
+    // every hit gets a buffer of its own size instead of one of MAX_VALUE_SIZE
+    value_allocator allocator{alloc_value, release_value, nullptr};
+    value_info val_tmp(0, nullptr, 0, 0);
     int64_t time_sum = 0;
     for (uint32_t count = 0; count < GET_TIMES; ++count) {
         auto number = rand_number(0u, KEY_COUNT - 1);
         key_info key_tmp(key_len[number % KEY_COUNT], key + (number % KEY_COUNT) * MAX_KEY_SIZE);
         usleep(rand_number(MIN_GET_SLEEP_TIME, MAX_GET_SLEEP_TIME));
         gettimeofday(&begin, nullptr);
-        cache.get(key_tmp, val_tmp, LRU_K);
+        int res = cache.get_alloc(key_tmp, val_tmp, allocator, LRU_K);
         gettimeofday(&end, nullptr);
         time_sum += delta_us(begin, end);
+        if (res == 0) {
+            release_value(val_tmp.data, nullptr);
+        }
     }
     gettimeofday(&now, nullptr);
     printf("pid: %d rand_get end, average = %f us.\n", getpid(), (float)time_sum / (float)(GET_TIMES));
 }
 
+char *alloc_value(uint32_t size, void * /*arg*/) { return (char *)malloc(std::max(size, 1u)); }
+
+void release_value(char *data, void * /*arg*/) { free(data); }
+
 void rdel(shm_cache &cache, len_vector &key_len, char *key) {
     timeval now;
     timeval begin;